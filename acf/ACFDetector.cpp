@@ -4,38 +4,83 @@
 
 #include <sstream>
 #include <chrono>
+#include <algorithm>
 #include <tbb/tbb.h>
-#include <matio.h>
 #include "../general/NonMaximumSuppression.h"
+#include "../general/LatencyStats.h"
+#include "../general/TraceRecorder.h"
+#include "../general/PerfCounters.h"
+#include "../general/Logger.h"
 
 #include "ACFDetector.h"
 #include "ACFFeaturePyramid.h"
 
 #define USE_TBB
 
-static inline void getChild(float *chns1, uint32_t *cids, uint32_t *fids,
-        float *thrs, uint32_t offset, uint32_t &k0, uint32_t &k) {
+static inline void getChild(const float *chns1, const uint32_t *cids,
+        const uint32_t *fids, const float *thrs, uint32_t offset, uint32_t &k0,
+        uint32_t &k) {
     float ftr = chns1[cids[fids[k]]];
     k = (ftr < thrs[k]) ? 1 : 2;
     k0 = k += k0 * 2;
     k += offset;
 }
 
+// 每帧开始时读取一次已发布的模型, 本帧始终使用该模型
+bool ACFDetector::updateModel() {
+    std::shared_ptr<const ACFModel> current = std::atomic_load(
+            &this->published_model);
+    if (current != this->model) {
+        ACF_LOG(Info) << "Switching detector model to " << current->path;
+        activateModel(current);
+    }
+    return this->model->isLoaded();
+}
+
+// 图像尺寸变化或切换模型后, 缓存的各层检测结果失效, 本帧需计算全部尺度
+bool ACFDetector::isCacheValid(cv::Size frame_size) const {
+    return frame_size == last_frame_size && !layer_detections.empty();
+}
+
 DetectionList ACFDetector::applyDetector(const cv::Mat &Frame) {
 
-    auto measure_time = std::chrono::high_resolution_clock::now();
+    if (!updateModel()) {
+        return DetectionList();
+    }
+
+    static LatencyHistogram &features_hist = LatencyStats::get(
+            "detector.features");
+    int64_t measure_time = LatencyHistogram::now_ns();
+    TraceScope trace_apply("detector.apply");
+
+    cv::Size frame_size = ACFFeaturePyramid::imageSize(Frame);
+    bool cache_valid = isCacheValid(frame_size);
 
     // 计算特征金字塔
     if (feature_pyramid) {
         delete feature_pyramid;
         feature_pyramid = NULL;
     }
-    feature_pyramid = new ACFFeaturePyramid(Frame, 8,
-            cv::Size(this->model_width, this->model_height), this->shrinking,
-            this->lambdas, this->pad_width, this->pad_height);
-
-    calc_feature_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::high_resolution_clock::now() - measure_time).count();
+    feature_pyramid = new ACFFeaturePyramid(Frame, pyramid_options,
+            cv::Size(model->model_width, model->model_height),
+            model->shrinking, model->lambdas, model->pad_width,
+            model->pad_height, frame_index,
+            cache_valid ? max_refresh_period : 1, model->used_channels);
+    frame_index++;
+
+    int64_t calc_feature_ns = LatencyHistogram::now_ns() - measure_time;
+    features_hist.record(calc_feature_ns);
+    calc_feature_ms = calc_feature_ns / 1e6f;
+
+    // 计算全部尺度时打印金字塔的规模, 用于比较不同尺度配置的耗时和内存
+    if (!cache_valid) {
+        ACF_LOG(Info) << "Pyramid " << frame_size.width << "x"
+                << frame_size.height << ": " << feature_pyramid->getAmount()
+                << " layers ("
+                << feature_pyramid->getRealScaleCount() << " real), "
+                << calc_feature_ms << "ms, "
+                << feature_pyramid->getMemoryBytes() / 1024 << "KB";
+    }
 
 //    feature_pyramid->print_duration();
 
@@ -54,32 +99,57 @@ DetectionList ACFDetector::applyDetector(const cv::Mat &Frame) {
 
 //    return DetectionList();
 
-    measure_time = std::chrono::high_resolution_clock::now();
+    return detectPyramid(*feature_pyramid, frame_size);
+}
+
+// 在已计算的特征金字塔上滑动窗口检测, 结果为原图坐标
+DetectionList ACFDetector::detectPyramid(ACFFeaturePyramid &pyramid,
+        cv::Size frame_size) {
+
+    if (!isCacheValid(frame_size)
+            || layer_detections.size() != pyramid.getAmount()) {
+        last_frame_size = frame_size;
+        layer_detections.assign(pyramid.getAmount(),
+                std::vector<Detection>());
+    }
+
+    static LatencyHistogram &classifier_hist = LatencyStats::get(
+            "detector.classifier");
+    static LayerLatencyStats layer_hists("classifier.layer");
+    int64_t measure_time = LatencyHistogram::now_ns();
+    TraceScope trace_classifier("detector.classifier");
 
     // use tbb to detect, save about 20 ms at 320x240 (serial_for cost 30ms)
     // 对每个尺度分别调用一次滑动窗口检测
     tbb::concurrent_vector<Detection> det_temp;
 #ifdef USE_TBB
-    tbb::parallel_for(size_t(0), size_t(feature_pyramid->getAmount()),
+    tbb::parallel_for(size_t(0), size_t(pyramid.getAmount()),
             [&](size_t layer_i) {
 #else
-    for (size_t i = 0; i < feature_pyramid->getAmount(); i++) {
+    for (size_t layer_i = 0; layer_i < pyramid.getAmount(); layer_i++) {
 #endif
-        auto layer = feature_pyramid->getLayer(layer_i);
-        if (layer != NULL) {
-            std::vector<Detection> det = Detect(layer);
+        // 本帧未调度的层沿用其最近一次的检测结果
+        if (pyramid.isLayerFresh(layer_i)) {
+            auto layer = pyramid.getLayer(layer_i);
+            int64_t layer_time = LatencyHistogram::now_ns();
+            TraceScope trace_layer("classifier.layer", layer_i);
+            std::vector<Detection> det = Detect(layer, layer_i);
+            layer_hists[layer_i].record(
+                    LatencyHistogram::now_ns() - layer_time);
             for (int i = 0; i < det.size(); i++) {
                 // 根据缩放尺度, 修改检测结果尺寸和位置
-                cv::Size2d scale_xy = feature_pyramid->get_scale_xy(layer_i);
+                cv::Size2d scale_xy = pyramid.get_scale_xy(layer_i);
                 det[i].setX(det[i].getX() / scale_xy.width);
                 det[i].setY(det[i].getY() / scale_xy.height);
                 det[i].setWidth(det[i].getWidth() / scale_xy.width);
                 det[i].setHeight(det[i].getHeight() / scale_xy.height);
                 det[i].setColor(cv::Scalar(0, 0, 255));
-                det_temp.push_back(det[i]);
+                det[i].setModelName(model->name);
             }
-        } else {
-            std::cout << "layer " << layer_i << " is NULL!" << std::endl;
+            layer_detections[layer_i] = det;
+        }
+        for (const Detection &det : layer_detections[layer_i]) {
+            det_temp.push_back(det);
         }
 #ifdef USE_TBB
     });
@@ -92,51 +162,92 @@ DetectionList ACFDetector::applyDetector(const cv::Mat &Frame) {
     for (int i = 0; i < det_temp.size(); i++) {
         DL.addDetection(det_temp[i]);
     }
-    apply_classifier_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::high_resolution_clock::now() - measure_time).count();
+    int64_t apply_classifier_ns = LatencyHistogram::now_ns() - measure_time;
+    classifier_hist.record(apply_classifier_ns);
+    apply_classifier_ms = apply_classifier_ns / 1e6f;
+
+    updateCascadeBudget();
 
     return DL;
 }
 
-std::vector<Detection> ACFDetector::Detect(
-        const ChannelFeatures *features) const {
+// 根据分类耗时调整提前拒绝阈值: 超出预算时提高阈值, 低于预算80%时逐步恢复
+void ACFDetector::updateCascadeBudget() {
+    if (classifier_budget_ms <= 0) {
+        return;
+    }
+
+    // 使用滑动平均, 避免尺度调度造成的逐帧波动引起阈值振荡
+    if (classifier_ms_avg < 0) {
+        classifier_ms_avg = apply_classifier_ms;
+    } else {
+        classifier_ms_avg = 0.7f * classifier_ms_avg
+                + 0.3f * apply_classifier_ms;
+    }
+
+    float offset = cascade_offset;
+    if (classifier_ms_avg > classifier_budget_ms) {
+        offset = std::min(cascade_offset + cascade_step, cascade_max_offset);
+    } else if (classifier_ms_avg < 0.8f * classifier_budget_ms) {
+        offset = std::max(cascade_offset - cascade_step, 0.0f);
+    }
+
+    if (offset != cascade_offset) {
+        double last_cascThr = this->cascThr;
+        cascade_offset = offset;
+        modifyCascade(cascade_offset);
+        ACF_LOG(Info) << "cascThr " << last_cascThr << " -> " << this->cascThr
+                << " (clf " << classifier_ms_avg << "ms, budget "
+                << classifier_budget_ms << "ms)";
+    }
+}
+
+std::vector<Detection> ACFDetector::Detect(const ChannelFeatures *features,
+        int layer_i) const {
     std::vector<Detection> dets;
 
 //    float cascThr = -1; //could also come from model
     float cascThr = this->cascThr; //could also come from model
-    int stride = this->shrinking;
-    int shrink = this->shrinking;
+    int stride = model->shrinking;
+    int shrink = model->shrinking;
     float* chns = features->chns;
-
-    int treeDepth = this->ModelDepth;
+    int shrinking = model->shrinking;
+    const float *thrs = model->thrs;
+    const float *hs = model->hs;
+    const uint32_t *fids = model->fids;
+    const uint32_t *child = model->child;
+
+    int treeDepth = model->ModelDepth;
+#ifdef ACF_INSTRUMENT
+    // 插桩编译统一使用通用的树遍历, 以便记录每个节点读取的特征
+    treeDepth = 0;
+#endif
     int chnWidth = features->getChannelWidth();
     int chnHeight = features->getChannelHeight();
     int width = chnWidth;                // 积分特征图的宽度
     int height = chnHeight;               // 积分特征图的高度
 
-    int nTrees = this->nTrees;
-    int nTreeNodes = this->nTreeNodes;
+    int nTrees = model->nTrees;
+    int nTreeNodes = model->nTreeNodes;
 
     // Should be kept in the model
-    int modelWd = this->model_width_pad;
-    int modelHt = this->model_height_pad;
+    int modelWd = model->model_width_pad;
+    int modelHt = model->model_height_pad;
 
     //Height and width of the area to cover with the sliding window-detector
     int height1 = static_cast<int>(std::ceil(
             static_cast<float>(chnHeight * shrinking - modelHt + 1) / stride));
     int width1 = static_cast<int>(std::ceil(
             static_cast<float>(chnWidth * shrinking - modelWd + 1) / stride));
+    // 共用金字塔按最小的模型建到更小的尺度, 小于本模型窗口的层没有可检测的位置
+    if (height1 <= 0 || width1 <= 0) {
+        return dets;
+    }
 
-    int nChns = features->getnChannels();
-
-    // construct cids array 构造cids数组, 该数组用于将(窗口位置+区域位置)映射到原始特征图
-    int nFtrs = modelHt / shrink * modelWd / shrink * nChns; // 每个检测窗口中的总特征数量 32/2*32/2*10
-    uint32_t *cids = new uint32_t[nFtrs];                     // 创建通道索引数组
-    int m = 0;                                             // 组织方式: 列->行->面(通道)
-    for (int z = 0; z < nChns; z++)                        // 遍历特征通道
-        for (int c = 0; c < modelWd / shrink; c++)           // 遍历宽度
-            for (int r = 0; r < modelHt / shrink; r++)         // 遍历高度
-                cids[m++] = z * width * height + c * height + r; // 设置索引号
+    std::vector<uint32_t> cids_vector = getChannelIndex(features);
+    uint32_t *cids = cids_vector.data();
+    // 逐树的拒绝阈值, 未标定时均为cascThr
+    const float *rejThr = this->rejection_thresholds.data();
 
             // apply classifier to each patch
     tbb::concurrent_vector<int> rs, cs;
@@ -144,6 +255,7 @@ std::vector<Detection> ACFDetector::Detect(
     tbb::concurrent_vector<int> levels;
 
     auto measure_time = std::chrono::high_resolution_clock::now();
+    static PerfStage &cascade_perf = PerfCounters::get("cascade");
 
     // 遍历减采样后的宽度和高度
     // 使用并行遍历, 最多可减少50%的时间
@@ -152,6 +264,11 @@ std::vector<Detection> ACFDetector::Detect(
 #else
     for (int c = 0; c < width1; c++) {
 #endif
+#ifdef ACF_INSTRUMENT
+        CascadeProfile::Counters &profile = cascade_profile->local();
+#endif
+        // 按列采样硬件计数器, 单位为窗口数
+        ScopedPerf perf(cascade_perf, height1);
         // 遍历Y轴
         for (int r = 0; r < height1; r++) {
             float h = 0;
@@ -165,7 +282,7 @@ std::vector<Detection> ACFDetector::Detect(
                     uint32_t offset = t * nTreeNodes, k = offset, k0 = 0;
                     getChild(chns1, cids, fids, thrs, offset, k0, k);
                     h += hs[k];
-                    if (h <= cascThr)
+                    if (h <= rejThr[t])
                         break;
                 }
             } else if (treeDepth == 2) {
@@ -175,7 +292,7 @@ std::vector<Detection> ACFDetector::Detect(
                     getChild(chns1, cids, fids, thrs, offset, k0, k);
                     getChild(chns1, cids, fids, thrs, offset, k0, k);
                     h += hs[k];
-                    if (h <= cascThr)
+                    if (h <= rejThr[t])
                         break;
                 }
             } else if (treeDepth > 2) {
@@ -185,7 +302,7 @@ std::vector<Detection> ACFDetector::Detect(
                     for (int i = 0; i < treeDepth; i++)
                         getChild(chns1, cids, fids, thrs, offset, k0, k);
                     h += hs[k];
-                    if (h <= cascThr)
+                    if (h <= rejThr[t])
                         break;
                 }
             } else {
@@ -199,16 +316,24 @@ std::vector<Detection> ACFDetector::Detect(
                         // fids[k]        待对比特征在采样窗口中的偏移量
                         // cids[fids[k]]  待对比特征在特征图中的偏移量
                         float ftr = chns1[cids[fids[k]]];             // 为待对比的特征
+#ifdef ACF_INSTRUMENT
+                        profile.fid_counts[fids[k]]++;
+#endif
                         // 根据特征值与给定阈值的大小关系, 转到对应的子节点
                         k = child[k] - ((ftr < thrs[k]) ? 1 : 0) + offset;
                     }
                     h += hs[k];
-                    if (h <= cascThr)
+                    if (h <= rejThr[t])
                         break; // 如果评分低于阈值, 则立即停止判断
                 }
             }
-            // 如果该窗口评分大于阈值, 则记录该窗口的位置和置信度
-            if (h > cascThr) {
+#ifdef ACF_INSTRUMENT
+            if (layer_i >= 0) {
+                profile.addWindow(layer_i, t, nTrees);
+            }
+#endif
+            // 如果该窗口通过了所有树且评分大于阈值, 则记录该窗口的位置和置信度
+            if (t == nTrees && h > cascThr) {
                 cs.push_back(c);
                 rs.push_back(r);
                 hs1.push_back(h);
@@ -221,17 +346,16 @@ std::vector<Detection> ACFDetector::Detect(
     }
 #endif
 
-    delete[] cids;
 
-    float shiftw = (this->model_width_pad - this->model_width) / 2.0; // when padding is used, this should also be subtracted ...
-    float shifth = (this->model_height_pad - this->model_height) / 2.0; // "
+    float shiftw = (model->model_width_pad - model->model_width) / 2.0; // when padding is used, this should also be subtracted ...
+    float shifth = (model->model_height_pad - model->model_height) / 2.0; // "
 
     for (int i = 0; i < cs.size(); i++) {
         Detection det;
-        det.setX((cs[i]) * shrinking - this->pad_width + shiftw);
-        det.setY((rs[i]) * shrinking - this->pad_height + shifth);
-        det.setWidth(this->model_width);
-        det.setHeight(this->model_height);
+        det.setX((cs[i]) * shrinking - model->pad_width + shiftw);
+        det.setY((rs[i]) * shrinking - model->pad_height + shifth);
+        det.setWidth(model->model_width);
+        det.setHeight(model->model_height);
         det.setScore(hs1[i]);
         det.setLevel(levels[i]);
         dets.push_back(det);
@@ -240,178 +364,127 @@ std::vector<Detection> ACFDetector::Detect(
     return dets;
 }
 
-ACFDetector::ACFDetector(std::string modelfile) {
-    ReadModel(modelfile);
+// construct cids array 构造cids数组, 该数组用于将(窗口位置+区域位置)映射到原始特征图
+std::vector<uint32_t> ACFDetector::getChannelIndex(
+        const ChannelFeatures *features) const {
+    int shrink = model->shrinking;
+    int width = features->getChannelWidth();
+    int height = features->getChannelHeight();
+    int modelWd = model->model_width_pad;
+    int modelHt = model->model_height_pad;
+    int nChns = features->getnChannels();
+
+    int nFtrs = modelHt / shrink * modelWd / shrink * nChns; // 每个检测窗口中的总特征数量 32/2*32/2*10
+    std::vector<uint32_t> cids(nFtrs);                     // 创建通道索引数组
+    int m = 0;                                             // 组织方式: 列->行->面(通道)
+    for (int z = 0; z < nChns; z++)                        // 遍历特征通道
+        for (int c = 0; c < modelWd / shrink; c++)           // 遍历宽度
+            for (int r = 0; r < modelHt / shrink; r++)         // 遍历高度
+                cids[m++] = z * width * height + c * height + r; // 设置索引号
+    return cids;
 }
 
-// 读取检测器模型
-void ACFDetector::ReadModel(std::string modelfile) {
-
-    if (modelfile.substr(modelfile.size() - 4, 4) == ".mat") {
-        const char *detector_path = modelfile.c_str();
-        std::cout << "Loading detector(" << detector_path << ")..."
-                << std::flush;
-        mat_t *matfp = Mat_Open(detector_path, MAT_ACC_RDONLY);
-        if (matfp) {
-            matvar_t *detector = NULL;
-            matvar_t *opt = NULL;
-            matvar_t *pPyramid = NULL;
-            matvar_t *pChns = NULL;
-            matvar_t *pad = NULL;
-            matvar_t *lambdas = NULL;
-            matvar_t *shrink = NULL;
-            matvar_t *modelDs = NULL;
-            matvar_t *modelDsPad = NULL;
-            matvar_t *cascThr = NULL;
-            matvar_t *name = NULL;
-            matvar_t *clf = NULL;
-            matvar_t *treeDepth = NULL;
-            matvar_t *fids = NULL;
-            matvar_t *thrs = NULL;
-            matvar_t *child = NULL;
-            matvar_t *hs = NULL;
-
-            // 读取并打印检测器名称
-            detector = Mat_VarRead(matfp, "detector");
-            if (detector) {
-                opt = Mat_VarGetStructFieldByName(detector, "opts", 0);
-                if (opt) {
-                    name = Mat_VarGetStructFieldByName(opt, "name", 0);
-                    modelDs = Mat_VarGetStructFieldByName(opt, "modelDs", 0);
-                    modelDsPad = Mat_VarGetStructFieldByName(opt, "modelDsPad",
-                            0);
-                    cascThr = Mat_VarGetStructFieldByName(opt, "cascThr", 0);
-                    pPyramid = Mat_VarGetStructFieldByName(opt, "pPyramid", 0);
-                    if (pPyramid) {
-                        pad = Mat_VarGetStructFieldByName(pPyramid, "pad", 0);
-                        lambdas = Mat_VarGetStructFieldByName(pPyramid,
-                                "lambdas", 0);
-                        pChns = Mat_VarGetStructFieldByName(pPyramid, "pChns",
-                                0);
-                        if (pChns) {
-                            shrink = Mat_VarGetStructFieldByName(pChns,
-                                    "shrink", 0);
-                        }
-                    }
-                }
-                // 读取分类器数据
-                clf = Mat_VarGetStructFieldByName(detector, "clf", 0);
-                if (clf) {
-                    treeDepth = Mat_VarGetStructFieldByName(clf, "treeDepth",
-                            0);
-                    fids = Mat_VarGetStructFieldByName(clf, "fids", 0);
-                    thrs = Mat_VarGetStructFieldByName(clf, "thrs", 0);
-                    child = Mat_VarGetStructFieldByName(clf, "child", 0);
-                    hs = Mat_VarGetStructFieldByName(clf, "hs", 0);
-                }
-            }
+std::vector<float> ACFDetector::traceWindow(const ChannelFeatures *features,
+        int r, int c) const {
+    std::vector<uint32_t> cids = getChannelIndex(features);
+    // 滑动步长等于shrink, 窗口位置即为特征图坐标
+    const float *chns1 = features->chns + r + c * features->getChannelHeight();
+
+    const float *thrs = model->thrs;
+    const float *hs = model->hs;
+    const uint32_t *fids = model->fids;
+    const uint32_t *child = model->child;
+
+    std::vector<float> trace(model->nTrees);
+    float h = 0;
+    for (int t = 0; t < model->nTrees; t++) {
+        uint32_t offset = t * model->nTreeNodes;
+        uint32_t k = offset;
+        while (child[k]) {
+            float ftr = chns1[cids[fids[k]]];
+            k = child[k] - ((ftr < thrs[k]) ? 1 : 0) + offset;
+        }
+        h += hs[k];
+        trace[t] = h;
+    }
+    return trace;
+}
 
-            if (name && shrink && modelDs && modelDsPad && cascThr && fids
-                    && thrs && child && hs && pad && lambdas) {
-                // 模型文件读取成功
-                std::cout << " OK" << std::endl;
-
-                // 从MAT对象中提取数据
-                const char *detector_name = (const char *) name->data;
-                double detector_shrink = ((const double*) shrink->data)[0];
-                const double *detector_modelDs = (const double*) modelDs->data;
-                const double *detector_modelDsPad =
-                        (const double*) modelDsPad->data;
-                double *detector_lambdas = (double*) lambdas->data;
-                double *detector_pad = (double*) pad->data;
-                double detector_cascThr = ((const double*) cascThr->data)[0];
-                uint32_t detector_treeDepth =
-                        treeDepth ? ((const uint32_t*) treeDepth->data)[0] : 0;
-                uint32_t detector_nNodes = fids->dims[0];
-                uint32_t detector_nWeaks = fids->dims[1];
-                const uint32_t *detector_fids = (const uint32_t *) fids->data;
-                const float *detector_thrs = (const float *) thrs->data;
-                const uint32_t *detector_child = (const uint32_t *) child->data;
-                const float *detector_hs = (const float *) hs->data;
-
-                // 打印检测器信息
-                std::cout << "Detector Name:        " << detector_name
-                        << std::endl;
-                std::cout << "Detector modelDs:     " << detector_modelDs[0]
-                        << "x" << detector_modelDs[1] << std::endl;
-                std::cout << "Detector modelDsPad:  " << detector_modelDsPad[0]
-                        << "x" << detector_modelDsPad[1] << std::endl;
-                std::cout << "Detector lambdas:     " << detector_lambdas[0]
-                        << "," << detector_lambdas[1] << ","
-                        << detector_lambdas[2] << std::endl;
-                std::cout << "Detector pad:         " << detector_pad[0] << ","
-                        << detector_pad[1] << std::endl;
-                std::cout << "Detector shrink:      " << detector_shrink
-                        << std::endl;
-                std::cout << "Detector cascThr:     " << detector_cascThr
-                        << std::endl;
-                std::cout << "Detector treeDepth:   " << detector_treeDepth
-                        << std::endl;
-                std::cout << "Detector classifier:  " << detector_nNodes << "x"
-                        << detector_nWeaks << std::endl;
-
-                // 将检测器数据拷贝至该对象
-                std::cout << "Copying data...";
-                this->setHeight(detector_modelDs[0]);
-                this->setWidth(detector_modelDs[1]);
-                this->setHeightPad(detector_modelDsPad[0]);
-                this->setWidthPad(detector_modelDsPad[1]);
-                this->pad_height = detector_pad[0];
-                this->pad_width = detector_pad[1];
-                this->lambdas = {detector_lambdas[0],
-                    detector_lambdas[1], detector_lambdas[2]};
-                this->ModelDepth = detector_treeDepth;
-                this->shrinking = detector_shrink;
-                this->cascThr = detector_cascThr;
-                this->nTrees = detector_nWeaks;
-                this->nTreeNodes = detector_nNodes;
-
-                this->child = new uint32_t[detector_nNodes * detector_nWeaks];
-                this->fids = new uint32_t[detector_nNodes * detector_nWeaks];
-                this->thrs = new float[detector_nNodes * detector_nWeaks];
-                this->hs = new float[detector_nNodes * detector_nWeaks];
-
-                memcpy(this->child, detector_child,
-                        sizeof(uint32_t) * detector_nNodes * detector_nWeaks);
-                memcpy(this->fids, detector_fids,
-                        sizeof(uint32_t) * detector_nNodes * detector_nWeaks);
-                memcpy(this->thrs, detector_thrs,
-                        sizeof(float) * detector_nNodes * detector_nWeaks);
-                memcpy(this->hs, detector_hs,
-                        sizeof(float) * detector_nNodes * detector_nWeaks);
-
-                this->Child = new const uint32_t*[detector_nWeaks];	// 创建指针数组
-                this->Fid = new const uint32_t*[detector_nWeaks];	// 创建指针数组
-                this->Thresholds = new const float*[detector_nWeaks];// 创建指针数组
-                this->Values = new const float*[detector_nWeaks];	// 创建指针数组
-                for (int i = 0; i < detector_nWeaks; i++) {
-                    this->Child[i] = &(this->child[i * detector_nNodes]);
-                    this->Fid[i] = &(this->fids[i * detector_nNodes]);
-                    this->Thresholds[i] = &(this->thrs[i * detector_nNodes]);
-                    this->Values[i] = &(this->hs[i * detector_nNodes]);
-                }
+void ACFDetector::updateRejectionThresholds() {
+    this->rejection_thresholds.assign(model->nTrees, (float) this->cascThr);
+    for (int t = 0; t < model->rejection_trace.size() && t < model->nTrees;
+            t++) {
+        this->rejection_thresholds[t] = std::max(this->rejection_thresholds[t],
+                model->rejection_trace[t]);
+    }
+}
 
-                std::cout << " OK" << std::endl;
-            } else {
-                // MAT文件数据格式错误
-                std::cout << "MAT file wrong format" << std::endl;
+bool ACFDetector::dumpCascadeProfile(const std::string &filepath) const {
+    if (this->cascade_profile == NULL) {
+        return false;
+    }
+    bool ok = this->cascade_profile->dump(filepath);
+    ACF_LOG(Info) << "Saving cascade profile to " << filepath << "..."
+            << (ok ? "OK" : "Fail");
+    return ok;
+}
+
+ACFDetector::ACFDetector(std::string modelfile) :
+        ACFDetector(std::make_shared<const ACFModel>(modelfile)) {
+}
+
+ACFDetector::ACFDetector(std::shared_ptr<const ACFModel> model) {
+    std::atomic_store(&this->published_model, model);
+    activateModel(model);
+}
+
+void ACFDetector::setModel(std::shared_ptr<const ACFModel> model) {
+    std::atomic_store(&this->published_model, model);
+}
+
+bool ACFDetector::reloadModel(const std::string &modelfile) {
+    std::shared_ptr<const ACFModel> model = std::make_shared<const ACFModel>(
+            modelfile);
+    if (!model->isLoaded()) {
+        ACF_LOG(Warn) << "Keep current model, failed to load " << modelfile;
+        return false;
+    }
+    setModel(model);
+    return true;
+}
+
+void ACFDetector::activateModel(std::shared_ptr<const ACFModel> model) {
+#ifdef ACF_INSTRUMENT
+    // 特征通道数由模型引用的最大特征序号推算
+    if (model->isLoaded()) {
+        int window_width = model->model_width_pad / model->shrinking;
+        int window_height = model->model_height_pad / model->shrinking;
+        uint32_t max_fid = *std::max_element(model->fids,
+                model->fids + model->nTreeNodes * model->nTrees);
+        int n_channels = max_fid / (window_width * window_height) + 1;
+        // 结构相同时继续累加, 否则先保存旧模型的统计, 避免热加载丢弃已收集的数据
+        if (this->cascade_profile == NULL
+                || !this->cascade_profile->sameShape(model->nTrees, n_channels,
+                        window_width, window_height)) {
+            if (this->cascade_profile && this->model) {
+                dumpCascadeProfile(this->model->path + ".cascade_profile.txt");
             }
-            Mat_Close(matfp);
-        } else {
-            // 打开MAT文件失败
-            std::cout << "Error opening MAT file" << std::endl;
+            delete this->cascade_profile;
+            this->cascade_profile = new CascadeProfile(model->nTrees,
+                    n_channels, window_width, window_height);
         }
-
-    } else {
-        std::cout << "Unsupported model" << std::endl;
     }
+#endif
+
+    this->model = model;
+    this->cascThr = model->cascThr + this->cascade_score;
+    updateRejectionThresholds();
+    // 各层缓存的检测结果由旧模型得到, 全部失效
+    this->layer_detections.clear();
 }
 
 ACFDetector::~ACFDetector() {
-    free(this->thrs);
-    free(this->hs);
-    free(this->fids);
-    free(this->child);
+    delete this->cascade_profile;
     if (feature_pyramid) {
         delete feature_pyramid;
         feature_pyramid = NULL;
@@ -10,6 +10,7 @@
 #include <iostream>
 #include <sstream>
 #include <fstream>
+#include <memory>
 
 #include "../general/detection.h"
 #include "../general/DetectionList.h"
@@ -17,6 +18,11 @@
 #include "ChannelFeatures.h"
 
 #include "ACFFeaturePyramid.h"
+#include "CascadeProfile.h"
+#include "ACFModel.h"
+
+// 默认使用的检测器模型
+#define ACF_DEFAULT_MODEL "/home/pi/AcfHSMy18Detector.mat"
 
 class ACFDetector {
 public:
@@ -25,92 +31,133 @@ public:
         return "ACF";
     }
 
-    ACFDetector() {
-        ReadModel("/home/pi/AcfHSCaltechDetector.mat");
+    ACFDetector() :
+            ACFDetector(ACF_DEFAULT_MODEL) {
     }
+    ACFDetector(std::string modelfile);
+    ACFDetector(std::shared_ptr<const ACFModel> model);
     ~ACFDetector();
 
-    std::vector<Detection> Detect(const ChannelFeatures *features) const;
+    // 发布新模型, 可在任意线程调用; 下一帧开始时生效, 正在处理的帧仍使用旧模型
+    void setModel(std::shared_ptr<const ACFModel> model);
+
+    // 加载模型文件并发布, 加载失败时保留原模型
+    bool reloadModel(const std::string &modelfile);
+
+    // 当前帧使用的模型
+    std::shared_ptr<const ACFModel> getModel() const {
+        return this->model;
+    }
+
+    std::vector<Detection> Detect(const ChannelFeatures *features,
+            int layer_i = -1) const;
 
     int getShrinking() const {
-        return this->shrinking;
+        return this->model->shrinking;
     }
 
+    // 以模型中的cascThr为基准, 调整提前拒绝阈值
     void modifyCascade(float score) {
-//        for(int s=0; s<this->Values.size(); s++) {
-//            for(int l=0; l<this->Values[s].size(); l++) {
-//                this->Values[s][l] += score;
-//            }
-//        }
+        this->cascade_score = score;
+        this->cascThr = this->model->cascThr + score;
+        updateRejectionThresholds();
     }
 
-    ACFDetector(std::string modelfile);
+    double getCascadeThreshold() const {
+        return this->cascThr;
+    }
 
-    DetectionList applyDetector(const cv::Mat &Frame);
+    // 不提前终止地计算窗口(r, c)处每棵树之后的累计得分, 用于标定拒绝阈值轨迹
+    std::vector<float> traceWindow(const ChannelFeatures *features, int r,
+            int c) const;
 
-    int getHeight() const {
-        return this->model_height;
+    int getTreeCount() const {
+        return this->model->nTrees;
     }
-    int pad_width;
-    int pad_height;
-    std::array<double, 3> lambdas;
 
+    int getWidthPad() const {
+        return this->model->model_width_pad;
+    }
 
-    ACFFeaturePyramid *feature_pyramid = NULL;
-    int calc_feature_ms = 0;
-    int apply_classifier_ms = 0;
+    int getHeightPad() const {
+        return this->model->model_height_pad;
+    }
 
-private:
+    // 导出级联统计信息, 仅插桩编译(ACF_INSTRUMENT)时可用
+    bool dumpCascadeProfile(const std::string &filepath) const;
 
-    void setWidth(float w) {
-        this->model_width = w;
+    // Frame为BGR图像或I420帧(见ACFFeaturePyramid::convertToLuv)
+    DetectionList applyDetector(const cv::Mat &Frame);
 
+    // 以下供多个检测器共用一个特征金字塔(ACFMultiDetector)时使用:
+    // 每帧开始时切换至已发布的模型, 模型无效时返回false
+    bool updateModel();
+    // 缓存的各层检测结果是否可用, 不可用时本帧需计算全部尺度
+    bool isCacheValid(cv::Size frame_size) const;
+    // 在给定特征金字塔上检测, 金字塔的shrink/lambdas/pad须与模型一致
+    DetectionList detectPyramid(ACFFeaturePyramid &pyramid,
+            cv::Size frame_size);
+
+    int getWidth() const {
+        return this->model->model_width;
     }
 
-    void setHeight(float h) {
-        this->model_height = h;
+    int getHeight() const {
+        return this->model->model_height;
     }
 
-    void setWidthPad(float w) {
-        this->model_width_pad = w;
-
-    }
+    ACFFeaturePyramid *feature_pyramid = NULL;
+    // 本帧的耗时(ms), 由纳秒计时换算, 滚动统计见LatencyStats中的detector.*
+    float calc_feature_ms = 0;
+    float apply_classifier_ms = 0;
 
-    void setHeightPad(float h) {
-        this->model_height_pad = h;
-    }
+    // 特征金字塔的尺度配置
+    PyramidOptions pyramid_options;
 
-    void ReadModel(std::string modelfile);
+    // 精细尺度的最大刷新周期(帧), 1表示每帧计算全部尺度
+    int max_refresh_period = 1;
 
-    int nTrees;
+    // 分类耗时预算(ms), 超出时提高提前拒绝阈值, 0表示关闭
+    int classifier_budget_ms = 0;
+    // 每次调整的步长, 以及相对于模型cascThr的最大偏移量
+    float cascade_step = 0.05;
+    float cascade_max_offset = 1.0;
 
-    int nTreeNodes;
+private:
 
-    //! holds indeces to follow through a stage evaluation, normally these are the same in every stage since these represent the decision stump tree
-    const uint32_t **Child;
+    void updateCascadeBudget();
 
-    //! holds indeces to follow through a stage evaluation, normally these are the same in every stage since these represent the decision stump tree
-    // std::vector<std::vector<int> > depth;
+    // 切换至新模型, 仅在处理线程中帧与帧之间调用
+    void activateModel(std::shared_ptr<const ACFModel> model);
 
-    //! holds the indeces of the features to use, no longer used when features are inside the model
-    const uint32_t **Fid;
+    void updateRejectionThresholds();
 
-    //! The thresholds that should be reached for each feature
-    const float **Thresholds;
+    std::vector<uint32_t> getChannelIndex(
+            const ChannelFeatures *features) const;
 
-    //! stores the values to be added/subtracted at the end of a stage (dependent on the leaf reached)
-    const float **Values;
+    //! 其他线程发布的模型, 通过std::atomic_load/std::atomic_store访问
+    std::shared_ptr<const ACFModel> published_model;
+    //! 当前帧使用的模型, 仅由处理线程修改
+    std::shared_ptr<const ACFModel> model;
 
-    float model_width, model_height;
-    float model_width_pad, model_height_pad;
-    int shrinking;
     double cascThr;
-    int ModelDepth;
+    //! 相对于模型cascThr的偏移量, 切换模型后保持不变
+    float cascade_score = 0;
+
+    //! 实际使用的逐树拒绝阈值, 即max(cascThr, rejection_trace[t])
+    std::vector<float> rejection_thresholds;
+
+    //! 级联统计信息, 仅插桩编译时创建
+    CascadeProfile *cascade_profile = NULL;
+
+    // 尺度调度状态: 帧序号, 以及各层最近一次计算得到的检测结果(原图坐标)
+    int frame_index = 0;
+    cv::Size last_frame_size;
+    std::vector<std::vector<Detection>> layer_detections;
 
-    float *thrs = NULL;
-    float *hs = NULL;
-    uint32_t *fids = NULL;
-    uint32_t *child = NULL;
+    // 耗时预算控制状态: 分类耗时的滑动平均, 以及当前阈值偏移量
+    float classifier_ms_avg = -1;
+    float cascade_offset = 0;
 };
 
 #endif /* ACFDETECTOR_H_ */
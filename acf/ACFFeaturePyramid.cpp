@@ -3,33 +3,116 @@
  */
 #include "ACFFeaturePyramid.h"
 #include "../low-level/Functions.h"
+#include "../general/LatencyStats.h"
+#include "../general/TraceRecorder.h"
+#include "../general/PerfCounters.h"
 #include <cmath>
+#include <iomanip>
 #include <chrono>
+#include <numeric>
+#include <limits>
 #include <tbb/tbb.h>
 #include <opencv2/opencv.hpp>
 //#include <ctgmath>
 
 #define USE_TBB
 
+// 预设的尺度配置, balanced与Piotr toolbox的默认参数(nPerOct=8, nApprox=7)一致
+PyramidOptions PyramidOptions::fromProfile(const std::string &name) {
+    PyramidOptions options;
+    if (name == "fast") {
+        // 每个八度4个尺度, 每个八度计算一个真实尺度
+        options.scales_per_oct = 4;
+        options.n_approx = 3;
+    } else if (name == "accurate") {
+        // 每个八度8个尺度, 每个八度计算两个真实尺度, 估计误差更小
+        options.scales_per_oct = 8;
+        options.n_approx = 3;
+    } else if (name != "balanced") {
+        ACF_LOG(Warn) << "Unknown pyramid profile " << name << ", use balanced";
+    }
+    return options;
+}
+
+// 将BGR或I420图像转换为LUV颜色空间, 返回按列存储的L, U, V平面, 由调用者free()释放
+float* ACFFeaturePyramid::convertToLuv(const cv::Mat &source_image,
+        bool yuv_full_range) {
+    if (source_image.type() == CV_8UC1) {
+        // I420: 转置, 色度上采样和颜色转换在yuv2luv_sse中一次完成, 不经过BGR
+        assert(source_image.isContinuous());
+        cv::Size size = imageSize(source_image);
+        float *image_luv = (float *) aligned_alloc(16,
+                size.area() * 3 * sizeof(float));
+        assert(image_luv != NULL);
+        const uint8_t *y = source_image.data;
+        const uint8_t *u = y + size.area();
+        const uint8_t *v = u + size.area() / 4;
+        yuv2luv_sse(y, u, v, image_luv, size.width, size.height, 1.0f / 255,
+                yuv_full_range);
+        return image_luv;
+    }
+
+    // 使用OpenCV的转置函数, 将数据排列转换为按列存储
+    cv::Mat mat_temp = cv::Mat(source_image.cols, source_image.rows, CV_8UC3);
+    cv::transpose(source_image, mat_temp);
+    // 将图像转换到YUV颜色空间, 存储格式为float数组,
+    float *image_luv = (float *) aligned_alloc(16,
+            source_image.cols * source_image.rows * 3 * sizeof(float));
+    assert(image_luv != NULL);
+
+    /* 使用cvtColor进行转换, >23ms, 更耗时 */
+//    cv::Mat mat_luv(source_image.cols, source_image.rows, CV_32FC3, image_luv);
+//    cv::cvtColor(mat_temp / 255.0f, mat_luv, CV_BGR2Luv);
+//    std::cout << "cvtColor cost "
+//            << std::chrono::duration<float>(
+//                    std::chrono::high_resolution_clock::now() - measure_time).count()
+//                    * 1000 << std::endl;
+    /* 使用rgb2luv_sse进行转换, 17ms, 更快速  */
+    // 将图像转换为Matlab形式存储: float数组, 分为R G B通道, 每个通道width列, 每列height像素
+    // 预申请对齐的内存空间
+    uint8_t *image_matlab_format_data = (uint8_t *) aligned_alloc(16,
+            source_image.cols * source_image.rows * 3 * sizeof(uint8_t));
+    assert(image_matlab_format_data != NULL);
+    // 使用OpenCV的split函数, 将BGR像素格式拆分为R通道, G通道, B通道
+    cv::Mat image_channel_bgr[3] = { cv::Mat(source_image.cols,
+            source_image.rows, CV_8UC1,
+            image_matlab_format_data
+                    + source_image.cols * source_image.rows * 2), cv::Mat(
+            source_image.cols, source_image.rows, CV_8UC1,
+            image_matlab_format_data + source_image.cols * source_image.rows),
+            cv::Mat(source_image.cols, source_image.rows, CV_8UC1,
+                    image_matlab_format_data), };
+    cv::split(mat_temp, image_channel_bgr);
+    rgb2luv_sse(image_matlab_format_data, image_luv,
+            source_image.rows * source_image.cols, 1.0f / 255);
+//    std::cout << "rgb2luv_sse cost "
+//            << std::chrono::duration<float>(
+//                    std::chrono::high_resolution_clock::now() - measure_time).count()
+//                    * 1000 << std::endl;
+    free(image_matlab_format_data);
+    return image_luv;
+}
+
 ACFFeaturePyramid::ACFFeaturePyramid(const cv::Mat &source_image,
-        int _scales_per_oct, cv::Size minSize, float shrink,
-        const std::array<double, 3>& lambdas, int pad_width, int pad_height) :
-        scales_per_oct(_scales_per_oct), minSize(minSize), image_size(
-                source_image.cols, source_image.rows) {
+        const PyramidOptions &options, cv::Size minSize, float shrink,
+        const std::array<double, 3>& lambdas, int pad_width, int pad_height,
+        int frame_index, int max_refresh_period,
+        const ChannelMask &channel_mask) :
+        scales_per_oct(options.scales_per_oct), minSize(
+                std::max(minSize.width, options.min_layer_size.width),
+                std::max(minSize.height, options.min_layer_size.height)), image_size(
+                imageSize(source_image)) {
 
-    // 不使用增采样
-    int n_oct_upsample = 0;
+    // 增采样的八度数量
+    int n_oct_upsample = options.n_oct_upsample;
     // 计算二倍频数量
     float n_oct = n_oct_upsample
             + log2f(
-                    std::min((float) image_size.width / minSize.width,
-                            (float) image_size.height / minSize.height));
+                    std::min((float) image_size.width / this->minSize.width,
+                            (float) image_size.height / this->minSize.height));
     // 计算尺度数量
-    int n_scales = std::floor(
-            static_cast<float>(scales_per_oct * (n_oct + n_oct_upsample) + 1));
-
-    // 设定特征金字塔的层数为尺度数量set the size of the feature-pyramid at the nScales amount
-    layers.resize(n_scales);
+    int n_scales = std::max(0, (int) std::floor(
+            static_cast<float>(scales_per_oct * n_oct + 1)));
 
     std::vector<float> origin_scales;
     // 生成各个尺度的缩放比例
@@ -37,7 +120,6 @@ ACFFeaturePyramid::ACFFeaturePyramid(const cv::Mat &source_image,
         origin_scales.push_back(
                 std::pow(2.0, ((float) -s / scales_per_oct + n_oct_upsample)));
     }
-
     // 优化缩放系数
     float dim_short, dim_long;
     if (image_size.height < image_size.width) {
@@ -99,16 +181,33 @@ ACFFeaturePyramid::ACFFeaturePyramid(const cv::Mat &source_image,
         }
     }
 
+    // 去掉超出尺寸上限的精细尺度
+    if (options.max_layer_size.area() > 0) {
+        auto first = std::find_if(scaled_sizes.begin(), scaled_sizes.end(),
+                [&options](const cv::Size &size) {
+                    return size.width <= options.max_layer_size.width
+                            && size.height <= options.max_layer_size.height;
+                });
+        scaled_sizes.erase(scaled_sizes.begin(), first);
+    }
+    // 取整后重复的尺寸只保留一个, 层数以实际尺寸数量为准
+    n_scales = scaled_sizes.size();
+
+    // 设定特征金字塔的层数为尺度数量set the size of the feature-pyramid at the nScales amount
+    layers.resize(n_scales);
+
     // 统计需要计算的真实尺度
     std::vector<bool> is_added_scales(n_scales, false);
     std::vector<std::pair<int, std::vector<int>>> scale_tree;
 
     int real_scale_size_threshold = 0; // 80000
-    for (int i = 0; i < n_scales; i += scales_per_oct) {
+    // 每隔n_approx个估计尺度计算一个真实尺度, 估计尺度由距离最近的真实尺度得到
+    int real_step = std::max(1, options.n_approx + 1);
+    for (int i = 0; i < n_scales; i += real_step) {
         // 统计属下的估计尺度
         std::vector<int> sub_scales;
-        int front = i - (scales_per_oct - 1) / 2;
-        int back = i + scales_per_oct / 2;
+        int front = i - (real_step - 1) / 2;
+        int back = i + real_step / 2;
         if (front < 0) {
             front = 0;
         }
@@ -136,6 +235,8 @@ ACFFeaturePyramid::ACFFeaturePyramid(const cv::Mat &source_image,
         }
     }
 
+    n_real_scales = scale_tree.size();
+
     // 打印尺度的关系
 //    for (const auto& p : scale_tree) {
 //        print_scale(p.first);
@@ -147,62 +248,47 @@ ACFFeaturePyramid::ACFFeaturePyramid(const cv::Mat &source_image,
 //        std::cout << std::endl;
 //    }
 
-    // 使用OpenCV的转置函数, 将数据排列转换为按列存储
-    cv::Mat mat_temp = cv::Mat(image_size.width, image_size.height, CV_8UC3);
-    cv::transpose(source_image, mat_temp);
-    // 将图像转换到YUV颜色空间, 存储格式为float数组,
-    float *image_luv = (float *) aligned_alloc(16,
-            image_size.width * image_size.height * 3 * sizeof(float));
-    assert(image_luv != NULL);
+    // 按刷新周期筛选本帧需要计算的尺度组, 其余层保持为NULL
+    std::vector<bool> group_due = scheduleGroups(scale_tree, frame_index,
+            max_refresh_period);
+    std::vector<std::pair<int, std::vector<int>>> scheduled_tree;
+    for (size_t i = 0; i < scale_tree.size(); i++) {
+        if (group_due[i]) {
+            scheduled_tree.push_back(scale_tree[i]);
+        }
+    }
 
-    /* 使用cvtColor进行转换, >23ms, 更耗时 */
-    auto measure_time = std::chrono::high_resolution_clock::now();
-//    cv::Mat mat_luv(image_size.width, image_size.height, CV_32FC3, image_luv);
-//    cv::cvtColor(mat_temp / 255.0f, mat_luv, CV_BGR2Luv);
-//    std::cout << "cvtColor cost "
-//            << std::chrono::duration<float>(
-//                    std::chrono::high_resolution_clock::now() - measure_time).count()
-//                    * 1000 << std::endl;
-    /* 使用rgb2luv_sse进行转换, 17ms, 更快速  */
-    // 将图像转换为Matlab形式存储: float数组, 分为R G B通道, 每个通道width列, 每列height像素
-    // 预申请对齐的内存空间
-    uint8_t *image_matlab_format_data = (uint8_t *) aligned_alloc(16,
-            image_size.width * image_size.height * 3 * sizeof(uint8_t));
-    assert(image_matlab_format_data != NULL);
-    // 使用OpenCV的split函数, 将BGR像素格式拆分为R通道, G通道, B通道
-    cv::Mat image_channel_bgr[3] = { cv::Mat(image_size.width,
-            image_size.height, CV_8UC1,
-            image_matlab_format_data
-                    + image_size.width * image_size.height * 2), cv::Mat(
-            image_size.width, image_size.height, CV_8UC1,
-            image_matlab_format_data + image_size.width * image_size.height),
-            cv::Mat(image_size.width, image_size.height, CV_8UC1,
-                    image_matlab_format_data), };
-    cv::split(mat_temp, image_channel_bgr);
-//    auto measure_time = std::chrono::high_resolution_clock::now();
-    rgb2luv_sse(image_matlab_format_data, image_luv,
-            image_size.height * image_size.width, 1.0f / 255);
-//    std::cout << "rgb2luv_sse cost "
-//            << std::chrono::duration<float>(
-//                    std::chrono::high_resolution_clock::now() - measure_time).count()
-//                    * 1000 << std::endl;
-    free(image_matlab_format_data);
+    static LatencyHistogram &pre_hist = LatencyStats::get("pyramid.pre");
+    static LayerLatencyStats layer_hists("pyramid.layer");
+    static LatencyHistogram &calc_hist = LatencyStats::get("pyramid.calc");
+    static LatencyHistogram &resize_hist = LatencyStats::get("layer.resize");
+    static PerfStage &luv_perf = PerfCounters::get("rgb2luv");
 
-    pre_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::high_resolution_clock::now() - measure_time).count();
+    int64_t measure_time = LatencyHistogram::now_ns();
+    // 将图像转换到LUV颜色空间, 按列存储的float数组
+    float *image_luv;
+    {
+        TraceScope trace_luv("pyramid.luv");
+        ScopedPerf perf(luv_perf, image_size.area());
+        image_luv = convertToLuv(source_image, options.yuv_full_range);
+    }
+
+    pre_ns = LatencyHistogram::now_ns() - measure_time;
+    pre_hist.record(pre_ns);
 
-    measure_time = std::chrono::high_resolution_clock::now();
+    measure_time = LatencyHistogram::now_ns();
     // 计算实际尺度的特征图 Real Scales
 #ifdef USE_TBB
-    tbb::parallel_for(size_t(0), scale_tree.size(),
-            [&scale_tree, image_luv, shrink, lambdas, pad_width, pad_height, this](size_t i) {
+    tbb::parallel_for(size_t(0), scheduled_tree.size(),
+            [&scheduled_tree, &channel_mask, image_luv, shrink, lambdas, pad_width, pad_height, this](size_t i) {
 #else
-            for (int i = 0; i < scale_tree.size(); i++) {
+            for (int i = 0; i < scheduled_tree.size(); i++) {
 #endif
-            auto measure_time = std::chrono::high_resolution_clock::now();
+            int64_t measure_time = LatencyHistogram::now_ns();
 
-            int real_scale_i = scale_tree[i].first;
-            std::vector<int>& sub_scales = scale_tree[i].second;
+            int real_scale_i = scheduled_tree[i].first;
+            TraceScope trace_scale("pyramid.scale", real_scale_i);
+            std::vector<int>& sub_scales = scheduled_tree[i].second;
 
             // 计算缩放后的图像尺寸
             cv::Size &real_scale_size = scaled_sizes[real_scale_i];
@@ -227,15 +313,13 @@ ACFFeaturePyramid::ACFFeaturePyramid(const cv::Mat &source_image,
                 cv::resize(src_mat, scaled_mat,
                         cv::Size(scaled_height, scaled_width));
             }
-            int resize_dur =
-            std::chrono::duration_cast<std::chrono::milliseconds>(
-                    std::chrono::high_resolution_clock::now()
-                    - measure_time).count();
+            int64_t resize_ns = LatencyHistogram::now_ns() - measure_time;
+            resize_hist.record(resize_ns);
 
             // 计算实际尺度下的特征图
             layers[real_scale_i] = new ChannelFeatures(scaled_image, scaled_width,
-                    scaled_height, shrink);
-            layers[real_scale_i]->init_duration += resize_dur;
+                    scaled_height, shrink, channel_mask);
+            layers[real_scale_i]->init_ns += resize_ns;
 //            if (scaled_height == 240)
 //                std::cout << "ChannelFeatures cost "
 //                        << std::chrono::duration<float>(
@@ -248,11 +332,13 @@ ACFFeaturePyramid::ACFFeaturePyramid(const cv::Mat &source_image,
             for (int i = 0; i < sub_scales.size(); i++) {
 #endif
             int sub_scale_i = sub_scales[i];
+            TraceScope trace_approx("layer.approx", sub_scale_i);
             layers[sub_scale_i] = new ChannelFeatures(*layers[real_scale_i], scaled_sizes[sub_scale_i].width, scaled_sizes[sub_scale_i].height,
                     lambdas);
             // 特征图后处理
             layers[sub_scale_i]->SmoothPadAndConcatChannel(pad_width / shrink,
                     pad_height / shrink);
+            layer_hists[sub_scale_i].record(layers[sub_scale_i]->total_ns());
 #ifdef USE_TBB
         });
 #else
@@ -261,6 +347,7 @@ ACFFeaturePyramid::ACFFeaturePyramid(const cv::Mat &source_image,
             // 特征图后处理
             layers[real_scale_i]->SmoothPadAndConcatChannel(pad_width / shrink,
                     pad_height / shrink);
+            layer_hists[real_scale_i].record(layers[real_scale_i]->total_ns());
 #ifdef USE_TBB
         });
 #else
@@ -272,8 +359,8 @@ ACFFeaturePyramid::ACFFeaturePyramid(const cv::Mat &source_image,
 //                    std::chrono::high_resolution_clock::now() - measure_time).count()
 //                    * 1000 << std::endl;
 
-    calc_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::high_resolution_clock::now() - measure_time).count();
+    calc_ns = LatencyHistogram::now_ns() - measure_time;
+    calc_hist.record(calc_ns);
 
     // 保存特征图
 //    std::system("mkdir -p /home/pi/features/");
@@ -290,6 +377,115 @@ ACFFeaturePyramid::ACFFeaturePyramid(const cv::Mat &source_image,
 
 }
 
+// 为每个尺度组(真实尺度及其估计尺度)分配刷新周期和相位, 返回本帧需要计算的尺度组.
+// 最粗的八度(近处的人)每帧刷新, 每细一个八度周期翻倍, 周期不超过max_refresh_period;
+// 相位按计算量从大到小贪心分配, 使每帧的计算量尽量均衡
+std::vector<bool> ACFFeaturePyramid::scheduleGroups(
+        const std::vector<std::pair<int, std::vector<int>>> &scale_tree,
+        int frame_index, int max_refresh_period) {
+    size_t n_groups = scale_tree.size();
+    std::vector<bool> due(n_groups, true);
+    refresh_periods.assign(layers.size(), 1);
+    if (max_refresh_period <= 1 || n_groups == 0) {
+        return due;
+    }
+
+    // 周期均取2的幂, 因此最大周期即为调度的超周期
+    int max_period = 1;
+    while (max_period * 2 <= max_refresh_period) {
+        max_period *= 2;
+    }
+    int coarse_oct = ((int) layers.size() - 1) / scales_per_oct;
+
+    std::vector<int> periods(n_groups);
+    std::vector<double> costs(n_groups);
+    for (size_t g = 0; g < n_groups; g++) {
+        int period = 1;
+        for (int o = scale_tree[g].first / scales_per_oct;
+                o < coarse_oct && period < max_period; o++) {
+            period *= 2;
+        }
+        periods[g] = period;
+        // 计算量近似为真实尺度的特征计算加各层的分类, 均与面积成正比
+        costs[g] = 2.0 * scaled_sizes[scale_tree[g].first].area();
+        for (int sub : scale_tree[g].second) {
+            costs[g] += scaled_sizes[sub].area();
+        }
+    }
+
+    std::vector<size_t> order(n_groups);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&costs](size_t a, size_t b) {
+        return costs[a] > costs[b];
+    });
+
+    std::vector<double> load(max_period, 0);
+    for (size_t g : order) {
+        int period = periods[g];
+        // 选择使超周期内峰值计算量最小的相位
+        int best_phase = 0;
+        double best_peak = std::numeric_limits<double>::max();
+        for (int phase = 0; phase < period; phase++) {
+            double peak = 0;
+            for (int f = phase; f < max_period; f += period) {
+                peak = std::max(peak, load[f]);
+            }
+            if (peak < best_peak) {
+                best_peak = peak;
+                best_phase = phase;
+            }
+        }
+        for (int f = best_phase; f < max_period; f += period) {
+            load[f] += costs[g];
+        }
+
+        due[g] = (frame_index % period) == best_phase;
+        refresh_periods[scale_tree[g].first] = period;
+        for (int sub : scale_tree[g].second) {
+            refresh_periods[sub] = period;
+        }
+    }
+    return due;
+}
+
+void ACFFeaturePyramid::print_duration() const {
+    std::ios::fmtflags flags = std::cout.flags();
+    std::streamsize precision = std::cout.precision();
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "Pre: " << pre_ns / 1e6 << std::endl;
+    int64_t sum_layer_init = 0;
+    int64_t sum_layer_smooth = 0;
+    int64_t sum_layer_pad = 0;
+    for (int i = 0; i < layers.size(); i++) {
+        std::cout << "Layer " << i << ": ";
+        if (layers[i] == NULL) {
+            std::cout << "NULL";
+        } else {
+            sum_layer_init += layers[i]->init_ns;
+            sum_layer_smooth += layers[i]->smooth_ns;
+            sum_layer_pad += layers[i]->pad_ns;
+            std::cout << "(" << layers[i]->color_ns / 1e6 << " + "
+                    << layers[i]->mag_ns / 1e6 << " + "
+                    << layers[i]->hist_ns / 1e6 << " = "
+                    << layers[i]->init_ns / 1e6 << ") + "
+                    << layers[i]->smooth_ns / 1e6 << " + "
+                    << layers[i]->pad_ns / 1e6 << " = "
+                    << layers[i]->total_ns() / 1e6;
+        }
+        // 滚动窗口内该层的耗时分布
+        LatencyHistogram::Snapshot s = LatencyStats::layer("pyramid.layer",
+                i).snapshot();
+        std::cout << "  [p50 " << s.p50_ms() << " p99 " << s.p99_ms()
+                << "]" << std::endl;
+    }
+    std::cout << "Calc: " << calc_ns / 1e6 << " / (" << sum_layer_init / 1e6
+            << " + " << sum_layer_smooth / 1e6 << " + " << sum_layer_pad / 1e6
+            << ")" << std::endl;
+    std::cout.flags(flags);
+    std::cout.precision(precision);
+    LatencyStats::print();
+}
+
 ACFFeaturePyramid::~ACFFeaturePyramid() {
     for (auto& layer : layers) {
         if (layer != NULL) {
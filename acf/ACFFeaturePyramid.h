@@ -3,29 +3,92 @@
  */
 #pragma once
 
+#include <string>
+
 #include "ChannelFeatures.h"
+#include "../general/Logger.h"
+
+// 特征金字塔的尺度配置, 可通过fromProfile选择预设配置(fast, balanced, accurate)
+struct PyramidOptions {
+    // 每个八度(图像尺寸减半)的尺度数量
+    int scales_per_oct = 8;
+    // 每个真实尺度对应的估计尺度数量, 0表示所有尺度均计算真实特征
+    int n_approx = 7;
+    // 增采样的八度数量, 用于检测小于模型尺寸的目标
+    int n_oct_upsample = 0;
+    // 缩放后图像尺寸的下限和上限, 为0时不限制(下限不小于模型尺寸)
+    cv::Size min_layer_size;
+    cv::Size max_layer_size;
+    // I420输入为全范围(JFIF, 树莓派摄像头), 否则按有限范围(Y为16~235, OpenCV和V4L2)转换
+    bool yuv_full_range = false;
+
+    static PyramidOptions fromProfile(const std::string &name);
+};
 
 class ACFFeaturePyramid {
 public:
 
-    ACFFeaturePyramid(const cv::Mat &source_image, int _scales_per_oct,
-            cv::Size minSize, float shrink,
+    ACFFeaturePyramid(const cv::Mat &source_image,
+            const PyramidOptions &options, cv::Size minSize, float shrink,
             const std::array<double, 3>& lambdas, int pad_width,
-            int pad_height);
+            int pad_height, int frame_index = 0, int max_refresh_period = 1,
+            const ChannelMask &channel_mask = allChannels());
 
     void update(const cv::Mat &source_image);
 
+    // 将图像转换为按列存储的LUV平面(aligned_alloc申请, 由调用者free()释放)
+    // source_image为BGR(CV_8UC3)或I420(CV_8UC1, 行数为图像高度的1.5倍, 与cv::COLOR_YUV2BGR_I420相同)
+    // yuv_full_range见PyramidOptions, BGR图像忽略
+    static float* convertToLuv(const cv::Mat &source_image,
+            bool yuv_full_range = false);
+
+    // 图像尺寸, I420帧不计色度平面的行
+    static cv::Size imageSize(const cv::Mat &source_image) {
+        return source_image.type() == CV_8UC1 ?
+                cv::Size(source_image.cols, source_image.rows * 2 / 3) :
+                source_image.size();
+    }
+
     virtual ~ACFFeaturePyramid();
 
     int getAmount() {
         return this->layers.size();
     }
 
+    // 计算真实特征的尺度数量, 其余为估计尺度
+    int getRealScaleCount() const {
+        return this->n_real_scales;
+    }
+
+    // 本帧计算的各层特征图占用的内存(字节)
+    size_t getMemoryBytes() const {
+        size_t bytes = 0;
+        for (const ChannelFeatures *layer : this->layers) {
+            if (layer != NULL) {
+                bytes += (size_t) layer->getChannelWidth()
+                        * layer->getChannelHeight() * layer->getnChannels()
+                        * sizeof(float);
+            }
+        }
+        return bytes;
+    }
+
+    // 第L层在本帧是否被计算, 未被调度的层为NULL
+    bool isLayerFresh(int L) const {
+        return L < this->layers.size() && this->layers[L] != NULL;
+    }
+
+    // 第L层的刷新周期(帧)
+    int getRefreshPeriod(int L) const {
+        return this->refresh_periods.at(L);
+    }
+
     ChannelFeatures* getLayer(int L) {
         if (L < this->layers.size()) {
             return this->layers[L];
         } else {
-            std::cerr << "Requesting unknown layer ..." << std::endl;
+            ACF_LOG(Error) << "Requesting unknown layer " << L;
+            Logger::flush();
             exit(1);
         }
     }
@@ -49,46 +112,30 @@ public:
                 << this->scaled_sizes.at(i).height << "]";
     }
 
-    void print_duration() {
-        std::cout << "Pre: " << pre_duration << std::endl;
-        int sum_layer_init = 0;
-        int sum_layer_smooth = 0;
-        int sum_layer_pad = 0;
-        for (int i = 0; i < layers.size(); i++) {
-            std::cout << "Layer " << i << ": ";
-            if (layers[i] == NULL) {
-                std::cout << "NULL";
-            } else {
-                sum_layer_init += layers[i]->init_duration;
-                sum_layer_smooth += layers[i]->smooth_duration;
-                sum_layer_pad += layers[i]->pad_duration;
-                int sum = layers[i]->init_duration + layers[i]->smooth_duration + layers[i]->pad_duration;
-                std::cout << "(" << layers[i]->color_duration << " + "
-                        << layers[i]->mag_duration << " + "
-                        << layers[i]->hist_duration << " = "
-                        << layers[i]->init_duration << ") + "
-                        << layers[i]->smooth_duration << " + "
-                        << layers[i]->pad_duration << " = " << sum;
-            }
-            std::cout << std::endl;
-        }
-        std::cout << "Calc: " << calc_duration << " / (" << sum_layer_init
-                << " + " << sum_layer_smooth << " + " << sum_layer_pad << ")"
-                << std::endl;
-    }
+    // 打印本帧各层的耗时, 以及LatencyStats滚动窗口内各层和各阶段的p50/p99(ms)
+    void print_duration() const;
 
-    int pre_duration;
-    int calc_duration;
+    // 本帧的耗时(ns)
+    int64_t pre_ns = 0;
+    int64_t calc_ns = 0;
 
 protected:
 
     std::vector<ChannelFeatures*> layers;
+    // 各层的刷新周期, 同一尺度组(真实尺度及其估计尺度)共用一个周期
+    std::vector<int> refresh_periods;
 
     // amount of scales in each octave (so between halving each image dimension )
     int scales_per_oct;
+    int n_real_scales = 0;
     // Minimum size an image can have (size of the model)
     cv::Size minSize;
 
     cv::Size image_size;
     std::vector<cv::Size> scaled_sizes;
+
+private:
+    std::vector<bool> scheduleGroups(
+            const std::vector<std::pair<int, std::vector<int>>> &scale_tree,
+            int frame_index, int max_refresh_period);
 };
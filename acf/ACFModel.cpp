@@ -0,0 +1,562 @@
+/*
+ * ACFModel.cpp
+ */
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <tuple>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <matio.h>
+
+#include "ACFModel.h"
+#include "ACFModelFile.h"
+#include "../general/Logger.h"
+
+ACFModel::ACFModel(const std::string &modelfile) :
+        path(modelfile) {
+    Load(modelfile);
+}
+
+ACFModel::~ACFModel() {
+    Release();
+}
+
+std::string ACFModel::getRejectionTracePath(const std::string &modelfile) {
+    return modelfile.substr(0, modelfile.find_last_of('.')) + ".trace";
+}
+
+// 读取拒绝阈值轨迹, 文件格式: #开头的注释行, 之后每行一个阈值, 共nTrees行
+bool ACFModel::ReadRejectionTrace(const std::string &tracefile) {
+    std::ifstream in(tracefile);
+    if (!in) {
+        return false;
+    }
+
+    // 格式错误时忽略整个轨迹, 使用固定的cascThr, 不影响模型加载
+    std::vector<float> trace;
+    std::string line;
+    int line_no = 0;
+    while (std::getline(in, line)) {
+        line_no++;
+        size_t begin = line.find_first_not_of(" \t\r");
+        if (begin == std::string::npos || line[begin] == '#') {
+            continue;
+        }
+        size_t end = 0;
+        try {
+            trace.push_back(std::stof(line.substr(begin), &end));
+        } catch (const std::invalid_argument&) {
+            end = 0;
+        } catch (const std::out_of_range&) {
+            end = 0;
+        }
+        if (end == 0
+                || line.find_first_not_of(" \t\r", begin + end)
+                        != std::string::npos) {
+            ACF_LOG(Error) << "Rejection trace " << tracefile << ":" << line_no
+                    << " is not a threshold, trace ignored";
+            return false;
+        }
+    }
+
+    if (trace.size() != this->nTrees) {
+        ACF_LOG(Warn) << "Rejection trace " << tracefile << " has "
+                << trace.size() << " thresholds, model has " << this->nTrees
+                << " trees";
+        return false;
+    }
+
+    this->rejection_trace = trace;
+    ACF_LOG(Info) << "Detector trace:       " << tracefile;
+    return true;
+}
+
+bool ACFModel::WriteRejectionTrace(const std::string &tracefile,
+        const std::vector<float> &trace) {
+    std::ofstream out(tracefile);
+    if (!out) {
+        return false;
+    }
+    out << "# ACF rejection trace, " << trace.size() << " trees" << std::endl;
+    out.precision(9);
+    for (float thr : trace) {
+        out << thr << std::endl;
+    }
+    return static_cast<bool>(out);
+}
+
+// 仅非叶节点(child != 0)读取特征, 叶节点的fids无意义
+ChannelMask ACFModel::getUsedChannels(int n_first_trees) const {
+    ChannelMask mask;
+    mask.fill(false);
+    int window_size = (this->model_width_pad / this->shrinking)
+            * (this->model_height_pad / this->shrinking);
+    int n = (n_first_trees < 0 || n_first_trees > this->nTrees) ?
+            this->nTrees : n_first_trees;
+    for (int k = 0; k < n * this->nTreeNodes; k++) {
+        if (this->child[k]) {
+            uint32_t z = this->fids[k] / window_size;
+            if (z < mask.size()) {
+                mask[z] = true;
+            }
+        }
+    }
+    return mask;
+}
+
+// 打印模型引用的通道以及窗口内被访问的区域
+void ACFModel::printFeatureUsage() const {
+    int window_width = this->model_width_pad / this->shrinking;
+    int window_height = this->model_height_pad / this->shrinking;
+    int min_c = window_width, max_c = -1, min_r = window_height, max_r = -1;
+    for (int k = 0; k < this->nTrees * this->nTreeNodes; k++) {
+        if (this->child[k]) {
+            int offset = this->fids[k] % (window_width * window_height);
+            int c = offset / window_height, r = offset % window_height;
+            min_c = std::min(min_c, c);
+            max_c = std::max(max_c, c);
+            min_r = std::min(min_r, r);
+            max_r = std::max(max_r, r);
+        }
+    }
+
+    // 通道列表先拼接成一行再写日志
+    std::ostringstream channels;
+    for (size_t z = 0; z < this->used_channels.size(); z++) {
+        if (this->used_channels[z]) {
+            channels << z << " ";
+        }
+    }
+    const int first_trees = 64;
+    ChannelMask first_mask = getUsedChannels(first_trees);
+    channels << "(first " << first_trees << " trees:";
+    for (size_t z = 0; z < first_mask.size(); z++) {
+        if (first_mask[z]) {
+            channels << " " << z;
+        }
+    }
+    channels << ")";
+    ACF_LOG(Info) << "Detector channels:    " << channels.str();
+    ACF_LOG(Info) << "Detector window used: cols " << min_c << "-" << max_c
+            << ", rows " << min_r << "-" << max_r << " of " << window_width
+            << "x" << window_height;
+}
+
+static bool endsWith(const std::string &str, const std::string &suffix) {
+    return str.size() >= suffix.size()
+            && str.compare(str.size() - suffix.size(), suffix.size(), suffix)
+                    == 0;
+}
+
+// 读取检测器模型, 支持Piotr toolbox的.mat格式和可直接mmap的.acfm二进制格式
+bool ACFModel::Load(const std::string &modelfile) {
+    Release();
+
+    bool loaded = false;
+    if (endsWith(modelfile, ".mat")) {
+        loaded = ReadMat(modelfile);
+    } else if (endsWith(modelfile, ".acfm")) {
+        loaded = MapBinary(modelfile);
+    } else {
+        ACF_LOG(Error) << "Unsupported model " << modelfile;
+    }
+    if (!loaded) {
+        return false;
+    }
+
+    // 分析模型引用的特征通道, 未引用的通道不再计算
+    this->used_channels = getUsedChannels();
+    printFeatureUsage();
+
+    // 模型文件中不含拒绝阈值轨迹时, 读取与模型同名的轨迹文件(可选)
+    if (this->rejection_trace.empty()) {
+        ReadRejectionTrace(getRejectionTracePath(modelfile));
+    }
+    return true;
+}
+
+// 读取Piotr toolbox导出的.mat模型, 将分类器数据拷贝至该对象
+bool ACFModel::ReadMat(const std::string &modelfile) {
+    bool loaded = false;
+    const char *detector_path = modelfile.c_str();
+    mat_t *matfp = Mat_Open(detector_path, MAT_ACC_RDONLY);
+    if (matfp) {
+        matvar_t *detector = NULL;
+        matvar_t *opt = NULL;
+        matvar_t *pPyramid = NULL;
+        matvar_t *pChns = NULL;
+        matvar_t *pad = NULL;
+        matvar_t *lambdas = NULL;
+        matvar_t *shrink = NULL;
+        matvar_t *modelDs = NULL;
+        matvar_t *modelDsPad = NULL;
+        matvar_t *cascThr = NULL;
+        matvar_t *name = NULL;
+        matvar_t *clf = NULL;
+        matvar_t *treeDepth = NULL;
+        matvar_t *fids = NULL;
+        matvar_t *thrs = NULL;
+        matvar_t *child = NULL;
+        matvar_t *hs = NULL;
+
+        // 读取并打印检测器名称
+        detector = Mat_VarRead(matfp, "detector");
+        if (detector) {
+            opt = Mat_VarGetStructFieldByName(detector, "opts", 0);
+            if (opt) {
+                name = Mat_VarGetStructFieldByName(opt, "name", 0);
+                modelDs = Mat_VarGetStructFieldByName(opt, "modelDs", 0);
+                modelDsPad = Mat_VarGetStructFieldByName(opt, "modelDsPad",
+                        0);
+                cascThr = Mat_VarGetStructFieldByName(opt, "cascThr", 0);
+                pPyramid = Mat_VarGetStructFieldByName(opt, "pPyramid", 0);
+                if (pPyramid) {
+                    pad = Mat_VarGetStructFieldByName(pPyramid, "pad", 0);
+                    lambdas = Mat_VarGetStructFieldByName(pPyramid,
+                            "lambdas", 0);
+                    pChns = Mat_VarGetStructFieldByName(pPyramid, "pChns",
+                            0);
+                    if (pChns) {
+                        shrink = Mat_VarGetStructFieldByName(pChns,
+                                "shrink", 0);
+                    }
+                }
+            }
+            // 读取分类器数据
+            clf = Mat_VarGetStructFieldByName(detector, "clf", 0);
+            if (clf) {
+                treeDepth = Mat_VarGetStructFieldByName(clf, "treeDepth",
+                        0);
+                fids = Mat_VarGetStructFieldByName(clf, "fids", 0);
+                thrs = Mat_VarGetStructFieldByName(clf, "thrs", 0);
+                child = Mat_VarGetStructFieldByName(clf, "child", 0);
+                hs = Mat_VarGetStructFieldByName(clf, "hs", 0);
+            }
+        }
+
+        if (name && shrink && modelDs && modelDsPad && cascThr && fids
+                && thrs && child && hs && pad && lambdas) {
+            // 模型文件读取成功
+            ACF_LOG(Info) << "Loading detector(" << detector_path << ")... OK";
+
+            // 从MAT对象中提取数据
+            const char *detector_name = (const char *) name->data;
+            double detector_shrink = ((const double*) shrink->data)[0];
+            const double *detector_modelDs = (const double*) modelDs->data;
+            const double *detector_modelDsPad =
+                    (const double*) modelDsPad->data;
+            double *detector_lambdas = (double*) lambdas->data;
+            double *detector_pad = (double*) pad->data;
+            double detector_cascThr = ((const double*) cascThr->data)[0];
+            uint32_t detector_treeDepth =
+                    treeDepth ? ((const uint32_t*) treeDepth->data)[0] : 0;
+            uint32_t detector_nNodes = fids->dims[0];
+            uint32_t detector_nWeaks = fids->dims[1];
+            const uint32_t *detector_fids = (const uint32_t *) fids->data;
+            const float *detector_thrs = (const float *) thrs->data;
+            const uint32_t *detector_child = (const uint32_t *) child->data;
+            const float *detector_hs = (const float *) hs->data;
+
+            // 打印检测器信息
+            ACF_LOG(Info) << "Detector Name:        " << detector_name;
+            ACF_LOG(Info) << "Detector modelDs:     " << detector_modelDs[0]
+                    << "x" << detector_modelDs[1];
+            ACF_LOG(Info) << "Detector modelDsPad:  " << detector_modelDsPad[0]
+                    << "x" << detector_modelDsPad[1];
+            ACF_LOG(Info) << "Detector lambdas:     " << detector_lambdas[0]
+                    << "," << detector_lambdas[1] << ","
+                    << detector_lambdas[2];
+            ACF_LOG(Info) << "Detector pad:         " << detector_pad[0] << ","
+                    << detector_pad[1];
+            ACF_LOG(Info) << "Detector shrink:      " << detector_shrink;
+            ACF_LOG(Info) << "Detector cascThr:     " << detector_cascThr;
+            ACF_LOG(Info) << "Detector treeDepth:   " << detector_treeDepth;
+            ACF_LOG(Info) << "Detector classifier:  " << detector_nNodes << "x"
+                    << detector_nWeaks;
+
+            // 将检测器数据拷贝至该对象
+            this->name = detector_name;
+            this->model_height = (detector_modelDs[0]);
+            this->model_width = (detector_modelDs[1]);
+            this->model_height_pad = (detector_modelDsPad[0]);
+            this->model_width_pad = (detector_modelDsPad[1]);
+            this->pad_height = detector_pad[0];
+            this->pad_width = detector_pad[1];
+            this->lambdas = {detector_lambdas[0],
+                detector_lambdas[1], detector_lambdas[2]};
+            this->ModelDepth = detector_treeDepth;
+            this->shrinking = detector_shrink;
+            this->cascThr = detector_cascThr;
+            this->nTrees = detector_nWeaks;
+            this->nTreeNodes = detector_nNodes;
+
+            uint32_t *model_child = new uint32_t[detector_nNodes * detector_nWeaks];
+            uint32_t *model_fids = new uint32_t[detector_nNodes * detector_nWeaks];
+            float *model_thrs = new float[detector_nNodes * detector_nWeaks];
+            float *model_hs = new float[detector_nNodes * detector_nWeaks];
+
+            memcpy(model_child, detector_child,
+                    sizeof(uint32_t) * detector_nNodes * detector_nWeaks);
+            memcpy(model_fids, detector_fids,
+                    sizeof(uint32_t) * detector_nNodes * detector_nWeaks);
+            memcpy(model_thrs, detector_thrs,
+                    sizeof(float) * detector_nNodes * detector_nWeaks);
+            memcpy(model_hs, detector_hs,
+                    sizeof(float) * detector_nNodes * detector_nWeaks);
+
+            this->child = model_child;
+            this->fids = model_fids;
+            this->thrs = model_thrs;
+            this->hs = model_hs;
+
+            loaded = true;
+        } else {
+            // MAT文件数据格式错误
+            ACF_LOG(Error) << "MAT file wrong format: " << detector_path;
+        }
+        // 分类器数据已拷贝, 释放读取的变量(结构体字段随之释放), 热加载时每次换模型都会执行
+        Mat_VarFree(detector);
+        Mat_Close(matfp);
+    } else {
+        // 打开MAT文件失败
+        ACF_LOG(Error) << "Error opening MAT file " << detector_path;
+    }
+    return loaded;
+}
+
+// 检查.acfm模型的参数和分类器数组内容, 保证getUsedChannels和Detect不会除零或越界访问.
+// 返回错误描述, 正确时返回NULL
+static const char *checkBinaryModel(const ACFModelFileHeader *header,
+        const uint32_t *fids, const uint32_t *child) {
+    if (header->shrink <= 0) {
+        return "bad shrink";
+    }
+    int window_width = (int) header->model_width_pad / header->shrink;
+    int window_height = (int) header->model_height_pad / header->shrink;
+    if (window_width <= 0 || window_height <= 0) {
+        return "bad modelDsPad";
+    }
+    if (header->n_trees == 0 || header->n_tree_nodes == 0) {
+        return "empty classifier";
+    }
+    // 固定深度的树按完全二叉树访问节点, 需要2^(depth+1)-1个节点
+    if (header->tree_depth < 0 || header->tree_depth > 30
+            || (header->tree_depth > 0
+                    && (2ULL << header->tree_depth) - 1 > header->n_tree_nodes)) {
+        return "bad tree depth";
+    }
+
+    uint64_t n_features = (uint64_t) window_width * window_height
+            * std::tuple_size<ChannelMask>::value;
+    // 固定深度时前2^depth-1个节点读取特征; 通用遍历(含插桩编译)读取child非0的节点
+    uint32_t n_internal = header->tree_depth > 0 ?
+            (1u << header->tree_depth) - 1 : 0;
+    for (uint32_t t = 0; t < header->n_trees; t++) {
+        const uint32_t *tree_fids = fids + (uint64_t) t * header->n_tree_nodes;
+        const uint32_t *tree_child = child + (uint64_t) t * header->n_tree_nodes;
+        for (uint32_t k = 0; k < header->n_tree_nodes; k++) {
+            // 子节点为child-1和child, 须在本树内且序号大于当前节点, 否则遍历越界或不结束
+            if (tree_child[k] != 0
+                    && (tree_child[k] < k + 2
+                            || tree_child[k] >= header->n_tree_nodes)) {
+                return "child index out of range";
+            }
+            if ((tree_child[k] != 0 || k < n_internal)
+                    && tree_fids[k] >= n_features) {
+                return "feature index out of range";
+            }
+        }
+    }
+    return NULL;
+}
+
+// 映射.acfm二进制模型, 分类器数组直接指向映射的内存, 不做拷贝
+bool ACFModel::MapBinary(const std::string &modelfile) {
+    int fd = open(modelfile.c_str(), O_RDONLY);
+    if (fd < 0) {
+        ACF_LOG(Error) << "Error opening model file " << modelfile << ": "
+                << strerror(errno);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0
+            || (size_t) st.st_size < sizeof(ACFModelFileHeader)) {
+        ACF_LOG(Error) << "Model file too small: " << modelfile;
+        close(fd);
+        return false;
+    }
+    size_t map_size = st.st_size;
+    void *map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        ACF_LOG(Error) << "mmap " << modelfile << " failed: " << strerror(errno);
+        return false;
+    }
+
+    // 校验文件头, 数组范围和校验和
+    const uint8_t *base = (const uint8_t *) map;
+    const ACFModelFileHeader *header = (const ACFModelFileHeader *) map;
+    uint64_t n = (uint64_t) header->n_tree_nodes * header->n_trees;
+    auto in_file = [&](uint64_t offset, uint64_t bytes) {
+        return offset % ACF_MODEL_FILE_ALIGN == 0 && offset <= map_size
+                && bytes <= map_size - offset;
+    };
+    const char *error = NULL;
+    if (memcmp(header->magic, ACF_MODEL_FILE_MAGIC, 4) != 0) {
+        error = "bad magic";
+    } else if (header->version != ACF_MODEL_FILE_VERSION) {
+        error = "unsupported version";
+    } else if (header->header_size != sizeof(ACFModelFileHeader)
+            || header->file_size != map_size) {
+        error = "bad header";
+    } else if (!in_file(header->fids_offset, n * sizeof(uint32_t))
+            || !in_file(header->thrs_offset, n * sizeof(float))
+            || !in_file(header->child_offset, n * sizeof(uint32_t))
+            || !in_file(header->hs_offset, n * sizeof(float))
+            || (header->trace_offset != 0
+                    && !in_file(header->trace_offset,
+                            header->n_trees * sizeof(float)))) {
+        error = "array out of range";
+    } else if (header->checksum
+            != acfModelChecksum(*header, base + sizeof(ACFModelFileHeader),
+                    map_size - sizeof(ACFModelFileHeader))) {
+        error = "checksum mismatch";
+    } else {
+        error = checkBinaryModel(header,
+                (const uint32_t *) (base + header->fids_offset),
+                (const uint32_t *) (base + header->child_offset));
+    }
+    if (error) {
+        ACF_LOG(Error) << "Model file " << modelfile << ": " << error;
+        munmap(map, map_size);
+        return false;
+    }
+
+    this->name = std::string(header->name,
+            strnlen(header->name, sizeof(header->name)));
+    this->model_height = (header->model_height);
+    this->model_width = (header->model_width);
+    this->model_height_pad = (header->model_height_pad);
+    this->model_width_pad = (header->model_width_pad);
+    this->pad_height = header->pad_height;
+    this->pad_width = header->pad_width;
+    this->lambdas = {header->lambdas[0], header->lambdas[1],
+        header->lambdas[2]};
+    this->ModelDepth = header->tree_depth;
+    this->shrinking = header->shrink;
+    this->cascThr = header->casc_thr;
+    this->nTrees = header->n_trees;
+    this->nTreeNodes = header->n_tree_nodes;
+
+    this->fids = (const uint32_t *) (base + header->fids_offset);
+    this->thrs = (const float *) (base + header->thrs_offset);
+    this->child = (const uint32_t *) (base + header->child_offset);
+    this->hs = (const float *) (base + header->hs_offset);
+    if (header->trace_offset != 0) {
+        const float *trace = (const float *) (base + header->trace_offset);
+        this->rejection_trace.assign(trace, trace + header->n_trees);
+    }
+
+    this->model_map = map;
+    this->model_map_size = map_size;
+
+    ACF_LOG(Info) << "Mapping detector(" << modelfile << ")... OK";
+    ACF_LOG(Info) << "Detector Name:        " << this->name;
+    ACF_LOG(Info) << "Detector classifier:  " << this->nTreeNodes << "x"
+            << this->nTrees << ", depth " << this->ModelDepth << ", shrink "
+            << this->shrinking << ", cascThr " << this->cascThr
+            << (this->rejection_trace.empty() ? "" : ", with trace");
+    return true;
+}
+
+// 将当前模型(包括拒绝阈值轨迹)保存为.acfm二进制格式
+bool ACFModel::Write(const std::string &modelfile) const {
+    if (this->fids == NULL) {
+        return false;
+    }
+
+    uint64_t n = (uint64_t) this->nTreeNodes * this->nTrees;
+    ACFModelFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ACF_MODEL_FILE_MAGIC, 4);
+    header.version = ACF_MODEL_FILE_VERSION;
+    header.header_size = sizeof(ACFModelFileHeader);
+    strncpy(header.name, this->name.c_str(), sizeof(header.name) - 1);
+    header.model_height = this->model_height;
+    header.model_width = this->model_width;
+    header.model_height_pad = this->model_height_pad;
+    header.model_width_pad = this->model_width_pad;
+    header.pad_height = this->pad_height;
+    header.pad_width = this->pad_width;
+    for (int i = 0; i < 3; i++) {
+        header.lambdas[i] = this->lambdas[i];
+    }
+    header.shrink = this->shrinking;
+    header.tree_depth = this->ModelDepth;
+    header.casc_thr = this->cascThr;
+    header.n_tree_nodes = this->nTreeNodes;
+    header.n_trees = this->nTrees;
+
+    // 依次排列各数组, 每个数组16字节对齐
+    std::vector<uint8_t> data;
+    auto append = [&](const void *array, size_t bytes) {
+        uint64_t offset = acfModelAlign(sizeof(header) + data.size());
+        data.resize(offset - sizeof(header), 0);
+        data.insert(data.end(), (const uint8_t *) array,
+                (const uint8_t *) array + bytes);
+        return offset;
+    };
+    header.fids_offset = append(this->fids, n * sizeof(uint32_t));
+    header.thrs_offset = append(this->thrs, n * sizeof(float));
+    header.child_offset = append(this->child, n * sizeof(uint32_t));
+    header.hs_offset = append(this->hs, n * sizeof(float));
+    if (!this->rejection_trace.empty()) {
+        header.trace_offset = append(this->rejection_trace.data(),
+                this->rejection_trace.size() * sizeof(float));
+    }
+    header.file_size = sizeof(header) + data.size();
+    header.checksum = acfModelChecksum(header, data.data(), data.size());
+
+    // 先写入临时文件再重命名, 已映射该文件的进程不会读到写了一半的数据
+    std::string tmpfile = modelfile + ".tmp";
+    std::ofstream out(tmpfile, std::ios::binary);
+    if (!out) {
+        return false;
+    }
+    out.write((const char *) &header, sizeof(header));
+    out.write((const char *) data.data(), data.size());
+    out.close();
+    if (!out || rename(tmpfile.c_str(), modelfile.c_str()) != 0) {
+        unlink(tmpfile.c_str());
+        return false;
+    }
+    return true;
+}
+
+// 释放当前模型数据, .acfm模型解除映射, .mat模型释放拷贝的数组
+void ACFModel::Release() {
+    if (this->model_map != NULL) {
+        munmap(this->model_map, this->model_map_size);
+        this->model_map = NULL;
+        this->model_map_size = 0;
+    } else {
+        delete[] this->thrs;
+        delete[] this->hs;
+        delete[] this->fids;
+        delete[] this->child;
+    }
+    this->thrs = NULL;
+    this->hs = NULL;
+    this->fids = NULL;
+    this->child = NULL;
+    this->rejection_trace.clear();
+}
+
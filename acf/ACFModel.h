@@ -0,0 +1,91 @@
+/*
+ * ACFModel.h
+ */
+
+#ifndef ACFMODEL_H_
+#define ACFMODEL_H_
+
+#include <array>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "ChannelFeatures.h"
+
+/*
+ * 检测器模型: 分类器数组, 金字塔参数以及离线标定的拒绝阈值轨迹.
+ * 加载完成后不再修改, 由ACFDetector通过std::shared_ptr<const ACFModel>引用,
+ * 因此可以在其他线程中加载新模型, 再整体替换正在使用的模型.
+ */
+class ACFModel {
+public:
+    // 加载.mat或.acfm模型, 失败时isLoaded()返回false
+    ACFModel(const std::string &modelfile);
+    ~ACFModel();
+
+    ACFModel(const ACFModel&) = delete;
+    ACFModel& operator=(const ACFModel&) = delete;
+
+    bool isLoaded() const {
+        return this->fids != NULL;
+    }
+
+    // 将模型保存为可直接mmap的.acfm二进制格式
+    bool Write(const std::string &modelfile) const;
+
+    // 统计前n_first_trees棵树(<0表示全部)引用的特征通道
+    ChannelMask getUsedChannels(int n_first_trees = -1) const;
+
+    // 拒绝阈值轨迹与模型文件同名, 扩展名为.trace
+    static std::string getRejectionTracePath(const std::string &modelfile);
+    static bool WriteRejectionTrace(const std::string &tracefile,
+            const std::vector<float> &trace);
+
+    std::string path;
+    std::string name;
+
+    float model_width = 0, model_height = 0;
+    float model_width_pad = 0, model_height_pad = 0;
+    int pad_width = 0;
+    int pad_height = 0;
+    std::array<double, 3> lambdas;
+    int shrinking = 0;
+    int ModelDepth = 0;
+    //! 模型中的cascThr
+    double cascThr = 0;
+
+    int nTrees = 0;
+    int nTreeNodes = 0;
+
+    //! 分类器数组, 指向.mat模型拷贝得到的内存或.acfm模型的映射区域
+    const float *thrs = NULL;
+    const float *hs = NULL;
+    const uint32_t *fids = NULL;
+    const uint32_t *child = NULL;
+
+    //! 每棵树之后的拒绝阈值轨迹(离线标定), 为空时仅使用cascThr
+    std::vector<float> rejection_trace;
+
+    //! 模型引用的特征通道, 其余通道在特征金字塔中不计算
+    ChannelMask used_channels = allChannels();
+
+private:
+
+    bool Load(const std::string &modelfile);
+
+    bool ReadMat(const std::string &modelfile);
+
+    bool MapBinary(const std::string &modelfile);
+
+    void Release();
+
+    bool ReadRejectionTrace(const std::string &tracefile);
+
+    void printFeatureUsage() const;
+
+    //! .acfm模型的映射区域, 为NULL时上述数组由new[]分配
+    void *model_map = NULL;
+    size_t model_map_size = 0;
+};
+
+#endif /* ACFMODEL_H_ */
@@ -0,0 +1,74 @@
+/*
+ * ACFModelFile.h
+ *
+ * 二进制检测器模型格式(.acfm). 文件由固定长度的文件头和若干16字节对齐的数组组成,
+ * 数组与ACFDetector::Detect使用的布局完全一致(按树连续存放各节点), 因此加载时直接
+ * mmap文件, 无需解析和拷贝, 多个检测进程可共享同一份物理内存页.
+ *
+ * 数据按本机字节序存储, 由acf_convert_model从Piotr toolbox的.mat模型转换得到.
+ */
+
+#ifndef ACFMODELFILE_H_
+#define ACFMODELFILE_H_
+
+#include <cstdint>
+#include <cstddef>
+
+static const char ACF_MODEL_FILE_MAGIC[4] = { 'A', 'C', 'F', 'M' };
+static const uint32_t ACF_MODEL_FILE_VERSION = 2;
+static const uint32_t ACF_MODEL_FILE_ALIGN = 16;
+
+struct ACFModelFileHeader {
+    char magic[4];              // "ACFM"
+    uint32_t version;           // ACF_MODEL_FILE_VERSION
+    uint32_t header_size;       // sizeof(ACFModelFileHeader), 用于检查结构体布局
+    uint32_t checksum;          // 整个文件的FNV-1a校验和, 计算时本字段按0处理
+    uint64_t file_size;         // 文件总字节数
+
+    char name[64];              // 检测器名称, 以'\0'结尾
+
+    float model_height, model_width;            // modelDs
+    float model_height_pad, model_width_pad;    // modelDsPad
+    int32_t pad_height, pad_width;              // pPyramid.pad
+    double lambdas[3];                          // pPyramid.lambdas
+    int32_t shrink;                             // pPyramid.pChns.shrink
+    int32_t tree_depth;                         // clf.treeDepth
+    double casc_thr;                            // cascThr
+
+    uint32_t n_tree_nodes;      // 每棵树的节点数
+    uint32_t n_trees;           // 树的数量
+
+    // 各数组相对文件起始处的偏移量, 长度均为n_tree_nodes * n_trees
+    uint64_t fids_offset;       // uint32_t
+    uint64_t thrs_offset;       // float
+    uint64_t child_offset;      // uint32_t
+    uint64_t hs_offset;         // float
+    // 逐树拒绝阈值轨迹, 长度为n_trees, 0表示不含轨迹
+    uint64_t trace_offset;      // float
+};
+
+// FNV-1a 32位校验和, hash为上一段数据的结果时可分段计算
+static inline uint32_t acfModelChecksum(const uint8_t *data, size_t size,
+        uint32_t hash = 2166136261u) {
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// 文件校验和: 依次计算checksum置0的文件头和其后的全部数据
+static inline uint32_t acfModelChecksum(const ACFModelFileHeader &header,
+        const uint8_t *data, size_t size) {
+    ACFModelFileHeader copy = header;
+    copy.checksum = 0;
+    return acfModelChecksum(data, size,
+            acfModelChecksum((const uint8_t *) &copy, sizeof(copy)));
+}
+
+static inline uint64_t acfModelAlign(uint64_t offset) {
+    return (offset + ACF_MODEL_FILE_ALIGN - 1) / ACF_MODEL_FILE_ALIGN
+            * ACF_MODEL_FILE_ALIGN;
+}
+
+#endif /* ACFMODELFILE_H_ */
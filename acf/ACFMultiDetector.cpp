@@ -0,0 +1,121 @@
+/*
+ * ACFMultiDetector.cpp
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+
+#include "ACFMultiDetector.h"
+#include "../general/LatencyStats.h"
+#include "../general/Logger.h"
+
+ACFMultiDetector::~ACFMultiDetector() {
+    for (ACFDetector *detector : detectors) {
+        delete detector;
+    }
+    if (feature_pyramid) {
+        delete feature_pyramid;
+        feature_pyramid = NULL;
+    }
+}
+
+bool ACFMultiDetector::isCompatible(const ACFModel &a, const ACFModel &b) {
+    return a.shrinking == b.shrinking && a.lambdas == b.lambdas
+            && a.pad_width == b.pad_width && a.pad_height == b.pad_height;
+}
+
+bool ACFMultiDetector::addModel(const std::string &modelfile) {
+    ACFDetector *detector = new ACFDetector(modelfile);
+    std::shared_ptr<const ACFModel> model = detector->getModel();
+    if (!model->isLoaded()) {
+        delete detector;
+        return false;
+    }
+    if (!detectors.empty()
+            && !isCompatible(*detectors[0]->getModel(), *model)) {
+        ACF_LOG(Warn) << "Model " << modelfile
+                << " cannot share the feature pyramid (shrink/lambdas/pad differ)";
+        delete detector;
+        return false;
+    }
+    detectors.push_back(detector);
+    active.push_back(true);
+    return true;
+}
+
+std::vector<DetectionList> ACFMultiDetector::applyDetectors(
+        const cv::Mat &Frame) {
+    std::vector<DetectionList> results(detectors.size());
+    cv::Size frame_size = ACFFeaturePyramid::imageSize(Frame);
+
+    // 切换至已发布的模型, 以第一个有效模型为基准选出可共用金字塔的检测器
+    const ACFModel *base = NULL;
+    cv::Size min_size(INT_MAX, INT_MAX);
+    ChannelMask channels;
+    channels.fill(false);
+    bool cache_valid = true;
+    std::vector<bool> selected(detectors.size(), false);
+    for (size_t i = 0; i < detectors.size(); i++) {
+        if (!detectors[i]->updateModel()) {
+            continue;
+        }
+        const ACFModel &model = *detectors[i]->getModel();
+        if (base == NULL) {
+            base = &model;
+        }
+        selected[i] = isCompatible(*base, model);
+        if (selected[i] != active[i]) {
+            active[i] = selected[i];
+            ACF_LOG(Info) << "Model " << model.path
+                    << (selected[i] ? " rejoins" : " no longer shares")
+                    << " the feature pyramid";
+        }
+        if (!selected[i]) {
+            continue;
+        }
+        min_size.width = std::min(min_size.width, (int) model.model_width);
+        min_size.height = std::min(min_size.height, (int) model.model_height);
+        for (size_t z = 0; z < channels.size(); z++) {
+            channels[z] = channels[z] || model.used_channels[z];
+        }
+        cache_valid = cache_valid && detectors[i]->isCacheValid(frame_size);
+    }
+    if (base == NULL) {
+        return results;
+    }
+    // 参与检测的模型变化时金字塔的尺度随之变化, 缓存的检测结果失效
+    cache_valid = cache_valid && min_size == last_min_size;
+    last_min_size = min_size;
+
+    static LatencyHistogram &features_hist = LatencyStats::get(
+            "detector.features");
+    int64_t measure_time = LatencyHistogram::now_ns();
+
+    // 计算共用的特征金字塔
+    if (feature_pyramid) {
+        delete feature_pyramid;
+        feature_pyramid = NULL;
+    }
+    feature_pyramid = new ACFFeaturePyramid(Frame, pyramid_options, min_size,
+            base->shrinking, base->lambdas, base->pad_width,
+            base->pad_height, frame_index,
+            cache_valid ? max_refresh_period : 1, channels);
+    frame_index++;
+
+    int64_t calc_feature_ns = LatencyHistogram::now_ns() - measure_time;
+    features_hist.record(calc_feature_ns);
+    calc_feature_ms = calc_feature_ns / 1e6f;
+
+    // 各检测器依次在同一金字塔上检测, 每个检测器内部按层并行
+    apply_classifier_ms = 0;
+    for (size_t i = 0; i < detectors.size(); i++) {
+        if (selected[i]) {
+            results[i] = detectors[i]->detectPyramid(*feature_pyramid,
+                    frame_size);
+            apply_classifier_ms += detectors[i]->apply_classifier_ms;
+        }
+    }
+
+    return results;
+}
@@ -0,0 +1,66 @@
+/*
+ * ACFMultiDetector.h
+ */
+
+#ifndef ACFMULTIDETECTOR_H_
+#define ACFMULTIDETECTOR_H_
+
+#include <vector>
+#include <string>
+
+#include "ACFDetector.h"
+
+/*
+ * 多个检测器共用一个特征金字塔: 各模型的shrink, lambdas和pad须一致,
+ * 金字塔的最小尺寸取各模型中最小的, 计算的通道取各模型引用通道的并集.
+ * 每个模型的检测结果单独返回, 并以模型名称标记(Detection::getModelName).
+ */
+class ACFMultiDetector {
+public:
+    ACFMultiDetector() {
+    }
+    ~ACFMultiDetector();
+
+    ACFMultiDetector(const ACFMultiDetector&) = delete;
+    ACFMultiDetector& operator=(const ACFMultiDetector&) = delete;
+
+    // 加载模型并添加检测器, 模型无效或与已添加的模型不兼容时返回false
+    bool addModel(const std::string &modelfile);
+
+    size_t getDetectorCount() const {
+        return this->detectors.size();
+    }
+
+    // 用于设置各检测器的参数(如modifyCascade)或附加ModelWatcher
+    ACFDetector& getDetector(size_t i) {
+        return *this->detectors.at(i);
+    }
+
+    // 返回与addModel顺序一致的各模型检测结果, 不兼容(如热更新后)的模型返回空列表
+    std::vector<DetectionList> applyDetectors(const cv::Mat &Frame);
+
+    // shrink, lambdas和pad一致的模型才能共用特征金字塔
+    static bool isCompatible(const ACFModel &a, const ACFModel &b);
+
+    ACFFeaturePyramid *feature_pyramid = NULL;
+    // 本帧的耗时(ms), 由纳秒计时换算, 滚动统计见LatencyStats中的detector.*
+    float calc_feature_ms = 0;
+    float apply_classifier_ms = 0;
+
+    // 特征金字塔的尺度配置
+    PyramidOptions pyramid_options;
+
+    // 精细尺度的最大刷新周期(帧), 1表示每帧计算全部尺度
+    int max_refresh_period = 1;
+
+private:
+    std::vector<ACFDetector*> detectors;
+    //! 上一帧各检测器是否参与检测, 用于仅在状态变化时打印提示
+    std::vector<bool> active;
+
+    // 尺度调度状态, 金字塔最小尺寸变化时需重新计算全部尺度
+    int frame_index = 0;
+    cv::Size last_min_size;
+};
+
+#endif /* ACFMULTIDETECTOR_H_ */
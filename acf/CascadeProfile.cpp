@@ -0,0 +1,105 @@
+/*
+ * CascadeProfile.cpp
+ */
+
+#include <fstream>
+#include <iomanip>
+
+#include "CascadeProfile.h"
+
+CascadeProfile::CascadeProfile(int n_trees, int n_channels, int model_width,
+        int model_height) :
+        n_trees(n_trees), n_channels(n_channels), model_width(model_width), model_height(
+                model_height), counters([=]() {
+            Counters c;
+            c.fid_counts.assign(n_channels * model_width * model_height, 0);
+            return c;
+        }) {
+}
+
+void CascadeProfile::clear() {
+    this->counters.clear();
+}
+
+// 输出格式:
+//   layer <layer> windows <n> avg_trees <avg> passed <n>
+//   exit <layer> <tree> <count>              (仅输出非零项, tree == n_trees表示通过)
+//   channel <channel> reads <count>
+//   feature <channel> <col> <row> <count>    (仅输出非零项)
+bool CascadeProfile::dump(const std::string &filepath) const {
+    // 合并各线程的计数
+    std::vector<std::vector<uint64_t>> exit_hist;
+    std::vector<uint64_t> fid_counts(n_channels * model_width * model_height,
+            0);
+    for (const Counters &c : this->counters) {
+        if (c.exit_hist.size() > exit_hist.size()) {
+            exit_hist.resize(c.exit_hist.size());
+        }
+        for (size_t l = 0; l < c.exit_hist.size(); l++) {
+            if (c.exit_hist[l].empty()) {
+                continue;
+            }
+            if (exit_hist[l].empty()) {
+                exit_hist[l].assign(n_trees + 1, 0);
+            }
+            for (size_t t = 0; t < c.exit_hist[l].size(); t++) {
+                exit_hist[l][t] += c.exit_hist[l][t];
+            }
+        }
+        for (size_t f = 0; f < c.fid_counts.size(); f++) {
+            fid_counts[f] += c.fid_counts[f];
+        }
+    }
+
+    std::ofstream out(filepath);
+    if (!out) {
+        return false;
+    }
+
+    out << "# trees " << n_trees << " channels " << n_channels << " window "
+            << model_width << "x" << model_height << std::endl;
+    for (size_t l = 0; l < exit_hist.size(); l++) {
+        uint64_t windows = 0, trees = 0;
+        for (size_t t = 0; t < exit_hist[l].size(); t++) {
+            windows += exit_hist[l][t];
+            // 在第t棵树退出时共评估了t+1棵树
+            trees += exit_hist[l][t] * std::min<uint64_t>(t + 1, n_trees);
+        }
+        out << "layer " << l << " windows " << windows << " avg_trees "
+                << std::fixed << std::setprecision(2)
+                << (windows ? (double) trees / windows : 0.0) << " passed "
+                << (exit_hist[l].empty() ? 0 : exit_hist[l][n_trees])
+                << std::endl;
+    }
+    for (size_t l = 0; l < exit_hist.size(); l++) {
+        for (size_t t = 0; t < exit_hist[l].size(); t++) {
+            if (exit_hist[l][t]) {
+                out << "exit " << l << " " << t << " " << exit_hist[l][t]
+                        << std::endl;
+            }
+        }
+    }
+
+    // fid的排列方式与cids一致: 通道->列->行
+    int window_size = model_width * model_height;
+    for (int z = 0; z < n_channels; z++) {
+        uint64_t reads = 0;
+        for (int i = 0; i < window_size; i++) {
+            reads += fid_counts[z * window_size + i];
+        }
+        out << "channel " << z << " reads " << reads << std::endl;
+    }
+    for (int z = 0; z < n_channels; z++) {
+        for (int c = 0; c < model_width; c++) {
+            for (int r = 0; r < model_height; r++) {
+                uint64_t n = fid_counts[z * window_size + c * model_height + r];
+                if (n) {
+                    out << "feature " << z << " " << c << " " << r << " " << n
+                            << std::endl;
+                }
+            }
+        }
+    }
+
+    return static_cast<bool>(out);
+}
@@ -0,0 +1,67 @@
+/*
+ * CascadeProfile.h
+ */
+
+#ifndef CASCADEPROFILE_H_
+#define CASCADEPROFILE_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <tbb/enumerable_thread_specific.h>
+
+/*
+ * 级联分类器的统计信息, 仅在插桩编译(ACF_INSTRUMENT)时由ACFDetector::Detect收集:
+ * 每个金字塔层上各窗口退出的树序号直方图, 以及每个特征(通道+窗口内偏移)被读取的次数.
+ * 各线程在自己的计数器上累加, 导出时再合并, 因此不影响并行检测.
+ */
+class CascadeProfile {
+public:
+    struct Counters {
+        // exit_hist[layer][t]: 在第t棵树退出的窗口数量, t == n_trees表示通过全部树
+        std::vector<std::vector<uint64_t>> exit_hist;
+        // fid_counts[fid]: 特征fid被读取的次数
+        std::vector<uint64_t> fid_counts;
+
+        void addWindow(int layer, int exit_tree, int n_trees) {
+            if ((size_t) layer >= exit_hist.size()) {
+                exit_hist.resize(layer + 1);
+            }
+            if (exit_hist[layer].empty()) {
+                exit_hist[layer].assign(n_trees + 1, 0);
+            }
+            exit_hist[layer][exit_tree]++;
+        }
+    };
+
+    // model_width/model_height为特征图上的窗口尺寸(modelDsPad / shrink)
+    CascadeProfile(int n_trees, int n_channels, int model_width,
+            int model_height);
+
+    // 当前线程的计数器
+    Counters& local() {
+        return this->counters.local();
+    }
+
+    void clear();
+
+    // 统计的结构是否与给定的模型尺寸一致, 一致时换模型后可以继续累加
+    bool sameShape(int n_trees, int n_channels, int model_width,
+            int model_height) const {
+        return this->n_trees == n_trees && this->n_channels == n_channels
+                && this->model_width == model_width
+                && this->model_height == model_height;
+    }
+
+    // 将统计结果写入文本文件
+    bool dump(const std::string &filepath) const;
+
+private:
+    int n_trees;
+    int n_channels;
+    int model_width, model_height;
+    mutable tbb::enumerable_thread_specific<Counters> counters;
+};
+
+#endif /* CASCADEPROFILE_H_ */
@@ -4,53 +4,87 @@
 
 #include <cstring>
 #include <chrono>
+#include <memory>
 #include <stdexcept>
 
 #include <opencv2/opencv.hpp>
 #include <tbb/tbb.h>
 
 #include "../low-level/Functions.h"
+#include "../general/LatencyStats.h"
+#include "../general/TraceRecorder.h"
+#include "../general/PerfCounters.h"
 #include "ChannelFeatures.h"
 
 #define USE_TBB
 
 // 直接计算多通道特征图, 输入图像的释放不由ChannelFeatures处理
+// channel_mask中未被模型使用的通道不进行计算和降采样
 ChannelFeatures::ChannelFeatures(float* image_yuv, size_t image_width,
-        size_t image_height, int _shrink) :
+        size_t image_height, int _shrink, const ChannelMask &channel_mask) :
         image_luv(image_yuv), shrink(_shrink), channel_height(
                 image_height / _shrink), channel_width(image_width / _shrink), n_channels(
-                0), chns(NULL) {
-    auto measure_time = std::chrono::high_resolution_clock::now();
-    ColorChannel luv_channel(image_yuv, image_width, image_height);
-    color_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::high_resolution_clock::now() - measure_time).count();
+                0), chns(NULL), channel_mask(channel_mask), smooth_ns(0), pad_ns(
+                0) {
+    // 梯度方向直方图依赖梯度幅值和方向
+    bool need_hist = false;
+    for (int i = 4; i < 10; i++) {
+        need_hist = need_hist || channel_mask[i];
+    }
+    bool need_mag = channel_mask[3] || need_hist;
+
+    static LatencyHistogram &color_hist = LatencyStats::get("layer.color");
+    static LatencyHistogram &mag_hist = LatencyStats::get("layer.mag");
+    static LatencyHistogram &hist_hist = LatencyStats::get("layer.hist");
+    static PerfStage &mag_perf = PerfCounters::get("gradMag");
+    static PerfStage &hist_perf = PerfCounters::get("gradHist");
 
-    measure_time = std::chrono::high_resolution_clock::now();
-    GradMagChannel grad_mag_channel(luv_channel);
-    mag_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::high_resolution_clock::now() - measure_time).count();
+    TraceScope trace_init("layer.channels");
+    int64_t measure_time = LatencyHistogram::now_ns();
+    ColorChannel luv_channel(image_yuv, image_width, image_height);
+    color_ns = LatencyHistogram::now_ns() - measure_time;
 
-    measure_time = std::chrono::high_resolution_clock::now();
-    GradHistChannel grad_hist_channel(grad_mag_channel, this->shrink);
-    hist_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::high_resolution_clock::now() - measure_time).count();
+    measure_time = LatencyHistogram::now_ns();
+    std::unique_ptr<GradMagChannel> grad_mag_channel;
+    if (need_mag) {
+        ScopedPerf perf(mag_perf, image_width * image_height);
+        grad_mag_channel.reset(new GradMagChannel(luv_channel));
+    }
+    mag_ns = LatencyHistogram::now_ns() - measure_time;
+
+    measure_time = LatencyHistogram::now_ns();
+    std::unique_ptr<GradHistChannel> grad_hist_channel;
+    if (need_hist) {
+        ScopedPerf perf(hist_perf, image_width * image_height);
+        grad_hist_channel.reset(
+                new GradHistChannel(*grad_mag_channel, this->shrink));
+    }
+    hist_ns = LatencyHistogram::now_ns() - measure_time;
 
-    measure_time = std::chrono::high_resolution_clock::now();
+    measure_time = LatencyHistogram::now_ns();
     this->addChannelFeatures(luv_channel);
-    color_duration += std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::high_resolution_clock::now() - measure_time).count();
+    color_ns += LatencyHistogram::now_ns() - measure_time;
 
-    measure_time = std::chrono::high_resolution_clock::now();
-    this->addChannelFeatures(grad_mag_channel);
-    mag_duration += std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::high_resolution_clock::now() - measure_time).count();
+    measure_time = LatencyHistogram::now_ns();
+    if (grad_mag_channel) {
+        this->addChannelFeatures(*grad_mag_channel);
+    } else {
+        this->addSkippedChannels(1);
+    }
+    mag_ns += LatencyHistogram::now_ns() - measure_time;
 
-    measure_time = std::chrono::high_resolution_clock::now();
-    this->addChannelFeatures(grad_hist_channel);
-    hist_duration += std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::high_resolution_clock::now() - measure_time).count();
+    measure_time = LatencyHistogram::now_ns();
+    if (grad_hist_channel) {
+        this->addChannelFeatures(*grad_hist_channel);
+    } else {
+        this->addSkippedChannels(6);
+    }
+    hist_ns += LatencyHistogram::now_ns() - measure_time;
 
-    init_duration = color_duration + mag_duration + hist_duration;
+    init_ns = color_ns + mag_ns + hist_ns;
+    color_hist.record(color_ns);
+    mag_hist.record(mag_ns);
+    hist_hist.record(hist_ns);
 }
 
 // 添加通道特征, 若尺寸不匹配则进行降采样
@@ -70,6 +104,10 @@ void ChannelFeatures::addChannelFeatures(Channel &ch) {
         cv::Mat source_mat;
         cv::Mat scaled_mat;
         for (size_t i = 0; i < ch.getnChns(); i++) {
+            // 模型未使用的通道不进行降采样
+            if (!this->channel_mask[this->n_channels + i]) {
+                continue;
+            }
             source_mat = cv::Mat(ch.getWidth(), ch.getHeight(), CV_32FC1,
                     (float *) ch.getData()
                             + ch.getWidth() * ch.getHeight() * i);
@@ -100,8 +138,12 @@ void ChannelFeatures::addChannelFeatures(Channel &ch) {
         data = ch.getData();
     }
     for (int c = 0; c < ch.getnChns(); c++) {
-        this->features.push_back(
-                data + c * this->channel_height * this->channel_width);
+        if (this->channel_mask[this->n_channels + c]) {
+            this->features.push_back(
+                    data + c * this->channel_height * this->channel_width);
+        } else {
+            this->features.push_back(NULL);
+        }
     }
     if (data != this->image_luv) {
         this->pointers.push_back(data);
@@ -109,14 +151,23 @@ void ChannelFeatures::addChannelFeatures(Channel &ch) {
     this->n_channels += ch.getnChns();
 }
 
+// 添加未计算的通道占位, 保持通道排列不变
+void ChannelFeatures::addSkippedChannels(int n) {
+    for (int c = 0; c < n; c++) {
+        this->features.push_back(NULL);
+    }
+    this->n_channels += n;
+}
+
 // 通过降采样计算多通道特征图, lambdas: {lambdas_LUV, lambdas_GradMag, lambdas_GradHist}
 ChannelFeatures::ChannelFeatures(const ChannelFeatures &real_channels,
         int scaled_width, int scaled_height,
         const std::array<double, 3>& lambdas) :
         image_luv(NULL), channel_width(scaled_width / real_channels.shrink), channel_height(
                 scaled_height / real_channels.shrink), shrink(
-                real_channels.shrink), n_channels(real_channels.n_channels) {
-    auto measure_time = std::chrono::high_resolution_clock::now();
+                real_channels.shrink), n_channels(real_channels.n_channels), channel_mask(
+                real_channels.channel_mask), smooth_ns(0), pad_ns(0) {
+    int64_t measure_time = LatencyHistogram::now_ns();
 
     // 计算各个通道的系数
     float scale_NofR = (((float) channel_width / real_channels.channel_width)
@@ -132,6 +183,10 @@ ChannelFeatures::ChannelFeatures(const ChannelFeatures &real_channels,
     }
 
     for (size_t i = 0; i < this->n_channels; i++) {
+        if (!this->channel_mask[i]) {
+            features.push_back(NULL);
+            continue;
+        }
         // 申请连续的内存空间
         float* channel = (float*) aligned_alloc(16,
                 channel_width * channel_height * sizeof(float));
@@ -149,15 +204,17 @@ ChannelFeatures::ChannelFeatures(const ChannelFeatures &real_channels,
 #else
             for (size_t i = 0; i < n_channels; i++) {
 #endif
-            const cv::Mat source_mat = cv::Mat(real_channels.channel_width,
-                    real_channels.channel_height, CV_32FC1,
-                    (float*)real_channels.features[i]);
-            cv::Mat scaled_mat = cv::Mat(channel_width, channel_height, CV_32FC1,
-                    features[i]);
-            cv::resize(source_mat, scaled_mat,
-                    cv::Size(channel_height, channel_width));
-            if (std::abs(ratios[i] - 1.0) > 0.001) {
-                scaled_mat *= ratios[i];
+            if (features[i] != NULL) {
+                const cv::Mat source_mat = cv::Mat(real_channels.channel_width,
+                        real_channels.channel_height, CV_32FC1,
+                        (float*)real_channels.features[i]);
+                cv::Mat scaled_mat = cv::Mat(channel_width, channel_height, CV_32FC1,
+                        features[i]);
+                cv::resize(source_mat, scaled_mat,
+                        cv::Size(channel_height, channel_width));
+                if (std::abs(ratios[i] - 1.0) > 0.001) {
+                    scaled_mat *= ratios[i];
+                }
             }
 #ifdef USE_TBB
         });
@@ -165,9 +222,9 @@ ChannelFeatures::ChannelFeatures(const ChannelFeatures &real_channels,
         }
 #endif
 
-            init_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::high_resolution_clock::now() - measure_time)
-.    count();
+    init_ns = LatencyHistogram::now_ns() - measure_time;
+    static LatencyHistogram &approx_hist = LatencyStats::get("layer.approx");
+    approx_hist.record(init_ns);
 }
 
 // 连接所有通道, 并填充边缘像素
@@ -182,15 +239,38 @@ void ChannelFeatures::SmoothPadAndConcatChannel(int padLR, int padTB) {
         throw std::runtime_error("Failed to aligned_alloc chns");
     }
 
+    // 模型未使用的通道不进行平滑和填充, 置零即可
+    std::vector<size_t> active_channels;
+    for (size_t i = 0; i < n_channels; i++) {
+        if (this->channel_mask[i]) {
+            active_channels.push_back(i);
+        } else {
+            features[i] = this->chns
+                    + (this->channel_width + padLR * 2)
+                            * (this->channel_height + padTB * 2) * i;
+            memset(features[i], 0,
+                    (this->channel_width + padLR * 2)
+                            * (this->channel_height + padTB * 2)
+                            * sizeof(float));
+        }
+    }
+
+    static LatencyHistogram &smooth_hist = LatencyStats::get("layer.smooth");
+    static LatencyHistogram &pad_hist = LatencyStats::get("layer.pad");
+    static PerfStage &smooth_pad_perf = PerfCounters::get("smoothPad");
+
     // serial 157ms, par 133ms
-    smooth_duration = 0;
-    pad_duration = 0;
+    smooth_ns = 0;
+    pad_ns = 0;
 #ifdef USE_TBB
-    tbb::parallel_for(size_t(0), size_t(n_channels), [&](size_t i) {
+    tbb::parallel_for(size_t(0), active_channels.size(), [&](size_t n) {
 #else
-            for (int i = 0; i < n_channels; i++) {
+            for (size_t n = 0; n < active_channels.size(); n++) {
 #endif
-            auto measure_time = std::chrono::high_resolution_clock::now();
+            size_t i = active_channels[n];
+            TraceScope trace_channel("channel.smooth_pad", i);
+            ScopedPerf perf(smooth_pad_perf, channel_width * channel_height);
+            int64_t measure_time = LatencyHistogram::now_ns();
 
             float* smoothed = (float*) aligned_alloc(16,
                     channel_width * channel_height * sizeof(float));
@@ -203,10 +283,9 @@ void ChannelFeatures::SmoothPadAndConcatChannel(int padLR, int padTB) {
                     channel_width, 1, 2, 1);
 //            memcpy(smoothed, this->features[i], channel_width * channel_height * sizeof(float));
 
-            smooth_duration += std::chrono::duration_cast<std::chrono::milliseconds>(
-                    std::chrono::high_resolution_clock::now() - measure_time).count();
+            smooth_ns += LatencyHistogram::now_ns() - measure_time;
 
-            measure_time = std::chrono::high_resolution_clock::now();
+            measure_time = LatencyHistogram::now_ns();
 
 // 调用OpenCV函数进行图像填充, 准备cv::Mat对象
             cv::Mat src = cv::Mat(this->channel_width, this->channel_height,
@@ -228,8 +307,7 @@ void ChannelFeatures::SmoothPadAndConcatChannel(int padLR, int padTB) {
                         cv::BORDER_CONSTANT, 0);
             }
 
-            pad_duration += std::chrono::duration_cast<std::chrono::milliseconds>(
-                    std::chrono::high_resolution_clock::now() - measure_time).count();
+            pad_ns += LatencyHistogram::now_ns() - measure_time;
 
             free(smoothed);
             if (!dst.isContinuous()) {
@@ -244,6 +322,8 @@ void ChannelFeatures::SmoothPadAndConcatChannel(int padLR, int padTB) {
 #else
         }
 #endif
+    smooth_hist.record(smooth_ns);
+    pad_hist.record(pad_ns);
 
             // 修改通道尺寸
             this->channel_height += 2 * padTB;
@@ -7,6 +7,8 @@
 #include <array>
 #include <iostream>
 #include <chrono>
+#include <atomic>
+#include <cstdint>
 
 #include <opencv2/opencv.hpp>
 
@@ -15,6 +17,15 @@
 #include "GradMagChannel.h"
 #include "GradHistChannel.h"
 
+// 10个特征通道(LUV, 梯度幅值, 6个梯度方向直方图)是否需要计算, 由模型引用的特征决定
+typedef std::array<bool, 10> ChannelMask;
+
+static inline ChannelMask allChannels() {
+    ChannelMask mask;
+    mask.fill(true);
+    return mask;
+}
+
 /*
  * This class will be used to generate the features. By hiding the implementation details of the channels,
  * we can avoid having memory-leaks due to users who are not familiar with the channel-functions (which are
@@ -25,7 +36,8 @@ public:
     friend class SqrtChannelFeatures;
 
     ChannelFeatures(float* image_yuv, size_t image_width,
-            size_t image_height, int shrinking);
+            size_t image_height, int shrinking,
+            const ChannelMask &channel_mask = allChannels());
 
     ChannelFeatures(const ChannelFeatures &real_channels, int scaled_width,
             int scaled_height, const std::array<double, 3>& lambdas);
@@ -99,14 +111,22 @@ public:
 
     float *chns = NULL;
     const float *image_luv;
-    int color_duration = -1;
-    int mag_duration = -1;
-    int hist_duration = -1;
-    int init_duration = -1;
-    int smooth_duration = -1;
-    int pad_duration = -1;
+    // 各步骤耗时(ns), 同时记入LatencyStats中的layer.*统计项
+    // smooth和pad在parallel_for中按通道累加, 因此为原子变量
+    int64_t color_ns = 0;
+    int64_t mag_ns = 0;
+    int64_t hist_ns = 0;
+    int64_t init_ns = 0;
+    std::atomic<int64_t> smooth_ns;
+    std::atomic<int64_t> pad_ns;
+
+    int64_t total_ns() const {
+        return init_ns + smooth_ns.load() + pad_ns.load();
+    }
 private:
     void addChannelFeatures(Channel &ch);
+    void addSkippedChannels(int n);
+    ChannelMask channel_mask;
     std::vector<const float*> pointers;
     std::vector<float*> features;
     int shrink;
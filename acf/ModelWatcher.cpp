@@ -0,0 +1,84 @@
+/*
+ * ModelWatcher.cpp
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+
+#include "ModelWatcher.h"
+#include "../general/Logger.h"
+
+ModelWatcher::ModelWatcher(const std::string &modelfile,
+        ACFDetector &detector) :
+        ModelWatcher(modelfile, [&detector](const std::string &path) {
+            return detector.reloadModel(path);
+        }) {
+}
+
+ModelWatcher::ModelWatcher(const std::string &modelfile,
+        std::function<bool(const std::string&)> reload) :
+        modelfile(modelfile), reload(reload), stop_flag(false) {
+    watch_thread = std::thread(&ModelWatcher::run, this);
+}
+
+ModelWatcher::~ModelWatcher() {
+    stop_flag = true;
+    if (watch_thread.joinable()) {
+        watch_thread.join();
+    }
+}
+
+void ModelWatcher::run() {
+    size_t slash = modelfile.find_last_of('/');
+    std::string dir = (slash == std::string::npos) ?
+            "." : modelfile.substr(0, slash + 1);
+    std::string model_name = modelfile.substr(slash + 1);
+    std::string trace_name = ACFModel::getRejectionTracePath(model_name);
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        ACF_LOG(Error) << "ModelWatcher: inotify_init1 failed: "
+                << strerror(errno);
+        return;
+    }
+    // 监视目录而非文件本身, 模型文件被mv替换后仍能收到通知
+    if (inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        ACF_LOG(Error) << "ModelWatcher: cannot watch " << dir << ": "
+                << strerror(errno);
+        close(fd);
+        return;
+    }
+
+    alignas(struct inotify_event) char buffer[4096];
+    bool changed = false;
+    while (!stop_flag) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        // 超时用于检查退出标志; 文件变化后再等待一个周期, 合并连续的写入
+        int ret = poll(&pfd, 1, 500);
+        if (ret > 0) {
+            ssize_t len;
+            while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+                for (char *p = buffer; p < buffer + len;) {
+                    struct inotify_event *event = (struct inotify_event *) p;
+                    if (event->len > 0
+                            && (model_name == event->name
+                                    || trace_name == event->name)) {
+                        changed = true;
+                    }
+                    p += sizeof(struct inotify_event) + event->len;
+                }
+            }
+        } else if (ret == 0 && changed) {
+            changed = false;
+            ACF_LOG(Info) << "Model file changed, reloading " << modelfile;
+            reload(modelfile);
+        } else if (ret < 0 && errno != EINTR) {
+            ACF_LOG(Error) << "ModelWatcher: poll failed: " << strerror(errno);
+            break;
+        }
+    }
+    close(fd);
+}
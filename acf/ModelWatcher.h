@@ -0,0 +1,41 @@
+/*
+ * ModelWatcher.h
+ */
+
+#ifndef MODELWATCHER_H_
+#define MODELWATCHER_H_
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+#include "ACFDetector.h"
+
+/*
+ * 监视模型文件(及其.trace文件), 文件被替换后在本线程中加载新模型并发布给检测器,
+ * 处理线程在下一帧开始时切换模型, 无需重启相机和GPIO.
+ * 模型文件应整体替换(写入临时文件后mv), 避免读到写了一半的文件.
+ */
+class ModelWatcher {
+public:
+    ModelWatcher(const std::string &modelfile, ACFDetector &detector);
+    // 文件变化后调用reload(modelfile), 用于同时更新多个检测器(DetectionServer)
+    ModelWatcher(const std::string &modelfile,
+            std::function<bool(const std::string&)> reload);
+    ~ModelWatcher();
+
+    ModelWatcher(const ModelWatcher&) = delete;
+    ModelWatcher& operator=(const ModelWatcher&) = delete;
+
+private:
+    void run();
+
+    std::string modelfile;
+    std::function<bool(const std::string&)> reload;
+
+    std::atomic<bool> stop_flag;
+    std::thread watch_thread;
+};
+
+#endif /* MODELWATCHER_H_ */
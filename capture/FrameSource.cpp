@@ -0,0 +1,54 @@
+/*
+ * FrameSource.cpp
+ */
+
+#include "FrameSource.h"
+#include "ReplaySource.h"
+#include "V4L2Source.h"
+#ifdef WITH_RASPICAM
+#include "RaspiCamSource.h"
+#endif
+#include "../general/Logger.h"
+
+static bool hasPrefix(const std::string &str, const std::string &prefix) {
+    return str.compare(0, prefix.size(), prefix) == 0;
+}
+
+FrameSource *FrameSource::create(const std::string &address,
+        const CaptureOptions &options) {
+    if (address == "raspicam") {
+#ifdef WITH_RASPICAM
+        return new RaspiCamSource(options);
+#else
+        ACF_LOG(Error) << "Built without raspicam (WITH_RASPICAM=OFF)";
+        return NULL;
+#endif
+    } else if (hasPrefix(address, "v4l2:")) {
+        return new V4L2Source(address.substr(5), options);
+    } else if (hasPrefix(address, "video:")) {
+        return new VideoFileSource(address.substr(6), options);
+    } else if (hasPrefix(address, "images:")) {
+        return new ImageDirSource(address.substr(7), options);
+    }
+    ACF_LOG(Error) << "Unknown capture source " << address;
+    return NULL;
+}
+
+std::shared_ptr<uint8_t> FrameSource::convert(const cv::Mat &bgr) const {
+    cv::Mat frame;
+    if (bgr.size() != options.size) {
+        cv::resize(bgr, frame, options.size, 0, 0, cv::INTER_AREA);
+    } else {
+        frame = bgr;
+    }
+    if (options.format == FRAME_I420) {
+        cv::Mat i420;
+        cv::cvtColor(frame, i420, cv::COLOR_BGR2YUV_I420);
+        frame = i420;
+    } else if (!frame.isContinuous()) {
+        frame = frame.clone();
+    }
+    // 删除器持有cv::Mat的引用, 最后一个引用释放时释放图像数据
+    return std::shared_ptr<uint8_t>(frame.data, [frame](uint8_t*) {
+    });
+}
@@ -0,0 +1,111 @@
+/*
+ * FrameSource.h
+ *
+ * 图像采集接口. 后端由create()按地址选择:
+ *     raspicam                 树莓派摄像头(编译时需WITH_RASPICAM)
+ *     v4l2:/dev/video0         V4L2设备(USB摄像头等), mmap内核缓冲区, 不做拷贝
+ *     video:/path/file.mp4     回放视频文件
+ *     images:/path/dir         回放图片目录(按文件名排序)
+ * 回放后端默认按录制速度(视频时间戳或CaptureOptions::fps)输出, realtime为false时全速输出.
+ */
+
+#ifndef CAPTURE_FRAMESOURCE_H_
+#define CAPTURE_FRAMESOURCE_H_
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+enum FrameFormat {
+    FRAME_BGR,      // CV_8UC3
+    FRAME_I420,     // 平面YUV420, 作为CV_8UC1处理时行数为图像高度的1.5倍
+};
+
+struct CaptureOptions {
+    cv::Size size = cv::Size(960, 720);
+    FrameFormat format = FRAME_BGR;
+    int fps = 15;
+    // 回放后端: 按录制速度输出, false时全速输出(用于测试吞吐量)
+    bool realtime = true;
+    // 回放后端: 播放结束后从头开始
+    bool loop = false;
+};
+
+class FrameSource {
+public:
+    explicit FrameSource(const CaptureOptions &options) :
+            options(options) {
+    }
+
+    virtual ~FrameSource() {
+    }
+
+    FrameSource(const FrameSource&) = delete;
+    FrameSource& operator=(const FrameSource&) = delete;
+
+    // 按地址创建后端, 地址无效或后端未编译时返回NULL
+    static FrameSource *create(const std::string &address,
+            const CaptureOptions &options);
+
+    virtual bool open() = 0;
+
+    // 阻塞读取下一帧, 尺寸和格式与options一致. 数据在所有引用释放前有效,
+    // V4L2后端在最后一个引用释放时将缓冲区归还驱动. 读取失败或回放结束时返回false
+    virtual bool read(std::shared_ptr<uint8_t> &data) = 0;
+
+    virtual void release() {
+    }
+
+    // 回放结束, 不会再有新的帧
+    virtual bool atEnd() const {
+        return false;
+    }
+
+    // I420帧是否为全范围(JFIF, Y为0~255). 树莓派摄像头输出全范围, 其他后端
+    // (OpenCV转换和V4L2设备)为有限范围(BT.601, Y为16~235)
+    virtual bool isFullRange() const {
+        return false;
+    }
+
+    // 最近一次read()得到的帧的采集时间(steady_clock, 纳秒), 与LatencyHistogram::now_ns()可比.
+    // V4L2取驱动记录的时间戳, 其他后端取帧到达(grab返回)的时间
+    int64_t getGrabTime() const {
+        return grab_ns;
+    }
+
+    const CaptureOptions &getOptions() const {
+        return options;
+    }
+
+    // 将read()得到的数据包装为cv::Mat(不拷贝)
+    cv::Mat wrap(uint8_t *data) const {
+        if (options.format == FRAME_I420) {
+            return cv::Mat(options.size.height * 3 / 2, options.size.width,
+                    CV_8UC1, data);
+        }
+        return cv::Mat(options.size, CV_8UC3, data);
+    }
+
+    size_t frameBytes() const {
+        return options.format == FRAME_I420 ?
+                options.size.area() * 3 / 2 : options.size.area() * 3;
+    }
+
+protected:
+    // 缩放并转换为options的格式, 返回的数据引用转换结果, 不再拷贝
+    std::shared_ptr<uint8_t> convert(const cv::Mat &bgr) const;
+
+    // 以当前时间作为采集时间
+    void stampGrab() {
+        grab_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    CaptureOptions options;
+    int64_t grab_ns = 0;
+};
+
+#endif /* CAPTURE_FRAMESOURCE_H_ */
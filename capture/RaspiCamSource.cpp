@@ -0,0 +1,59 @@
+/*
+ * RaspiCamSource.cpp
+ */
+
+#include <cstdlib>
+
+#include "RaspiCamSource.h"
+#include "../general/Logger.h"
+
+bool RaspiCamSource::open() {
+    camera.setWidth(options.size.width);                        // 画面宽度
+    camera.setHeight(options.size.height);                      // 画面高度
+    camera.setBrightness(60);                         // 提升20%亮度(50+10=60)
+    camera.setContrast(10);
+    camera.setSaturation(30);                            // 提升20%颜色饱和度(0+20%)
+    camera.setExposure(raspicam::RASPICAM_EXPOSURE_AUTO);
+    camera.setMetering(raspicam::RASPICAM_METERING_MATRIX);
+//    camera.setShutterSpeed(330000);
+    camera.setFrameRate(options.fps);                 // FPS: 15
+    camera.setAWB(raspicam::RASPICAM_AWB_FLUORESCENT);
+    camera.setFormat(
+            options.format == FRAME_I420 ?
+                    raspicam::RASPICAM_FORMAT_YUV420 :
+                    raspicam::RASPICAM_FORMAT_RGB);
+
+    opened = camera.open();
+    if (!opened) {
+        ACF_LOG(Error) << "Camera open failed";
+        return false;
+    }
+    // 宽高未按摄像头要求对齐时缓冲区带有填充(大于紧凑排列的帧), 与FrameSource::wrap
+    // 的排列不一致, 按紧凑排列读取会错行, 因此大小必须完全相同
+    if (camera.getImageBufferSize() != frameBytes()) {
+        ACF_LOG(Error) << "Camera buffer " << camera.getImageBufferSize()
+                << " bytes, expected " << frameBytes();
+        return false;
+    }
+    return true;
+}
+
+bool RaspiCamSource::read(std::shared_ptr<uint8_t> &data) {
+    if (!opened || !camera.grab()) {
+        return false;
+    }
+    // grab()在新帧到达时返回, 之后的拷贝不计入
+    stampGrab();
+    uint8_t *raw_data = (uint8_t *) aligned_alloc(16,
+            camera.getImageBufferSize());
+    camera.retrieve(raw_data);
+    data = std::shared_ptr<uint8_t>(raw_data, free);
+    return true;
+}
+
+void RaspiCamSource::release() {
+    if (opened) {
+        camera.release();
+        opened = false;
+    }
+}
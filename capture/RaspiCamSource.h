@@ -0,0 +1,37 @@
+/*
+ * RaspiCamSource.h
+ *
+ * 树莓派摄像头采集(raspicam), 仅在WITH_RASPICAM时编译.
+ */
+
+#ifndef CAPTURE_RASPICAMSOURCE_H_
+#define CAPTURE_RASPICAMSOURCE_H_
+
+#include <raspicam/raspicam.h>
+
+#include "FrameSource.h"
+
+class RaspiCamSource: public FrameSource {
+public:
+    explicit RaspiCamSource(const CaptureOptions &options) :
+            FrameSource(options) {
+    }
+
+    ~RaspiCamSource() {
+        release();
+    }
+
+    bool open() override;
+    bool read(std::shared_ptr<uint8_t> &data) override;
+    void release() override;
+
+    bool isFullRange() const override {
+        return true;
+    }
+
+private:
+    raspicam::RaspiCam camera;
+    bool opened = false;
+};
+
+#endif /* CAPTURE_RASPICAMSOURCE_H_ */
@@ -0,0 +1,102 @@
+/*
+ * ReplaySource.cpp
+ */
+
+#include <algorithm>
+#include <thread>
+
+#include "ReplaySource.h"
+#include "../general/Logger.h"
+
+void ReplaySource::pace(double fps) {
+    auto now = std::chrono::steady_clock::now();
+    if (frame_index == 0) {
+        start_time = now;
+    }
+    if (options.realtime && fps > 0) {
+        auto due = start_time
+                + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                        std::chrono::duration<double>(frame_index / fps));
+        if (due > now) {
+            std::this_thread::sleep_until(due);
+        } else {
+            // 落后时以当前帧为新的起点, 之后仍按帧率输出
+            start_time = now
+                    - std::chrono::duration_cast<
+                            std::chrono::steady_clock::duration>(
+                            std::chrono::duration<double>(frame_index / fps));
+        }
+    }
+    frame_index++;
+    // 回放的帧以按帧率输出的时刻作为采集时间
+    stampGrab();
+}
+
+bool VideoFileSource::open() {
+    if (!video.open(path)) {
+        ACF_LOG(Error) << "Cannot open video " << path;
+        return false;
+    }
+    // 按视频记录的帧率回放, 没有帧率信息时使用options.fps
+    video_fps = video.get(cv::CAP_PROP_FPS);
+    if (!(video_fps > 0 && video_fps < 1000)) {
+        video_fps = options.fps;
+    }
+    ACF_LOG(Info) << "Replaying " << path << " at "
+            << (options.realtime ? video_fps : 0) << " fps"
+            << (options.realtime ? "" : " (max speed)");
+    return true;
+}
+
+bool VideoFileSource::read(std::shared_ptr<uint8_t> &data) {
+    // 每帧读入新的cv::Mat, 之前输出的帧可能仍被引用
+    cv::Mat bgr;
+    if (!video.read(bgr)) {
+        if (!options.loop || !video.set(cv::CAP_PROP_POS_FRAMES, 0)
+                || !video.read(bgr)) {
+            ended = true;
+            return false;
+        }
+    }
+    pace(video_fps);
+    data = convert(bgr);
+    return true;
+}
+
+void VideoFileSource::release() {
+    video.release();
+}
+
+bool ImageDirSource::open() {
+    cv::glob(dir + "/*", files, false);
+    std::sort(files.begin(), files.end());
+    if (files.empty()) {
+        ACF_LOG(Error) << "No image in " << dir;
+        return false;
+    }
+    ACF_LOG(Info) << "Replaying " << files.size() << " images from " << dir
+            << " at " << (options.realtime ? options.fps : 0) << " fps"
+            << (options.realtime ? "" : " (max speed)");
+    return true;
+}
+
+bool ImageDirSource::read(std::shared_ptr<uint8_t> &data) {
+    // 跳过无法解码的文件, 一轮中没有可读的图片时结束
+    for (size_t tried = 0; tried < files.size(); tried++) {
+        if (next_file >= files.size()) {
+            if (!options.loop) {
+                ended = true;
+                return false;
+            }
+            next_file = 0;
+        }
+        cv::Mat bgr = cv::imread(files[next_file++], cv::IMREAD_COLOR);
+        if (!bgr.empty()) {
+            pace(options.fps);
+            data = convert(bgr);
+            return true;
+        }
+    }
+    ended = true;
+    return false;
+}
@@ -0,0 +1,67 @@
+/*
+ * ReplaySource.h
+ *
+ * 回放录制的视频文件或图片目录, 用于在没有摄像头时运行和测试检测流程.
+ */
+
+#ifndef CAPTURE_REPLAYSOURCE_H_
+#define CAPTURE_REPLAYSOURCE_H_
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "FrameSource.h"
+
+// 回放后端的公共部分: 按帧序号和帧率控制输出速度
+class ReplaySource: public FrameSource {
+public:
+    explicit ReplaySource(const CaptureOptions &options) :
+            FrameSource(options), frame_index(0) {
+    }
+
+    bool atEnd() const override {
+        return ended;
+    }
+
+protected:
+    // realtime时等待到第frame_index帧的播放时间, 读取或转换较慢时不追赶
+    void pace(double fps);
+
+    uint64_t frame_index;
+    std::chrono::steady_clock::time_point start_time;
+    bool ended = false;
+};
+
+class VideoFileSource: public ReplaySource {
+public:
+    VideoFileSource(const std::string &path, const CaptureOptions &options) :
+            ReplaySource(options), path(path) {
+    }
+
+    bool open() override;
+    bool read(std::shared_ptr<uint8_t> &data) override;
+    void release() override;
+
+private:
+    std::string path;
+    cv::VideoCapture video;
+    double video_fps = 0;
+};
+
+class ImageDirSource: public ReplaySource {
+public:
+    ImageDirSource(const std::string &dir, const CaptureOptions &options) :
+            ReplaySource(options), dir(dir) {
+    }
+
+    bool open() override;
+    bool read(std::shared_ptr<uint8_t> &data) override;
+
+private:
+    std::string dir;
+    std::vector<cv::String> files;
+    size_t next_file = 0;
+};
+
+#endif /* CAPTURE_REPLAYSOURCE_H_ */
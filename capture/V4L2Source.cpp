@@ -0,0 +1,319 @@
+/*
+ * V4L2Source.cpp
+ */
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+
+#include "V4L2Source.h"
+#include "../general/Logger.h"
+
+struct V4L2Source::Buffers {
+    int fd = -1;
+    std::vector<void*> starts;
+    std::vector<size_t> lengths;
+    // 停止采集后不再归还缓冲区
+    std::atomic<bool> streaming;
+
+    Buffers() :
+            streaming(false) {
+    }
+
+    ~Buffers() {
+        for (size_t i = 0; i < starts.size(); i++) {
+            munmap(starts[i], lengths[i]);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    bool queue(uint32_t index) {
+        struct v4l2_buffer buf;
+        memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = index;
+        return ioctl(fd, VIDIOC_QBUF, &buf) == 0;
+    }
+};
+
+// ioctl被信号中断时重试
+static int xioctl(int fd, unsigned long request, void *arg) {
+    int ret;
+    do {
+        ret = ioctl(fd, request, arg);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+static std::string fourcc(uint32_t format) {
+    char s[5] = { (char) (format & 0xff), (char) ((format >> 8) & 0xff),
+            (char) ((format >> 16) & 0xff), (char) ((format >> 24) & 0xff),
+            0 };
+    return s;
+}
+
+V4L2Source::V4L2Source(const std::string &device,
+        const CaptureOptions &options) :
+        FrameSource(options), device(device) {
+}
+
+V4L2Source::~V4L2Source() {
+    release();
+}
+
+bool V4L2Source::setFormat(uint32_t format) {
+    struct v4l2_format fmt;
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.width = options.size.width;
+    fmt.fmt.pix.height = options.size.height;
+    fmt.fmt.pix.pixelformat = format;
+    fmt.fmt.pix.field = V4L2_FIELD_ANY;
+    if (xioctl(buffers->fd, VIDIOC_S_FMT, &fmt) < 0
+            || fmt.fmt.pix.pixelformat != format) {
+        return false;
+    }
+    // 驱动可能调整为最接近的尺寸
+    pixel_format = format;
+    driver_size = cv::Size(fmt.fmt.pix.width, fmt.fmt.pix.height);
+    bytes_per_line = fmt.fmt.pix.bytesperline;
+    return true;
+}
+
+bool V4L2Source::open() {
+    buffers.reset(new Buffers());
+    buffers->fd = ::open(device.c_str(), O_RDWR | O_CLOEXEC);
+    if (buffers->fd < 0) {
+        ACF_LOG(Error) << "Cannot open " << device << ": " << strerror(errno);
+        return false;
+    }
+
+    struct v4l2_capability cap;
+    memset(&cap, 0, sizeof(cap));
+    if (xioctl(buffers->fd, VIDIOC_QUERYCAP, &cap) < 0
+            || !(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)
+            || !(cap.capabilities & V4L2_CAP_STREAMING)) {
+        ACF_LOG(Error) << device << " is not a streaming capture device";
+        return false;
+    }
+
+    // 优先请求与输出相同的格式, 以便直接使用内核缓冲区; 其次为USB摄像头常见的格式
+    uint32_t wanted =
+            options.format == FRAME_I420 ?
+                    V4L2_PIX_FMT_YUV420 : V4L2_PIX_FMT_BGR24;
+    if (!setFormat(wanted) && !setFormat(V4L2_PIX_FMT_YUYV)
+            && !setFormat(V4L2_PIX_FMT_MJPEG)) {
+        ACF_LOG(Error) << device << ": no supported pixel format";
+        return false;
+    }
+    uint32_t packed_line =
+            pixel_format == V4L2_PIX_FMT_YUV420 ?
+                    driver_size.width : driver_size.width * 3;
+    zero_copy = pixel_format == wanted && driver_size == options.size
+            && bytes_per_line == packed_line;
+
+    // 帧率, 驱动不支持时忽略
+    struct v4l2_streamparm parm;
+    memset(&parm, 0, sizeof(parm));
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    parm.parm.capture.timeperframe.numerator = 1;
+    parm.parm.capture.timeperframe.denominator = options.fps;
+    xioctl(buffers->fd, VIDIOC_S_PARM, &parm);
+
+    struct v4l2_requestbuffers req;
+    memset(&req, 0, sizeof(req));
+    req.count = V4L2_BUFFERS;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    if (xioctl(buffers->fd, VIDIOC_REQBUFS, &req) < 0 || req.count < 2) {
+        ACF_LOG(Error) << device << ": mmap streaming not supported";
+        return false;
+    }
+    for (uint32_t i = 0; i < req.count; i++) {
+        struct v4l2_buffer buf;
+        memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = i;
+        if (xioctl(buffers->fd, VIDIOC_QUERYBUF, &buf) < 0) {
+            ACF_LOG(Error) << device << ": VIDIOC_QUERYBUF failed";
+            return false;
+        }
+        void *start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE,
+                MAP_SHARED, buffers->fd, buf.m.offset);
+        if (start == MAP_FAILED) {
+            ACF_LOG(Error) << device << ": mmap failed: " << strerror(errno);
+            return false;
+        }
+        buffers->starts.push_back(start);
+        buffers->lengths.push_back(buf.length);
+        if (!buffers->queue(i)) {
+            ACF_LOG(Error) << device << ": VIDIOC_QBUF failed";
+            return false;
+        }
+    }
+
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (xioctl(buffers->fd, VIDIOC_STREAMON, &type) < 0) {
+        ACF_LOG(Error) << device << ": VIDIOC_STREAMON failed: "
+                << strerror(errno);
+        return false;
+    }
+    buffers->streaming = true;
+
+    ACF_LOG(Info) << device << ": " << driver_size.width << "x"
+            << driver_size.height << " " << fourcc(pixel_format) << ", "
+            << req.count << " buffers"
+            << (zero_copy ? ", zero copy" : ", converted");
+    return true;
+}
+
+// 将驱动输出的一帧转换为BGR, 或紧凑排列的I420(驱动输出YUV420但行有填充时)
+cv::Mat V4L2Source::decode(const uint8_t *start, size_t bytes) const {
+    int width = driver_size.width, height = driver_size.height;
+    cv::Mat bgr;
+    switch (pixel_format) {
+    case V4L2_PIX_FMT_YUYV:
+        cv::cvtColor(
+                cv::Mat(height, width, CV_8UC2, (void *) start, bytes_per_line),
+                bgr, cv::COLOR_YUV2BGR_YUYV);
+        break;
+    case V4L2_PIX_FMT_MJPEG:
+        bgr = cv::imdecode(
+                cv::Mat(1, (int) bytes, CV_8UC1, (void *) start),
+                cv::IMREAD_COLOR);
+        break;
+    case V4L2_PIX_FMT_BGR24:
+        cv::Mat(height, width, CV_8UC3, (void *) start, bytes_per_line).copyTo(
+                bgr);
+        break;
+    case V4L2_PIX_FMT_YUV420: {
+        // 去掉行填充, 色度平面的行宽为亮度的一半
+        cv::Mat i420(height * 3 / 2, width, CV_8UC1);
+        const uint8_t *src = start;
+        uint8_t *dst = i420.data;
+        for (int y = 0; y < height; y++) {
+            memcpy(dst, src, width);
+            src += bytes_per_line;
+            dst += width;
+        }
+        for (int y = 0; y < height; y++) {
+            memcpy(dst, src, width / 2);
+            src += bytes_per_line / 2;
+            dst += width / 2;
+        }
+        return i420;
+    }
+    }
+    return bgr;
+}
+
+// 连续的读取失败只在第1, 2, 4, 8...次记录; 设备被拔出(ENODEV)或持续出错时视为结束
+void V4L2Source::readFailed(const std::string &message, int err) {
+    read_errors++;
+    if ((read_errors & (read_errors - 1)) == 0) {
+        ACF_LOG(Warn) << device << ": " << message << " (" << read_errors
+                << " consecutive)";
+    }
+    if (err == ENODEV || read_errors >= V4L2_MAX_READ_ERRORS) {
+        ACF_LOG(Error) << device << ": device lost, stop capturing";
+        device_lost = true;
+    }
+}
+
+bool V4L2Source::read(std::shared_ptr<uint8_t> &data) {
+    if (!buffers || !buffers->streaming) {
+        return false;
+    }
+    if (device_lost) {
+        return false;
+    }
+    struct pollfd pfd = { buffers->fd, POLLIN, 0 };
+    int ret = poll(&pfd, 1, 2000);
+    if (ret <= 0) {
+        readFailed(ret == 0 ? "frame timeout" : strerror(errno), 0);
+        return false;
+    }
+
+    struct v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    if (xioctl(buffers->fd, VIDIOC_DQBUF, &buf) < 0) {
+        int err = errno;
+        readFailed(std::string("VIDIOC_DQBUF failed: ") + strerror(err), err);
+        return false;
+    }
+    read_errors = 0;
+    if (buf.flags & V4L2_BUF_FLAG_ERROR) {
+        buffers->queue(buf.index);
+        return false;
+    }
+    uint8_t *start = (uint8_t *) buffers->starts[buf.index];
+    // 驱动在帧开始(或结束)时记录的单调时钟时间, 即steady_clock; 其他时钟的时间戳不可比, 改用当前时间
+    stampGrab();
+    if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK)
+            == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC
+            && (buf.timestamp.tv_sec != 0 || buf.timestamp.tv_usec != 0)) {
+        int64_t driver_ns = buf.timestamp.tv_sec * 1000000000LL
+                + buf.timestamp.tv_usec * 1000LL;
+        if (driver_ns <= grab_ns) {
+            grab_ns = driver_ns;
+        }
+    }
+
+    if (zero_copy) {
+        // 删除器持有buffers, 最后一个引用释放时归还缓冲区
+        std::shared_ptr<Buffers> owner = buffers;
+        uint32_t index = buf.index;
+        data = std::shared_ptr<uint8_t>(start, [owner, index](uint8_t*) {
+            if (owner->streaming) {
+                owner->queue(index);
+            }
+        });
+        return true;
+    }
+
+    cv::Mat frame = decode(start, buf.bytesused);
+    buffers->queue(buf.index);
+    if (frame.empty()) {
+        return false;
+    }
+    if (frame.type() == CV_8UC1) {
+        // 紧凑排列的I420
+        if (options.format == FRAME_I420 && driver_size == options.size) {
+            data = std::shared_ptr<uint8_t>(frame.data, [frame](uint8_t*) {
+            });
+            return true;
+        }
+        cv::Mat bgr;
+        cv::cvtColor(frame, bgr, cv::COLOR_YUV2BGR_I420);
+        frame = bgr;
+    }
+    data = convert(frame);
+    return true;
+}
+
+void V4L2Source::release() {
+    if (!buffers) {
+        return;
+    }
+    if (buffers->streaming) {
+        buffers->streaming = false;
+        enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        xioctl(buffers->fd, VIDIOC_STREAMOFF, &type);
+    }
+    // 仍被引用的帧保持映射, 全部释放后关闭设备
+    buffers.reset();
+}
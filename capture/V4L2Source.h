@@ -0,0 +1,55 @@
+/*
+ * V4L2Source.h
+ *
+ * V4L2设备(USB摄像头等)采集. 驱动直接输出所需的格式和尺寸时, read()返回的数据就是
+ * mmap的内核缓冲区, 不做拷贝, 最后一个引用释放时缓冲区归还驱动(VIDIOC_QBUF);
+ * 否则(如YUYV, MJPEG)转换后立即归还缓冲区.
+ * 下游同时持有的帧数应少于V4L2_BUFFERS, 否则驱动没有空闲缓冲区, 会丢帧.
+ */
+
+#ifndef CAPTURE_V4L2SOURCE_H_
+#define CAPTURE_V4L2SOURCE_H_
+
+#include <memory>
+#include <string>
+
+#include "FrameSource.h"
+
+#define V4L2_BUFFERS 6
+// 连续读取失败的次数达到该值时视为设备丢失
+#define V4L2_MAX_READ_ERRORS 20
+
+class V4L2Source: public FrameSource {
+public:
+    V4L2Source(const std::string &device, const CaptureOptions &options);
+    ~V4L2Source();
+
+    bool open() override;
+    bool read(std::shared_ptr<uint8_t> &data) override;
+    void release() override;
+
+    // 设备被拔出或持续读取失败
+    bool atEnd() const override {
+        return device_lost;
+    }
+
+private:
+    struct Buffers;
+
+    bool setFormat(uint32_t pixel_format);
+    cv::Mat decode(const uint8_t *start, size_t bytes) const;
+    void readFailed(const std::string &message, int err);
+
+    std::string device;
+    // 映射的缓冲区, 由已输出的帧共同持有, 全部释放后才解除映射
+    std::shared_ptr<Buffers> buffers;
+    // 驱动实际输出的格式
+    uint32_t pixel_format = 0;
+    cv::Size driver_size;
+    uint32_t bytes_per_line = 0;
+    bool zero_copy = false;
+    int read_errors = 0;
+    bool device_lost = false;
+};
+
+#endif /* CAPTURE_V4L2SOURCE_H_ */
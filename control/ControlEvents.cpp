@@ -0,0 +1,40 @@
+/*
+ * ControlEvents.cpp
+ */
+
+#include "ControlEvents.h"
+
+void ControlEventQueue::post(const ControlEvent &event) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // 检测结果和参数在处理时才读取, 未处理的同类事件不必重复投递
+        if (event.type == EVENT_DETECTION || event.type == EVENT_SETTINGS) {
+            for (const ControlEvent &queued : events) {
+                if (queued.type == event.type
+                        && (event.type != EVENT_DETECTION
+                                || queued.stream == event.stream)) {
+                    return;
+                }
+            }
+        }
+        if (events.size() >= CONTROL_QUEUE_SIZE) {
+            events.pop_front();
+            dropped++;
+        }
+        events.push_back(event);
+    }
+    cond.notify_one();
+}
+
+bool ControlEventQueue::waitUntil(
+        std::chrono::steady_clock::time_point deadline, ControlEvent &event) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!cond.wait_until(lock, deadline, [this] {
+        return !events.empty();
+    })) {
+        return false;
+    }
+    event = events.front();
+    events.pop_front();
+    return true;
+}
@@ -0,0 +1,96 @@
+/*
+ * ControlEvents.h
+ *
+ * 控制线程的事件队列和状态快照.
+ * 检测结果更新, 人体红外电平变化和界面参数修改以事件的形式投递到ControlEventQueue,
+ * 控制线程逐个处理; 计时(延时开关灯/空调)由控制线程等待到期时间实现.
+ * 控制线程每处理一个事件发布一份状态快照(StatePublisher), 界面线程只读取快照,
+ * 因此界面绘制, 暂停和保存截图不会阻塞灯光和空调控制.
+ */
+
+#ifndef CONTROL_CONTROLEVENTS_H_
+#define CONTROL_CONTROLEVENTS_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+// 队列中最多保留的事件数, 超出时丢弃最早的事件
+#define CONTROL_QUEUE_SIZE 256
+
+enum ControlEventType {
+    EVENT_DETECTION,    // 某一路流有新的检测结果, stream为流序号
+    EVENT_PIR,          // 人体红外电平变化, level为新电平
+    EVENT_SETTINGS,     // 界面修改了阈值或模拟检测结果
+    EVENT_TIMER,        // 等待到期, 由waitUntil超时产生, 不进入队列
+    EVENT_EXIT,         // 控制线程退出
+};
+
+struct ControlEvent {
+    ControlEventType type = EVENT_TIMER;
+    int stream = 0;
+    bool level = false;
+    int64_t time_ns = 0;    // 事件发生的时间(steady_clock)
+};
+
+class ControlEventQueue {
+public:
+    // 可在任意线程调用, 不会阻塞; 同一路流未处理的检测事件和未处理的参数修改事件只保留一个
+    void post(const ControlEvent &event);
+
+    // 等待下一个事件, 到deadline仍没有事件时返回false
+    bool waitUntil(std::chrono::steady_clock::time_point deadline,
+            ControlEvent &event);
+
+    uint64_t getDropped() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return dropped;
+    }
+
+private:
+    mutable std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<ControlEvent> events;
+    uint64_t dropped = 0;
+};
+
+// 单写多读的状态快照: 写入方整体替换, 读取方得到一致的副本
+template<typename T>
+class StatePublisher {
+public:
+    void publish(const T &state) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            this->state = state;
+            version++;
+        }
+        cond.notify_all();
+    }
+
+    T get(uint64_t *out_version = NULL) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (out_version) {
+            *out_version = version;
+        }
+        return state;
+    }
+
+    // 等待比known_version新的快照, 超时返回false
+    bool waitNewer(uint64_t known_version, int timeout_ms) const {
+        std::unique_lock<std::mutex> lock(mutex);
+        return cond.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                [this, known_version] {
+                    return version > known_version;
+                });
+    }
+
+private:
+    mutable std::mutex mutex;
+    mutable std::condition_variable cond;
+    T state;
+    uint64_t version = 0;
+};
+
+#endif /* CONTROL_CONTROLEVENTS_H_ */
@@ -5,24 +5,152 @@
  *      Author: shuixiang
  */
 
+#include <set>
+#include <stdexcept>
+#include <string>
+
 #include <pigpio.h>
 
 #include "HumanInfrared.h"
 
-HumanInfrared::HumanInfrared(int input_pin, bool active_high) {
+static int64_t steady_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::chrono::steady_clock::time_point to_time_point(int64_t ns) {
+    return std::chrono::steady_clock::time_point(
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::nanoseconds(ns)));
+}
+
+// 有效的实例. 注销pigpio回调不会等待正在执行的回调, 回调在持有该锁时确认实例仍然有效,
+// 析构时在同一把锁下移除实例, 之后不会再有回调访问该对象
+static std::mutex &instancesMutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+static std::set<HumanInfrared*> &instances() {
+    static std::set<HumanInfrared*> set;
+    return set;
+}
+
+HumanInfrared::HumanInfrared(int input_pin, bool active_high, int glitch_us) {
     this->input_pin = input_pin;
     this->active_high = active_high;
+    this->glitch_us = glitch_us > 0 ? glitch_us : 0;
     gpioSetMode(this->input_pin, PI_INPUT);
+    if (glitch_us > 0) {
+        int ret = gpioGlitchFilter(this->input_pin, glitch_us);
+        if (ret != 0) {
+            throw std::runtime_error(
+                    "HumanInfrared: gpioGlitchFilter failed with code "
+                            + std::to_string(ret));
+        }
+    }
+
+    // 先注册回调再读取初始电平, 两者之间的跳变不会丢失: 读取时持有锁, 读取前发生的跳变
+    // 其回调得到的电平与读取结果相同而被忽略, 读取后的跳变由回调正常更新
+    {
+        std::lock_guard<std::mutex> lock(instancesMutex());
+        instances().insert(this);
+    }
+    gpioSetAlertFuncEx(this->input_pin, alertFunc, this);
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if ((gpioRead(this->input_pin) != 0) == this->active_high
+            && !this->active) {
+        this->active = true;
+        this->has_motion = true;
+        this->active_since_ns = steady_ns();
+    }
+}
+
+HumanInfrared::HumanInfrared() {
+    this->input_pin = -1;
+    this->active_high = true;
 }
 
 HumanInfrared::~HumanInfrared() {
+    if (this->input_pin >= 0) {
+        gpioSetAlertFuncEx(this->input_pin, NULL, NULL);
+        // 等待正在执行的回调返回
+        std::lock_guard<std::mutex> lock(instancesMutex());
+        instances().erase(this);
+    }
 }
 
+void HumanInfrared::alertFunc(int gpio, int level, uint32_t tick,
+        void *userdata) {
+    // level为PI_TIMEOUT时是看门狗超时, 不是电平变化
+    if (level != 0 && level != 1) {
+        return;
+    }
+    HumanInfrared *self = static_cast<HumanInfrared*>(userdata);
+    std::lock_guard<std::mutex> lock(instancesMutex());
+    if (instances().count(self) == 0) {
+        return;
+    }
+
+    // tick为跳变时的微秒计数(约72分钟回绕一次), 按与当前tick的差值换算为steady_clock.
+    // 去抖过滤在电平稳定glitch_us后才上报, tick比实际跳变晚glitch_us
+    uint32_t delay_us = gpioTick() - tick;
+    int64_t time_ns = steady_ns()
+            - ((int64_t) delay_us + self->glitch_us) * 1000;
+    self->onEdge((level != 0) == self->active_high, time_ns);
+}
+
+void HumanInfrared::onEdge(bool active, int64_t time_ns) {
+    EdgeCallback callback;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (active == this->active) {
+            return;
+        }
+        this->active = active;
+        if (active) {
+            this->has_motion = true;
+            this->active_since_ns = time_ns;
+        } else {
+            this->inactive_since_ns = time_ns;
+        }
+        callback = this->callback;
+    }
+    if (callback) {
+        callback(active, time_ns);
+    }
+}
 
 bool HumanInfrared::get() {
-    if (this->active_high) {
-        return gpioRead(this->input_pin);
-    } else {
-        return !gpioRead(this->input_pin);
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->active;
+}
+
+bool HumanInfrared::lastMotion(time_point &time) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (!this->has_motion) {
+        return false;
+    }
+    time = this->active ?
+            std::chrono::steady_clock::now() :
+            to_time_point(this->inactive_since_ns);
+    return true;
+}
+
+bool HumanInfrared::activeSince(time_point &time) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (!this->active) {
+        return false;
     }
+    time = to_time_point(this->active_since_ns);
+    return true;
+}
+
+void HumanInfrared::setCallback(const EdgeCallback &callback) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->callback = callback;
+}
+
+void SimulatedHumanInfrared::set(bool active) {
+    onEdge(active, steady_ns());
 }
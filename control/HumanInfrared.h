@@ -3,20 +3,79 @@
  *
  *  Created on: 2018年3月16日
  *      Author: shuixiang
+ *
+ * 人体红外热释电输入. 由pigpio的电平变化回调(gpioSetAlertFuncEx)更新状态, get()等
+ * 只读取缓存的状态, 不访问GPIO. 跳变时间取pigpio记录的tick(微秒), 换算为steady_clock.
+ * 电平保持不足glitch_us的跳变由gpioGlitchFilter过滤, 不会产生回调; 通过过滤的跳变
+ * 在电平稳定glitch_us后才上报, 记录的跳变时间已减去这段延迟.
+ * 析构时注销回调, 并等待正在执行的回调返回, 因此不能在回调中析构该对象.
+ * SimulatedHumanInfrared不访问GPIO, 由set()模拟电平变化, 用于无硬件时测试.
  */
 
 #ifndef CONTROL_HUMANINFRARED_H_
 #define CONTROL_HUMANINFRARED_H_
 
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+
+// 默认的去抖时间(微秒), pigpio允许的最大值为300000
+#define PIR_GLITCH_US 10000
+
 class HumanInfrared {
 public:
-    HumanInfrared(int input_pin, bool active_high=true);
+    typedef std::chrono::steady_clock::time_point time_point;
+    // 有效电平变化时调用, active为变化后的状态, time_ns为跳变时间(steady_clock纳秒)
+    typedef std::function<void(bool active, int64_t time_ns)> EdgeCallback;
+
+    HumanInfrared(int input_pin, bool active_high=true,
+            int glitch_us=PIR_GLITCH_US);
     virtual ~HumanInfrared();
 
+    // 当前是否检测到人体
     bool get();
+
+    // 最近一次检测到人体的时间: 当前有效时为现在, 否则为上次有效电平结束的时间;
+    // 启动后从未检测到时返回false
+    bool lastMotion(time_point &time);
+
+    // 本次有效电平开始的时间, 当前无效时返回false
+    bool activeSince(time_point &time);
+
+    // 设置跳变回调, 在pigpio的回调线程中调用, 应尽快返回(如投递事件)
+    void setCallback(const EdgeCallback &callback);
+
+protected:
+    // 不访问GPIO, 供模拟后端使用
+    HumanInfrared();
+
+    // 记录一次跳变并调用回调, 电平未变化时忽略
+    void onEdge(bool active, int64_t time_ns);
+
 private:
+    static void alertFunc(int gpio, int level, uint32_t tick, void *userdata);
+
     int input_pin;
     bool active_high;
+    int glitch_us = 0;
+
+    std::mutex mutex;
+    bool active = false;
+    bool has_motion = false;
+    int64_t active_since_ns = 0;
+    int64_t inactive_since_ns = 0;
+    EdgeCallback callback;
+};
+
+// 模拟的人体红外输入
+class SimulatedHumanInfrared: public HumanInfrared {
+public:
+    SimulatedHumanInfrared() {
+    }
+
+    // 模拟一次电平变化, 跳变时间为当前时间
+    void set(bool active);
 };
 
 #endif /* CONTROL_HUMANINFRARED_H_ */
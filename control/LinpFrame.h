@@ -0,0 +1,170 @@
+/*
+ * LinpFrame.h
+ *
+ * 领普无线接收器的串口帧格式与分帧, 不依赖pigpio.
+ */
+
+#ifndef CONTROL_LINPFRAME_H_
+#define CONTROL_LINPFRAME_H_
+
+#include <cstdint>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct LinpWirelessFrame {
+    uint8_t type;               // 帧类型
+    uint32_t addr;              // 源地址
+    uint8_t sensor;             // 设备类型
+    std::vector<uint8_t> data;  // 数据
+
+    // construct frame raw data
+    std::vector<uint8_t> make_frame() {
+        std::vector<uint8_t> raw_data;
+        raw_data.push_back(type);
+        raw_data.push_back(static_cast<uint8_t>(addr >> 24));
+        raw_data.push_back(static_cast<uint8_t>(addr >> 16));
+        raw_data.push_back(static_cast<uint8_t>(addr >> 8));
+        raw_data.push_back(static_cast<uint8_t>(addr >> 0));
+        raw_data.push_back(sensor);
+        raw_data.insert(raw_data.end(), data.begin(), data.end());
+        return raw_data;
+    }
+
+    operator std::vector<uint8_t>() {
+        return this->make_frame();
+    }
+};
+
+struct LinpReceiverFrame {
+    const uint8_t start = 0x55;       // 引导码
+    uint16_t data_len;          // data数据字段长度
+    uint8_t opt_data_len;       // opt_data可选数据字段长度
+    uint8_t type;               // 帧类型
+    uint8_t crc_header;         // 帧头CRC8校验
+    std::vector<uint8_t> data;     // 数据
+    std::vector<uint8_t> opt_data;  // 可选数据
+    uint8_t crc_data;           // data字段 + opt字段的CRC8校验
+private:
+    static const uint8_t CRC8_TABLE[256];
+
+    static uint8_t CRC8(uint8_t *packet, int length, uint8_t init_crc = 0x00) {
+        uint8_t crc_result = init_crc;
+        for (int i = 0; i < length; i++) {
+            crc_result = CRC8_TABLE[crc_result ^ packet[i]];
+        }
+        return crc_result;
+    }
+public:
+    bool check_header_crc() {
+        std::vector<uint8_t> header = { static_cast<uint8_t>(data_len >> 8),
+                static_cast<uint8_t>(data_len >> 0), opt_data_len, type };
+        if (this->crc_header != CRC8(header.data(), header.size())) {
+            return false;
+        }
+        return true;
+    }
+
+    bool check_data_crc() {
+        uint8_t crc8 = CRC8(this->data.data(), this->data.size());
+        if (this->crc_data
+                != CRC8(this->opt_data.data(), opt_data.size(), crc8)) {
+            return false;
+        }
+        return true;
+    }
+
+    bool check_frame() {
+        if (this->data_len != this->data.size()) {
+            return false;
+        }
+        if (this->opt_data_len != this->opt_data.size()) {
+            return false;
+        }
+
+        // calc CRC of header
+        if (!check_header_crc()) {
+            return false;
+        }
+        // calc CRC of data + opt_data
+        if (!check_data_crc()) {
+            return false;
+        }
+        return true;
+    }
+
+    // 计算字段长度, 并计算CRC8校验码, 返回生成的整帧字节数组
+    std::vector<uint8_t> make_frame() {
+
+        // calc data length
+        if (this->data.size() > 65535) {
+            throw std::length_error(
+                    "LinpWirelessFrame total length "
+                            + std::to_string(this->data.size()) + " > 65535");
+        }
+        this->data_len = static_cast<uint16_t>(this->data.size());
+        // calc opt_data length
+        if (this->opt_data.size() > 255) {
+            throw std::length_error(
+                    "LinpReceiverFrame opt_data length "
+                            + std::to_string(this->opt_data.size()) + " > 255");
+        }
+        this->opt_data_len = static_cast<uint8_t>(this->opt_data.size());
+
+        // calc CRC of header
+        std::vector<uint8_t> header = { static_cast<uint8_t>(data_len >> 8),
+                static_cast<uint8_t>(data_len >> 0), opt_data_len, type };
+        this->crc_header = CRC8(header.data(), header.size());
+        // calc CRC of data + opt_data
+        this->crc_data = CRC8(this->data.data(), this->data.size());
+        this->crc_data = CRC8(this->opt_data.data(), opt_data.size(),
+                this->crc_data);
+
+        // construct frame raw data
+        std::vector<uint8_t> raw_data;
+        raw_data.push_back(this->start);
+        raw_data.push_back(static_cast<uint8_t>(data_len >> 8));
+        raw_data.push_back(static_cast<uint8_t>(data_len >> 0));
+        raw_data.push_back(opt_data_len);
+        raw_data.push_back(type);
+        raw_data.push_back(crc_header);
+        raw_data.insert(raw_data.end(), this->data.begin(), this->data.end());
+        raw_data.insert(raw_data.end(), this->opt_data.begin(),
+                this->opt_data.end());
+        raw_data.push_back(crc_data);
+
+        return raw_data;
+    }
+
+    operator std::vector<uint8_t>() {
+        return this->make_frame();
+    }
+};
+
+// 串口字节流的分帧. 收到的数据按顺序追加到缓冲区, 一帧的数据可以分多次到达;
+// 只有引导码, 帧头CRC和数据CRC都正确时才从缓冲区移除整帧. 校验失败时只丢弃开头的
+// 引导码, 从下一个字节重新查找, 因此数据中的0x55或损坏的帧不会吞掉其后的有效帧
+class LinpFrameParser {
+public:
+    void append(const uint8_t *data, size_t size) {
+        this->buffer.insert(this->buffer.end(), data, data + size);
+    }
+
+    // 解析下一帧, 没有完整的帧时返回false, 未解析的数据留在缓冲区
+    bool next(LinpReceiverFrame &frame);
+
+    void clear() {
+        this->buffer.clear();
+    }
+
+    // 缓冲区中尚未解析的字节数
+    size_t size() const {
+        return this->buffer.size();
+    }
+
+private:
+    std::deque<uint8_t> buffer;
+};
+
+#endif /* CONTROL_LINPFRAME_H_ */
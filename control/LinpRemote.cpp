@@ -10,29 +10,9 @@
 #include <pigpio.h>
 
 #include "LinpRemote.h"
-
-const uint8_t LinpReceiverFrame::CRC8_TABLE[256] = { 0x00, 0x07, 0x0e, 0x09,
-        0x1c, 0x1b, 0x12, 0x15, 0x38, 0x3f, 0x36, 0x31, 0x24, 0x23, 0x2a, 0x2d,
-        0x70, 0x77, 0x7e, 0x79, 0x6c, 0x6b, 0x62, 0x65, 0x48, 0x4f, 0x46, 0x41,
-        0x54, 0x53, 0x5a, 0x5d, 0xe0, 0xe7, 0xee, 0xe9, 0xfc, 0xfb, 0xf2, 0xf5,
-        0xd8, 0xdf, 0xd6, 0xd1, 0xc4, 0xc3, 0xca, 0xcd, 0x90, 0x97, 0x9e, 0x99,
-        0x8c, 0x8b, 0x82, 0x85, 0xa8, 0xaf, 0xa6, 0xa1, 0xb4, 0xb3, 0xba, 0xbd,
-        0xc7, 0xc0, 0xc9, 0xce, 0xdb, 0xdc, 0xd5, 0xd2, 0xff, 0xf8, 0xf1, 0xf6,
-        0xe3, 0xe4, 0xed, 0xea, 0xb7, 0xb0, 0xb9, 0xbe, 0xab, 0xac, 0xa5, 0xa2,
-        0x8f, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9d, 0x9a, 0x27, 0x20, 0x29, 0x2e,
-        0x3b, 0x3c, 0x35, 0x32, 0x1f, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0d, 0x0a,
-        0x57, 0x50, 0x59, 0x5e, 0x4b, 0x4c, 0x45, 0x42, 0x6f, 0x68, 0x61, 0x66,
-        0x73, 0x74, 0x7d, 0x7a, 0x89, 0x8e, 0x87, 0x80, 0x95, 0x92, 0x9b, 0x9c,
-        0xb1, 0xb6, 0xbf, 0xb8, 0xad, 0xaa, 0xa3, 0xa4, 0xf9, 0xfe, 0xf7, 0xf0,
-        0xe5, 0xe2, 0xeb, 0xec, 0xc1, 0xc6, 0xcf, 0xc8, 0xdd, 0xda, 0xd3, 0xd4,
-        0x69, 0x6e, 0x67, 0x60, 0x75, 0x72, 0x7b, 0x7c, 0x51, 0x56, 0x5f, 0x58,
-        0x4d, 0x4a, 0x43, 0x44, 0x19, 0x1e, 0x17, 0x10, 0x05, 0x02, 0x0b, 0x0c,
-        0x21, 0x26, 0x2f, 0x28, 0x3d, 0x3a, 0x33, 0x34, 0x4e, 0x49, 0x40, 0x47,
-        0x52, 0x55, 0x5c, 0x5b, 0x76, 0x71, 0x78, 0x7f, 0x6A, 0x6d, 0x64, 0x63,
-        0x3e, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2c, 0x2b, 0x06, 0x01, 0x08, 0x0f,
-        0x1a, 0x1d, 0x14, 0x13, 0xae, 0xa9, 0xa0, 0xa7, 0xb2, 0xb5, 0xbc, 0xbb,
-        0x96, 0x91, 0x98, 0x9f, 0x8a, 0x8D, 0x84, 0x83, 0xde, 0xd9, 0xd0, 0xd7,
-        0xc2, 0xc5, 0xcc, 0xcb, 0xe6, 0xe1, 0xe8, 0xef, 0xfa, 0xfd, 0xf4, 0xf3 };
+#include "../general/LatencyStats.h"
+#include "../general/Metrics.h"
+#include "../general/TraceRecorder.h"
 
 LinpRemote::LinpRemote() :
         ser_path("/dev/ttyS0") {
@@ -45,32 +25,202 @@ LinpRemote::LinpRemote() :
                         + std::to_string(this->ser_port));
     }
 
+    this->io_thread = std::thread(&LinpRemote::ioLoop, this);
 }
 
 LinpRemote::~LinpRemote() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stop_flag = true;
+    }
+    this->cond.notify_all();
+    this->io_thread.join();
+
+    // 未发送的请求
+    LinpReply reply;
+    reply.status = LINP_CLOSED;
+    for (Pending *pending : this->queue) {
+        complete(pending, reply);
+    }
+    this->queue.clear();
+
     serClose(this->ser_port);
 }
 
-int LinpRemote::send(LinpReceiverFrame &frame) {
-    std::vector<uint8_t> raw_frame = frame;
+std::future<LinpReply> LinpRemote::submit(const LinpRequest &request) {
+    Pending *pending = new Pending(request);
+    pending->submit_ns = LatencyHistogram::now_ns();
+    std::future<LinpReply> future = pending->promise.get_future();
 
-    int ret = serWrite(this->ser_port, reinterpret_cast<char *>(raw_frame.data()), raw_frame.size());
-    if (ret != 0) {
-        throw std::runtime_error(
-                "serWrite failed with code "
-                        + std::to_string(ret));
+    Pending *superseded = NULL;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (this->stop_flag) {
+            superseded = pending;
+        } else {
+            // 同一开关尚未发送的命令直接替换, 保持原来的位置
+            if (request.coalesce_key != 0) {
+                for (Pending *&queued : this->queue) {
+                    if (queued->request.coalesce_key == request.coalesce_key) {
+                        superseded = queued;
+                        queued = pending;
+                        break;
+                    }
+                }
+            }
+            if (superseded == NULL) {
+                this->queue.push_back(pending);
+            }
+        }
+    }
+    this->cond.notify_all();
+
+    if (superseded) {
+        LinpReply reply;
+        reply.status = superseded == pending ? LINP_CLOSED : LINP_SUPERSEDED;
+        complete(superseded, reply);
+    }
+    return future;
+}
+
+void LinpRemote::ioLoop() {
+    TraceRecorder::setThreadName("linp");
+    for (;;) {
+        Pending *pending;
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->cond.wait(lock, [this] {
+                return this->stop_flag || !this->queue.empty();
+            });
+            if (this->stop_flag) {
+                break;
+            }
+            pending = this->queue.front();
+            this->queue.pop_front();
+        }
+
+        TraceScope trace("linp.request");
+        LinpReply reply = execute(pending);
+        complete(pending, reply);
+    }
+}
+
+LinpReply LinpRemote::execute(Pending *pending) {
+    static MetricCounter &retries_total = Metrics::counter(
+            "acf_linp_retries_total", "Linp serial requests sent again");
+    LinpRequest &request = pending->request;
+    LinpReply reply;
+
+    // 丢弃之前收到的完整帧, 避免匹配到过期的应答; 不完整的帧留在缓冲区等待其余数据
+    LinpReceiverFrame stale;
+    while (recv(stale) == 0) {
     }
 
-    return ret;
+    for (int attempt = 0;; attempt++) {
+        if (attempt > 0) {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            if (this->stop_flag) {
+                reply.status = LINP_CLOSED;
+                return reply;
+            }
+            // 重发前已有同一开关更新的命令, 不再重发旧的状态
+            if (request.coalesce_key != 0 && hasQueued(request.coalesce_key)) {
+                reply.status = LINP_SUPERSEDED;
+                return reply;
+            }
+            retries_total.inc();
+        }
+
+        auto deadline = std::chrono::steady_clock::now()
+                + std::chrono::milliseconds(request.timeout_ms);
+        int ret = send(request.frame);
+        if (ret != 0) {
+            ACF_LOG(Warn) << "LinpRemote: serWrite failed with code " << ret;
+            reply.status = LINP_IO_ERROR;
+        } else if (!request.match) {
+            reply.status = LINP_OK;
+            return reply;
+        } else {
+            reply.status = LINP_TIMEOUT;
+            // 等待应答, 其他帧(如无线开关上报)忽略
+            for (;;) {
+                ret = recv(reply.ack);
+                if (ret == 0) {
+                    if (request.match(reply.ack)) {
+                        reply.status = LINP_OK;
+                        return reply;
+                    }
+                    ACF_LOG(Debug) << "LinpRemote: ignore frame type "
+                            << (int) reply.ack.type;
+                    continue;
+                } else if (ret < 0) {
+                    ACF_LOG(Warn) << "LinpRemote: serial read failed with code "
+                            << ret;
+                }
+                if (std::chrono::steady_clock::now() >= deadline) {
+                    break;
+                }
+                std::unique_lock<std::mutex> lock(this->mutex);
+                this->cond.wait_for(lock,
+                        std::chrono::milliseconds(LINP_POLL_MS), [this] {
+                            return this->stop_flag;
+                        });
+                if (this->stop_flag) {
+                    reply.status = LINP_CLOSED;
+                    return reply;
+                }
+            }
+        }
+
+        if (attempt >= request.retries) {
+            ACF_LOG(Warn) << "LinpRemote: request type "
+                    << (int) request.frame.type << " failed after "
+                    << attempt + 1 << " attempts";
+            return reply;
+        }
+        // 写入失败时等到本次超时再重发, 期间有更新的同类命令时提前结束
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->cond.wait_until(lock, deadline, [this, &request] {
+            return this->stop_flag || (request.coalesce_key != 0
+                    && hasQueued(request.coalesce_key));
+        });
+    }
+}
+
+void LinpRemote::complete(Pending *pending, const LinpReply &reply) {
+    static LatencyHistogram &request_hist = LatencyStats::get("linp.request");
+    if (reply.status == LINP_OK) {
+        request_hist.record(LatencyHistogram::now_ns() - pending->submit_ns);
+    }
+    if (pending->request.done) {
+        pending->request.done(reply);
+    }
+    pending->promise.set_value(reply);
+    delete pending;
+}
+
+bool LinpRemote::hasQueued(uint64_t coalesce_key) const {
+    for (Pending *queued : this->queue) {
+        if (queued->request.coalesce_key == coalesce_key) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int LinpRemote::send(LinpReceiverFrame &frame) {
+    std::vector<uint8_t> raw_frame = frame;
+
+    // pigpio以非阻塞方式打开串口, 写不完整时返回错误
+    return serWrite(this->ser_port, reinterpret_cast<char *>(raw_frame.data()),
+            raw_frame.size());
 }
 
 int LinpRemote::recv(LinpReceiverFrame &frame) {
     while (1) {
         int ret = serDataAvailable(this->ser_port);
         if (ret < 0) {
-            throw std::runtime_error(
-                    "serDataAvailable failed with code "
-                            + std::to_string(ret));
+            return ret;
         } else if (ret == 0) {
             break;
         }
@@ -78,22 +228,14 @@ int LinpRemote::recv(LinpReceiverFrame &frame) {
         std::vector<char> buf(ret);
         ret = serRead(this->ser_port, buf.data(), buf.size());
         if (ret < 0) {
-            throw std::runtime_error(
-                    "serRead failed with code "
-                            + std::to_string(ret));
+            return ret;
         } else if (ret == 0) {
             break;
         }
 
-        this->buffer << std::string(buf.begin(), buf.end());
+        this->parser.append(reinterpret_cast<const uint8_t *>(buf.data()),
+                ret);
     }
-//    try {
-        frame.read_from(this->buffer);
-//    } catch (const std::invalid_argument &err) {
-//        return -1;
-//    } catch (const std::out_of_range &err) {
-//        return -2;
-//    }
-    return 0;
+    // 没有完整的帧时未解析的数据留在缓冲区
+    return this->parser.next(frame) ? 0 : 1;
 }
-
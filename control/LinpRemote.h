@@ -16,277 +16,118 @@
 #include <sstream>
 #include <thread>
 #include <chrono>
-
-struct LinpWirelessFrame {
-    uint8_t type;               // 帧类型
-    uint32_t addr;              // 源地址
-    uint8_t sensor;             // 设备类型
-    std::vector<uint8_t> data;  // 数据
-
-    // construct frame raw data
-    std::vector<uint8_t> make_frame() {
-        std::vector<uint8_t> raw_data;
-        raw_data.push_back(type);
-        raw_data.push_back(static_cast<uint8_t>(addr >> 24));
-        raw_data.push_back(static_cast<uint8_t>(addr >> 16));
-        raw_data.push_back(static_cast<uint8_t>(addr >> 8));
-        raw_data.push_back(static_cast<uint8_t>(addr >> 0));
-        raw_data.push_back(sensor);
-        raw_data.insert(raw_data.end(), data.begin(), data.end());
-        return raw_data;
-    }
-
-    operator std::vector<uint8_t>() {
-        return this->make_frame();
-    }
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+
+#include "LinpFrame.h"
+#include "../general/Logger.h"
+
+// 每次发送等待应答的时间(ms), 以及超时或写入失败后的重发次数
+#define LINP_ACK_TIMEOUT_MS 300
+#define LINP_RETRIES 2
+// I/O线程等待应答时读取串口的间隔(ms)
+#define LINP_POLL_MS 10
+
+enum LinpStatus {
+    LINP_OK = 0,
+    LINP_TIMEOUT = -1,      // 重发后仍未收到应答
+    LINP_IO_ERROR = -2,     // 串口写入失败
+    LINP_SUPERSEDED = -3,   // 发送前被同一开关更新的命令取代
+    LINP_CLOSED = -4,       // LinpRemote已析构, 请求未发送
 };
 
-struct LinpReceiverFrame {
-    const uint8_t start = 0x55;       // 引导码
-    uint16_t data_len;          // data数据字段长度
-    uint8_t opt_data_len;       // opt_data可选数据字段长度
-    uint8_t type;               // 帧类型
-    uint8_t crc_header;         // 帧头CRC8校验
-    std::vector<uint8_t> data;     // 数据
-    std::vector<uint8_t> opt_data;  // 可选数据
-    uint8_t crc_data;           // data字段 + opt字段的CRC8校验
-private:
-    static const uint8_t CRC8_TABLE[256];
-
-    static uint8_t CRC8(uint8_t *packet, int length, uint8_t init_crc = 0x00) {
-        uint8_t crc_result = init_crc;
-        for (int i = 0; i < length; i++) {
-            crc_result = CRC8_TABLE[crc_result ^ packet[i]];
-        }
-        return crc_result;
-    }
-public:
-    bool check_header_crc() {
-        std::vector<uint8_t> header = { static_cast<uint8_t>(data_len >> 8),
-                static_cast<uint8_t>(data_len >> 0), opt_data_len, type };
-        if (this->crc_header != CRC8(header.data(), header.size())) {
-            return false;
-        }
-        return true;
-    }
-
-    bool check_data_crc() {
-        uint8_t crc8 = CRC8(this->data.data(), this->data.size());
-        if (this->crc_data
-                != CRC8(this->opt_data.data(), opt_data.size(), crc8)) {
-            return false;
-        }
-        return true;
-    }
-
-    bool check_frame() {
-        if (this->data_len != this->data.size()) {
-            return false;
-        }
-        if (this->opt_data_len != this->opt_data.size()) {
-            return false;
-        }
-
-        // calc CRC of header
-        if (!check_header_crc()) {
-            return false;
-        }
-        // calc CRC of data + opt_data
-        if (!check_data_crc()) {
-            return false;
-        }
-        return true;
-    }
-
-    // 计算字段长度, 并计算CRC8校验码, 返回生成的整帧字节数组
-    std::vector<uint8_t> make_frame() {
-
-        // calc data length
-        if (this->data.size() > 65535) {
-            throw std::length_error(
-                    "LinpWirelessFrame total length "
-                            + std::to_string(this->data.size()) + " > 65535");
-        }
-        this->data_len = static_cast<uint16_t>(this->data.size());
-        // calc opt_data length
-        if (this->opt_data.size() > 255) {
-            throw std::length_error(
-                    "LinpReceiverFrame opt_data length "
-                            + std::to_string(this->opt_data.size()) + " > 255");
-        }
-        this->opt_data_len = static_cast<uint8_t>(this->opt_data.size());
-
-        // calc CRC of header
-        std::vector<uint8_t> header = { static_cast<uint8_t>(data_len >> 8),
-                static_cast<uint8_t>(data_len >> 0), opt_data_len, type };
-        this->crc_header = CRC8(header.data(), header.size());
-        // calc CRC of data + opt_data
-        this->crc_data = CRC8(this->data.data(), this->data.size());
-        this->crc_data = CRC8(this->opt_data.data(), opt_data.size(),
-                this->crc_data);
-
-        // construct frame raw data
-        std::vector<uint8_t> raw_data;
-        raw_data.push_back(this->start);
-        raw_data.push_back(static_cast<uint8_t>(data_len >> 8));
-        raw_data.push_back(static_cast<uint8_t>(data_len >> 0));
-        raw_data.push_back(opt_data_len);
-        raw_data.push_back(type);
-        raw_data.push_back(crc_header);
-        raw_data.insert(raw_data.end(), this->data.begin(), this->data.end());
-        raw_data.insert(raw_data.end(), this->opt_data.begin(),
-                this->opt_data.end());
-        raw_data.push_back(crc_data);
-
-        return raw_data;
-    }
-
-    int read_from(std::stringstream &in) {
-        while (1) {
-            std::vector<uint8_t> data_read;
-            std::streamsize ret;
-
-            // find frame start
-            char start = 0x00;
-            do {
-                ret = in.readsome(&start, 1);
-            } while (ret == 1 && start != this->start);
-            if (start != this->start) {
-                throw std::runtime_error("can't find frame start");
-            }
-            data_read.push_back(start);
-
-            // get header
-            char header[5];
-            ret = in.readsome(header, 5);
-            data_read.insert(data_read.end(), header, header + ret);
-            if (ret < 5) {
-                for (int i = 0; i < data_read.size(); i++) {
-                    in.putback(data_read[i]);
-                }
-                throw std::runtime_error(
-                        "unfinished frame header" + std::to_string(ret) + "/5");
-            }
-            // assign header
-            this->data_len = static_cast<uint16_t>(data_read[1] << 8)
-                    + data_read[2];
-            this->opt_data_len = data_read[3];
-            this->type = data_read[4];
-            this->crc_header = data_read[5];
-            // check header
-            if (!this->check_header_crc()) {
-                // crc not match
-                for (int i = 1; i < data_read.size(); i++) {
-                    in.putback(data_read[i]);
-                }
-                continue;
-            }
-
-            // get data
-            std::vector<char> data(this->data_len + this->opt_data_len + 1);
-            ret = in.readsome(data.data(), data.size());
-            data_read.insert(data_read.end(), data.begin(), data.end());
-            if (ret < data.size()) {
-                for (int i = 0; i < data_read.size(); i++) {
-                    in.putback(data_read[i]);
-                }
-                throw std::runtime_error(
-                        "unfinished frame data " + std::to_string(ret) + "/"
-                                + std::to_string(data.size()));
-            }
-            // assign data, opt_data, crc_data
-            this->data = std::vector<uint8_t>(data.begin(),
-                    data.begin() + this->data_len);
-            this->opt_data = std::vector<uint8_t>(data.begin() + this->data_len,
-                    data.end() - 1);
-            this->crc_data = data[data.size() - 1];
-            if (!this->check_data_crc()) {
-                // crc not match
-                for (int i = 1; i < data_read.size(); i++) {
-                    in.putback(data_read[i]);
-                }
-                continue;
-            }
-
-            return 0;
-        }
-    }
+struct LinpReply {
+    int status = LINP_OK;
+    LinpReceiverFrame ack;      // 匹配到的应答帧, 仅在请求需要应答且成功时有效
+};
 
-    operator std::vector<uint8_t>() {
-        return this->make_frame();
-    }
+// 请求完成时在I/O线程中调用(被取代时在submit的调用线程中), 应尽快返回
+typedef std::function<void(const LinpReply&)> LinpCallback;
+
+struct LinpRequest {
+    LinpReceiverFrame frame;
+    // 判断收到的帧是否为本请求的应答; 为空时写入成功即完成
+    std::function<bool(const LinpReceiverFrame&)> match;
+    int timeout_ms = LINP_ACK_TIMEOUT_MS;
+    // 超时或写入失败后的重发次数; 重发期间队列中的其他请求需等待, 因此必须有限
+    int retries = LINP_RETRIES;
+    // 非0时, 队列中coalesce_key相同且尚未发送的请求只保留最新的一个
+    uint64_t coalesce_key = 0;
+    LinpCallback done;
 };
 
+/*
+ * 领普无线接收器的串口收发. 请求由submit()放入队列后立即返回, 专用的I/O线程依次写入串口,
+ * 按match匹配应答, 超时或写入失败时重发; 结果通过future和LinpRequest::done返回.
+ * 同一开关的多个命令在发送前合并为最后一个, 因此控制线程不会阻塞在串口或无线收发上.
+ */
 class LinpRemote {
 public:
     LinpRemote();
 
     virtual ~LinpRemote();
 
-    int ping(int timeout_ms = -1) {
-        std::chrono::high_resolution_clock::time_point measure_time =
-                std::chrono::high_resolution_clock::now();
-
-        LinpReceiverFrame ping_frame;
-        ping_frame.type = 0x05;
-        ping_frame.data = std::vector<uint8_t> { 0x01 };
-        this->send(ping_frame);
-
-        LinpReceiverFrame ack_frame;
-        while (1) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            try {
-                int ret = this->recv(ack_frame);
-                if (ack_frame.type != 0x06 || ack_frame.data.size() != 1
-                        || ack_frame.data[0] != 0x01) {
-                    std::cout << "bad ping ack" << std::endl;
-                } else {
-                    break;
-                }
-            } catch (const std::runtime_error &err) {
-                std::cout << err.what() << std::endl;
-                if (timeout_ms > 0
-                        && std::chrono::duration_cast<std::chrono::milliseconds>(
-                                std::chrono::high_resolution_clock::now()
-                                        - measure_time).count() > timeout_ms) {
-                    return -1;
-                }
+    // 放入发送队列, 不会阻塞
+    std::future<LinpReply> submit(const LinpRequest &request);
+
+    // 等待接收器应答, 成功返回0; timeout_ms不大于0时一直等待.
+    // 每次只提交一个不重发的请求, 超时后重新提交, 期间排队的开关命令可以先发送
+    int ping(int timeout_ms = 1000) {
+        auto deadline = std::chrono::steady_clock::now()
+                + std::chrono::milliseconds(timeout_ms);
+        for (;;) {
+            LinpRequest request;
+            request.frame.type = 0x05;
+            request.frame.data = std::vector<uint8_t> { 0x01 };
+            request.match = [](const LinpReceiverFrame &ack) {
+                return ack.type == 0x06 && ack.data.size() == 1
+                        && ack.data[0] == 0x01;
+            };
+            if (timeout_ms > 0) {
+                request.timeout_ms = std::min(timeout_ms, LINP_ACK_TIMEOUT_MS);
+            }
+            request.retries = 0;
+            int status = this->submit(request).get().status;
+            if (status == LINP_OK || status == LINP_CLOSED
+                    || (timeout_ms > 0
+                            && std::chrono::steady_clock::now() >= deadline)) {
+                return status;
+            }
+            // 写入失败时请求立即返回, 间隔一段时间再试
+            if (status == LINP_IO_ERROR) {
+                std::this_thread::sleep_for(
+                        std::chrono::milliseconds(LINP_ACK_TIMEOUT_MS));
             }
         }
-
-        return 0;
     }
 
     int read_fw_ver(std::string &version) {
-        LinpReceiverFrame read_fw_ver_frame;
-        read_fw_ver_frame.type = 0x05;
-        read_fw_ver_frame.data = std::vector<uint8_t> { 0x02 };
-        this->send(read_fw_ver_frame);
-
-        LinpReceiverFrame ack_frame;
-        while (1) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            try {
-                int ret = this->recv(ack_frame);
-                if (ack_frame.type != 0x06 || ack_frame.data.size() != 4
-                        || ack_frame.data[0] != 0x02) {
-                    std::cout << "bad read_fw_ver ack" << std::endl;
-                } else {
-                    break;
-                }
-            } catch (const std::runtime_error &err) {
-                std::cout << err.what() << std::endl;
-            }
+        LinpRequest request;
+        request.frame.type = 0x05;
+        request.frame.data = std::vector<uint8_t> { 0x02 };
+        request.match = [](const LinpReceiverFrame &ack) {
+            return ack.type == 0x06 && ack.data.size() == 4
+                    && ack.data[0] == 0x02;
+        };
+        LinpReply reply = this->submit(request).get();
+        if (reply.status != LINP_OK) {
+            return reply.status;
         }
 
-        version = "V" + std::to_string(ack_frame.data[1]) + "."
-                + std::to_string(ack_frame.data[2]) + "."
-                + std::to_string(ack_frame.data[3]);
+        version = "V" + std::to_string(reply.ack.data[1]) + "."
+                + std::to_string(reply.ack.data[2]) + "."
+                + std::to_string(reply.ack.data[3]);
 
         return 0;
     }
 
-    int set_switch(uint32_t addr, bool state) {
+    // 开关命令写入串口即完成(无线开关不回应答), 同一地址未发送的命令只保留最后一个
+    std::future<LinpReply> set_switch(uint32_t addr, bool state,
+            const LinpCallback &done = LinpCallback()) {
         LinpWirelessFrame wireless_frame;
         wireless_frame.type = 0x5F;
         wireless_frame.addr = addr;
@@ -298,22 +139,48 @@ public:
             wireless_frame.data.push_back(0x00);
         }
 
-        LinpReceiverFrame recver_frame;
-        recver_frame.type = 0x01;
-        recver_frame.data = wireless_frame;
-        recver_frame.opt_data = std::vector<uint8_t> { 0x01, 0x00, 0x00, 0x00,
-                0x00, 0x00, 0x00 };
+        LinpRequest request;
+        request.frame.type = 0x01;
+        request.frame.data = wireless_frame;
+        request.frame.opt_data = std::vector<uint8_t> { 0x01, 0x00, 0x00,
+                0x00, 0x00, 0x00, 0x00 };
+        request.coalesce_key = (1ULL << 32) | addr;
+        request.done = done;
 
-        this->send(recver_frame);
+        return this->submit(request);
     }
 
-    int send(LinpReceiverFrame &frame);
+private:
+    struct Pending {
+        LinpRequest request;
+        std::promise<LinpReply> promise;
+        int64_t submit_ns = 0;
 
+        explicit Pending(const LinpRequest &request) :
+                request(request) {
+        }
+    };
+
+    void ioLoop();
+    LinpReply execute(Pending *pending);
+    void complete(Pending *pending, const LinpReply &reply);
+    // 队列中是否有coalesce_key相同的请求; 需持有mutex
+    bool hasQueued(uint64_t coalesce_key) const;
+
+    // 写入一帧, 失败时返回pigpio的错误码
+    int send(LinpReceiverFrame &frame);
+    // 读取串口中已到达的数据并解析一帧: 0 得到一帧, 1 没有完整的帧, 小于0 串口错误
     int recv(LinpReceiverFrame &frame);
-private:
+
     std::string ser_path;
     int ser_port;
-    std::stringstream buffer;
+    LinpFrameParser parser;
+
+    std::thread io_thread;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<Pending*> queue;
+    bool stop_flag = false;
 };
 
 #endif /* CONTROL_LINPREMOTE_H_ */
@@ -0,0 +1,232 @@
+/*
+ * LatencyStats.cpp
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "LatencyStats.h"
+
+LatencyHistogram::Shard::Shard() {
+    total_count.store(0);
+    total_ns.store(0);
+    for (int s = 0; s < WINDOW_SLOTS; s++) {
+        slots[s].epoch.store(-1);
+        slots[s].sum_ns.store(0);
+        slots[s].max_ns.store(0);
+        for (int i = 0; i < N_BUCKETS; i++) {
+            slots[s].counts[i].store(0);
+        }
+    }
+}
+
+LatencyHistogram::LatencyHistogram(int64_t window_ms) :
+        slot_ns(std::max<int64_t>(1, window_ms * 1000000 / WINDOW_SLOTS)) {
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        shards[i].store(NULL);
+    }
+}
+
+LatencyHistogram::~LatencyHistogram() {
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        delete shards[i].load();
+    }
+}
+
+// 小于SUB_BUCKETS的值每个值一个桶, 之后每个2的幂区间[2^k, 2^(k+1))等分为SUB_BUCKETS个桶
+int LatencyHistogram::bucketIndex(int64_t ns) {
+    if (ns < SUB_BUCKETS) {
+        return ns < 0 ? 0 : (int) ns;
+    }
+    int k = 63 - __builtin_clzll((unsigned long long) ns);
+    if (k >= MAX_BITS) {
+        return N_BUCKETS - 1;
+    }
+    return (k - SUB_BITS + 1) * SUB_BUCKETS
+            + (int) ((ns >> (k - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+// 桶的中间值
+int64_t LatencyHistogram::bucketValue(int index) {
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+    int shift = index / SUB_BUCKETS - 1;
+    int64_t lower = (int64_t) (SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+    return lower + ((int64_t) 1 << shift) / 2;
+}
+
+// 每个线程首次记录时分配一个分片编号
+int LatencyHistogram::shardIndex() {
+    static std::atomic<int> next_index(0);
+    static thread_local int index = std::min(next_index.fetch_add(1),
+            MAX_SHARDS - 1);
+    return index;
+}
+
+LatencyHistogram::Shard *LatencyHistogram::localShard() {
+    std::atomic<Shard*> &entry = shards[shardIndex()];
+    Shard *shard = entry.load(std::memory_order_acquire);
+    if (shard == NULL) {
+        Shard *created = new Shard();
+        if (entry.compare_exchange_strong(shard, created,
+                std::memory_order_acq_rel)) {
+            shard = created;
+        } else {
+            // 共用分片的线程已先完成分配
+            delete created;
+        }
+    }
+    return shard;
+}
+
+void LatencyHistogram::record(int64_t ns) {
+    if (ns < 0) {
+        ns = 0;
+    }
+    Shard *shard = localShard();
+    int64_t epoch = now_ns() / slot_ns;
+    Slot &slot = shard->slots[epoch % WINDOW_SLOTS];
+
+    // 轮换到该段时清空过期数据
+    if (slot.epoch.load(std::memory_order_acquire) != epoch) {
+        for (int i = 0; i < N_BUCKETS; i++) {
+            slot.counts[i].store(0, std::memory_order_relaxed);
+        }
+        slot.sum_ns.store(0, std::memory_order_relaxed);
+        slot.max_ns.store(0, std::memory_order_relaxed);
+        slot.epoch.store(epoch, std::memory_order_release);
+    }
+
+    shard->total_count.fetch_add(1, std::memory_order_relaxed);
+    shard->total_ns.fetch_add(ns, std::memory_order_relaxed);
+    slot.counts[bucketIndex(ns)].fetch_add(1, std::memory_order_relaxed);
+    slot.sum_ns.fetch_add(ns, std::memory_order_relaxed);
+    int64_t max_ns = slot.max_ns.load(std::memory_order_relaxed);
+    while (ns > max_ns
+            && !slot.max_ns.compare_exchange_weak(max_ns, ns,
+                    std::memory_order_relaxed)) {
+    }
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::snapshot() const {
+    Snapshot result;
+    std::vector<uint64_t> counts(N_BUCKETS, 0);
+    uint64_t sum_ns = 0;
+    int64_t epoch = now_ns() / slot_ns;
+
+    for (int s = 0; s < MAX_SHARDS; s++) {
+        const Shard *shard = shards[s].load(std::memory_order_acquire);
+        if (shard == NULL) {
+            continue;
+        }
+        result.total_count += shard->total_count.load(
+                std::memory_order_relaxed);
+        result.total_ns += shard->total_ns.load(std::memory_order_relaxed);
+        for (int w = 0; w < WINDOW_SLOTS; w++) {
+            const Slot &slot = shard->slots[w];
+            int64_t slot_epoch = slot.epoch.load(std::memory_order_acquire);
+            if (slot_epoch <= epoch - WINDOW_SLOTS || slot_epoch > epoch) {
+                continue;
+            }
+            for (int i = 0; i < N_BUCKETS; i++) {
+                uint32_t n = slot.counts[i].load(std::memory_order_relaxed);
+                counts[i] += n;
+                result.count += n;
+            }
+            sum_ns += slot.sum_ns.load(std::memory_order_relaxed);
+            result.max_ns = std::max(result.max_ns,
+                    slot.max_ns.load(std::memory_order_relaxed));
+        }
+    }
+
+    if (result.count == 0) {
+        return result;
+    }
+    result.mean_ns = (double) sum_ns / result.count;
+
+    // 依次找到p50, p90, p99所在的桶, 桶中间值不超过窗口内的最大值
+    const double quantiles[3] = { 0.5, 0.9, 0.99 };
+    int64_t *values[3] = { &result.p50_ns, &result.p90_ns, &result.p99_ns };
+    uint64_t seen = 0;
+    int q = 0;
+    for (int i = 0; i < N_BUCKETS && q < 3; i++) {
+        seen += counts[i];
+        while (q < 3 && seen >= std::ceil(quantiles[q] * result.count)) {
+            *values[q] = std::min(bucketValue(i), result.max_ns);
+            q++;
+        }
+    }
+    return result;
+}
+
+static std::mutex &registryMutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+static std::map<std::string, std::unique_ptr<LatencyHistogram>> &registry() {
+    static std::map<std::string, std::unique_ptr<LatencyHistogram>> histograms;
+    return histograms;
+}
+
+LatencyHistogram &LatencyStats::get(const std::string &name) {
+    std::lock_guard<std::mutex> lock(registryMutex());
+    std::unique_ptr<LatencyHistogram> &hist = registry()[name];
+    if (!hist) {
+        hist.reset(new LatencyHistogram());
+    }
+    return *hist;
+}
+
+LatencyHistogram &LatencyStats::layer(const std::string &prefix, int index) {
+    std::string number = std::to_string(index);
+    if (number.size() < 2) {
+        number = "0" + number;
+    }
+    return get(prefix + number);
+}
+
+std::vector<std::pair<std::string, LatencyHistogram::Snapshot>> LatencyStats::snapshotAll() {
+    // 只在锁内拷贝直方图地址(注册后不变), 快照较慢, 在锁外进行, 避免阻塞注册新统计项的线程
+    std::vector<std::pair<std::string, LatencyHistogram*>> hists;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex());
+        for (const auto &entry : registry()) {
+            hists.push_back(std::make_pair(entry.first, entry.second.get()));
+        }
+    }
+    std::vector<std::pair<std::string, LatencyHistogram::Snapshot>> result;
+    for (const auto &entry : hists) {
+        result.push_back(
+                std::make_pair(entry.first, entry.second->snapshot()));
+    }
+    return result;
+}
+
+void LatencyStats::print(std::ostream &os) {
+    std::ios::fmtflags flags = os.flags();
+    std::streamsize precision = os.precision();
+    os << std::setw(22) << std::left << "stage (ms)" << std::right
+            << std::setw(8) << "count" << std::setw(9) << "mean"
+            << std::setw(9) << "p50" << std::setw(9) << "p90"
+            << std::setw(9) << "p99" << std::setw(9) << "max" << std::endl;
+    os << std::fixed << std::setprecision(3);
+    for (const auto &entry : snapshotAll()) {
+        const LatencyHistogram::Snapshot &s = entry.second;
+        if (s.count == 0) {
+            continue;
+        }
+        os << std::setw(22) << std::left << entry.first << std::right
+                << std::setw(8) << s.count << std::setw(9) << s.mean_ns / 1e6
+                << std::setw(9) << s.p50_ms() << std::setw(9) << s.p90_ms()
+                << std::setw(9) << s.p99_ms() << std::setw(9) << s.max_ms()
+                << std::endl;
+    }
+    os.flags(flags);
+    os.precision(precision);
+}
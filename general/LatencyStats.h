@@ -0,0 +1,160 @@
+/*
+ * LatencyStats.h
+ *
+ * 各处理阶段的耗时统计. 计时使用steady_clock, 精度为纳秒; 每个统计项为一个滚动窗口
+ * 的对数-线性直方图(类似HdrHistogram, 相对误差约6%), 可查询p50/p90/p99/max.
+ *
+ * 记录时每个线程只写自己的分片(原子计数, 无锁), 读取时合并全部分片, 因此可以在
+ * tbb::parallel_for内部直接记录, 也可以在其他线程(如显示线程)中随时读取.
+ *
+ * 用法:
+ *     static LatencyHistogram &hist = LatencyStats::get("layer.smooth");
+ *     {
+ *         ScopedLatency timer(hist);
+ *         ...
+ *     }
+ *     LatencyHistogram::Snapshot s = hist.snapshot();
+ */
+
+#ifndef LATENCYSTATS_H_
+#define LATENCYSTATS_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+class LatencyHistogram {
+public:
+    struct Snapshot {
+        uint64_t count = 0;
+        double mean_ns = 0;
+        int64_t p50_ns = 0;
+        int64_t p90_ns = 0;
+        int64_t p99_ns = 0;
+        int64_t max_ns = 0;
+        // 启动以来的累计次数与总耗时, 不随窗口滚动, 只增不减
+        uint64_t total_count = 0;
+        uint64_t total_ns = 0;
+
+        double p50_ms() const { return p50_ns / 1e6; }
+        double p90_ms() const { return p90_ns / 1e6; }
+        double p99_ms() const { return p99_ns / 1e6; }
+        double max_ms() const { return max_ns / 1e6; }
+    };
+
+    // window_ms: 统计窗口长度, 窗口被分为WINDOW_SLOTS段轮换, 过期的段被整体丢弃
+    explicit LatencyHistogram(int64_t window_ms = 10000);
+    ~LatencyHistogram();
+
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    void record(int64_t ns);
+    Snapshot snapshot() const;
+
+    static int64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+private:
+    // 每个2的幂区间分为SUB_BUCKETS个线性桶
+    static const int SUB_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    // 最大可记录2^36ns(约68s), 更大的值计入最后一个桶
+    static const int MAX_BITS = 36;
+    static const int N_BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS;
+    static const int WINDOW_SLOTS = 4;
+    // 超出该数量的线程共用最后一个分片(计数为原子操作, 共用也是安全的)
+    static const int MAX_SHARDS = 16;
+
+    struct Slot {
+        std::atomic<int64_t> epoch;
+        std::atomic<uint64_t> sum_ns;
+        std::atomic<int64_t> max_ns;
+        std::atomic<uint32_t> counts[N_BUCKETS];
+    };
+
+    struct Shard {
+        Slot slots[WINDOW_SLOTS];
+        std::atomic<uint64_t> total_count;
+        std::atomic<uint64_t> total_ns;
+        Shard();
+    };
+
+    static int bucketIndex(int64_t ns);
+    static int64_t bucketValue(int index);
+    static int shardIndex();
+    Shard *localShard();
+
+    int64_t slot_ns;
+    std::atomic<Shard*> shards[MAX_SHARDS];
+};
+
+// 按名称注册的直方图, 首次访问时创建, 之后地址不变
+class LatencyStats {
+public:
+    static LatencyHistogram &get(const std::string &name);
+    // 按层编号区分的统计项, 如layer("pyramid.layer", 3) -> "pyramid.layer03"
+    static LatencyHistogram &layer(const std::string &prefix, int index);
+
+    static std::vector<std::pair<std::string, LatencyHistogram::Snapshot>> snapshotAll();
+    // 打印全部统计项, 单位ms
+    static void print(std::ostream &os = std::cout);
+};
+
+// 按层编号缓存的统计项, 用于并行循环中逐层计时: 每层首次访问时经LatencyStats::layer
+// 注册, 之后只读取缓存的指针, 不构造名称也不加锁. 可在多个线程中同时使用
+class LayerLatencyStats {
+public:
+    static const int MAX_LAYERS = 64;
+
+    explicit LayerLatencyStats(const std::string &prefix) :
+            prefix(prefix) {
+        for (int i = 0; i < MAX_LAYERS; i++) {
+            hists[i].store(NULL, std::memory_order_relaxed);
+        }
+    }
+
+    LatencyHistogram &operator[](int index) {
+        if (index < 0 || index >= MAX_LAYERS) {
+            return LatencyStats::layer(prefix, index);
+        }
+        LatencyHistogram *hist = hists[index].load(std::memory_order_acquire);
+        if (hist == NULL) {
+            // 多个线程同时注册时得到同一个直方图
+            hist = &LatencyStats::layer(prefix, index);
+            hists[index].store(hist, std::memory_order_release);
+        }
+        return *hist;
+    }
+
+private:
+    std::string prefix;
+    std::atomic<LatencyHistogram*> hists[MAX_LAYERS];
+};
+
+// 作用域计时器, 析构时将耗时记入直方图
+class ScopedLatency {
+public:
+    explicit ScopedLatency(LatencyHistogram &hist) :
+            hist(hist), start_ns(LatencyHistogram::now_ns()) {
+    }
+
+    ~ScopedLatency() {
+        hist.record(elapsed_ns());
+    }
+
+    int64_t elapsed_ns() const {
+        return LatencyHistogram::now_ns() - start_ns;
+    }
+
+private:
+    LatencyHistogram &hist;
+    int64_t start_ns;
+};
+
+#endif /* LATENCYSTATS_H_ */
@@ -0,0 +1,251 @@
+/*
+ * Logger.cpp
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <thread>
+
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "Logger.h"
+
+std::atomic<int> Logger::min_level(Logger::Info);
+std::atomic<uint64_t> Logger::dropped(0);
+
+namespace {
+
+struct LogRecord {
+    int64_t time_ns;    // system_clock, 用于输出日期时间
+    int tid;
+    uint8_t level;
+    uint16_t len;
+    char text[LOG_RECORD_TEXT];
+};
+
+}
+
+// 单个线程的环形缓冲区: 所属线程只移动head, 写出线程只移动tail
+// 缓冲区在线程退出后保留, 以便写出其中剩余的日志
+struct Logger::Buffer {
+    int tid;
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    LogRecord records[LOG_BUFFER_RECORDS];
+};
+
+std::mutex &Logger::buffersMutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+std::vector<Logger::Buffer*> &Logger::buffers() {
+    static std::vector<Buffer*> list;
+    return list;
+}
+
+// 写出线程与flush()互斥, 保证每个缓冲区只有一个消费者
+static std::mutex &drainMutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+Logger::Buffer *Logger::localBuffer() {
+    static thread_local Buffer *buffer = NULL;
+    if (buffer == NULL) {
+        buffer = new Buffer();
+        buffer->tid = (int) syscall(SYS_gettid);
+        buffer->head.store(0);
+        buffer->tail.store(0);
+        std::lock_guard<std::mutex> lock(buffersMutex());
+        buffers().push_back(buffer);
+    }
+    return buffer;
+}
+
+void Logger::submit(Level level, const char *text, size_t len) {
+    startFlusher();
+    Buffer *buffer = localBuffer();
+    uint64_t head = buffer->head.load(std::memory_order_relaxed);
+    if (head - buffer->tail.load(std::memory_order_acquire)
+            >= LOG_BUFFER_RECORDS) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    LogRecord &record = buffer->records[head % LOG_BUFFER_RECORDS];
+    record.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    record.tid = buffer->tid;
+    record.level = level;
+    record.len = (uint16_t) std::min<size_t>(len, LOG_RECORD_TEXT);
+    memcpy(record.text, text, record.len);
+    buffer->head.store(head + 1, std::memory_order_release);
+}
+
+void Logger::flush() {
+    static const char level_chars[] = { 'D', 'I', 'W', 'E' };
+
+    std::lock_guard<std::mutex> drain_lock(drainMutex());
+    std::vector<LogRecord> records;
+    {
+        std::lock_guard<std::mutex> lock(buffersMutex());
+        for (Buffer *buffer : buffers()) {
+            uint64_t tail = buffer->tail.load(std::memory_order_relaxed);
+            uint64_t head = buffer->head.load(std::memory_order_acquire);
+            for (; tail < head; tail++) {
+                records.push_back(buffer->records[tail % LOG_BUFFER_RECORDS]);
+            }
+            buffer->tail.store(tail, std::memory_order_release);
+        }
+    }
+    if (records.empty()) {
+        return;
+    }
+
+    // 不同线程的日志按时间排序后输出
+    std::stable_sort(records.begin(), records.end(),
+            [](const LogRecord &a, const LogRecord &b) {
+                return a.time_ns < b.time_ns;
+            });
+
+    char prefix[64];
+    for (const LogRecord &record : records) {
+        std::time_t seconds = record.time_ns / 1000000000;
+        struct tm local;
+        localtime_r(&seconds, &local);
+        size_t n = strftime(prefix, sizeof(prefix), "%Y-%m-%d %H:%M:%S",
+                &local);
+        snprintf(prefix + n, sizeof(prefix) - n, ".%03d %c [%d] ",
+                (int) (record.time_ns / 1000000 % 1000),
+                level_chars[record.level], record.tid);
+        fputs(prefix, stdout);
+        fwrite(record.text, 1, record.len, stdout);
+        fputc('\n', stdout);
+    }
+    uint64_t n_dropped = dropped.exchange(0);
+    if (n_dropped > 0) {
+        fprintf(stdout, "(%llu log lines dropped)\n",
+                (unsigned long long) n_dropped);
+    }
+    fflush(stdout);
+}
+
+namespace {
+
+// 后台写出线程, 程序退出时(静态对象析构)停止并写出剩余日志
+class LogFlusher {
+public:
+    LogFlusher() :
+            stop_flag(false), thread(&LogFlusher::run, this) {
+        // 先于本对象完成构造的静态对象后析构, 保证退出时写出剩余日志仍可使用
+        Logger::flush();
+    }
+
+    ~LogFlusher() {
+        stop_flag = true;
+        thread.join();
+        Logger::flush();
+    }
+
+private:
+    void run() {
+        while (!stop_flag) {
+            std::this_thread::sleep_for(
+                    std::chrono::milliseconds(LOG_FLUSH_INTERVAL_MS));
+            Logger::flush();
+        }
+    }
+
+    std::atomic<bool> stop_flag;
+    std::thread thread;
+};
+
+}
+
+void Logger::startFlusher() {
+    static LogFlusher flusher;
+}
+
+void LogLine::append(const char *s, size_t n) {
+    n = std::min(n, LOG_RECORD_TEXT - len);
+    memcpy(text + len, s, n);
+    len += n;
+}
+
+void LogLine::appendf(const char *format, ...) {
+    if (len >= LOG_RECORD_TEXT) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(text + len, LOG_RECORD_TEXT - len, format, args);
+    va_end(args);
+    if (n > 0) {
+        // vsnprintf会写入结尾的'\0', 截断时最后一个字符被'\0'占用
+        len = std::min<size_t>(len + n, LOG_RECORD_TEXT - 1);
+    }
+}
+
+LogLine &LogLine::operator<<(const char *s) {
+    append(s, strlen(s));
+    return *this;
+}
+
+LogLine &LogLine::operator<<(const std::string &s) {
+    append(s.data(), s.size());
+    return *this;
+}
+
+LogLine &LogLine::operator<<(char c) {
+    append(&c, 1);
+    return *this;
+}
+
+LogLine &LogLine::operator<<(bool b) {
+    return *this << (b ? '1' : '0');
+}
+
+LogLine &LogLine::operator<<(int v) {
+    appendf("%d", v);
+    return *this;
+}
+
+LogLine &LogLine::operator<<(unsigned v) {
+    appendf("%u", v);
+    return *this;
+}
+
+LogLine &LogLine::operator<<(long v) {
+    appendf("%ld", v);
+    return *this;
+}
+
+LogLine &LogLine::operator<<(unsigned long v) {
+    appendf("%lu", v);
+    return *this;
+}
+
+LogLine &LogLine::operator<<(long long v) {
+    appendf("%lld", v);
+    return *this;
+}
+
+LogLine &LogLine::operator<<(unsigned long long v) {
+    appendf("%llu", v);
+    return *this;
+}
+
+LogLine &LogLine::operator<<(double v) {
+    appendf("%g", v);
+    return *this;
+}
+
+LogLine &LogLine::operator<<(const void *p) {
+    appendf("%p", p);
+    return *this;
+}
@@ -0,0 +1,121 @@
+/*
+ * Logger.h
+ *
+ * 异步日志. 调用线程只把格式化好的一行文本写入本线程的环形缓冲区(单生产者单消费者,
+ * 无锁), 由后台线程每LOG_FLUSH_INTERVAL_MS毫秒按时间顺序合并写到stdout, 因此TBB
+ * 工作线程和控制循环中记录日志不会因stdout加锁或终端阻塞而等待.
+ * 缓冲区满时丢弃该条日志并计数, 不会阻塞; 低于当前级别的日志不做任何格式化.
+ *
+ * 用法:
+ *     ACF_LOG(Info) << "Light ON";
+ *     ACF_LOG(Warn) << "Keep current model, failed to load " << path;
+ *     Logger::setLevel(Logger::Debug);
+ *
+ * 输出格式: 2018-05-20 12:34:56.789 I [1234] Light ON
+ */
+
+#ifndef LOGGER_H_
+#define LOGGER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// 每条日志的最大长度, 超出部分截断
+#define LOG_RECORD_TEXT 232
+// 每个线程缓冲区的日志条数
+#define LOG_BUFFER_RECORDS 256
+#define LOG_FLUSH_INTERVAL_MS 20
+
+class Logger {
+public:
+    enum Level {
+        Debug, Info, Warn, Error, Off
+    };
+
+    static bool isEnabled(Level level) {
+        return level >= min_level.load(std::memory_order_relaxed);
+    }
+
+    static void setLevel(Level level) {
+        min_level.store(level);
+    }
+
+    // 拷贝一条日志到当前线程的缓冲区
+    static void submit(Level level, const char *text, size_t len);
+
+    // 在调用线程中立即写出全部缓冲的日志, 用于退出前和致命错误
+    static void flush();
+
+    // 上次写出之后因缓冲区满而丢弃的日志条数
+    static uint64_t getDropped() {
+        return dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Buffer;
+    static Buffer *localBuffer();
+    static std::vector<Buffer*> &buffers();
+    static std::mutex &buffersMutex();
+    static void startFlusher();
+
+    static std::atomic<int> min_level;
+    static std::atomic<uint64_t> dropped;
+};
+
+// 一条日志, 析构时提交; 常用类型直接格式化到定长缓冲区, 其他类型经ostringstream转换
+class LogLine {
+public:
+    explicit LogLine(Logger::Level level) :
+            level(level), len(0) {
+    }
+
+    ~LogLine() {
+        Logger::submit(level, text, len);
+    }
+
+    LogLine(const LogLine&) = delete;
+    LogLine& operator=(const LogLine&) = delete;
+
+    LogLine &operator<<(const char *s);
+    LogLine &operator<<(const std::string &s);
+    LogLine &operator<<(char c);
+    LogLine &operator<<(bool b);
+    LogLine &operator<<(int v);
+    LogLine &operator<<(unsigned v);
+    LogLine &operator<<(long v);
+    LogLine &operator<<(unsigned long v);
+    LogLine &operator<<(long long v);
+    LogLine &operator<<(unsigned long long v);
+    LogLine &operator<<(double v);
+    LogLine &operator<<(float v) {
+        return *this << (double) v;
+    }
+    LogLine &operator<<(const void *p);
+
+    template<typename T>
+    LogLine &operator<<(const T &value) {
+        std::ostringstream os;
+        os << value;
+        return *this << os.str();
+    }
+
+private:
+    void append(const char *s, size_t n);
+    void appendf(const char *format, ...);
+
+    Logger::Level level;
+    size_t len;
+    char text[LOG_RECORD_TEXT];
+};
+
+// 级别低于当前设置时不构造LogLine, 后面的<<表达式也不会求值
+#define ACF_LOG(level) \
+    if (!Logger::isEnabled(Logger::level)) ; \
+    else LogLine(Logger::level)
+
+#endif /* LOGGER_H_ */
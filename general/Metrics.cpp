@@ -0,0 +1,262 @@
+/*
+ * Metrics.cpp
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "Metrics.h"
+#include "LatencyStats.h"
+#include "Logger.h"
+
+namespace {
+
+// 同名指标(不同标签)归为一组, 导出时共用HELP和TYPE行
+struct MetricFamily {
+    std::string help;
+    std::map<std::string, std::unique_ptr<MetricCounter>> counters;
+    std::map<std::string, std::unique_ptr<MetricGauge>> gauges;
+};
+
+std::mutex &registryMutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+std::map<std::string, MetricFamily> &registry() {
+    static std::map<std::string, MetricFamily> families;
+    return families;
+}
+
+std::string labelSet(const std::string &labels) {
+    return labels.empty() ? "" : "{" + labels + "}";
+}
+
+}
+
+MetricCounter &Metrics::counter(const std::string &name,
+        const std::string &help, const std::string &labels) {
+    std::lock_guard<std::mutex> lock(registryMutex());
+    MetricFamily &family = registry()[name];
+    if (family.help.empty()) {
+        family.help = help;
+    }
+    // 同一组只能是一种类型, 否则导出的TYPE行与部分指标不符
+    if (!family.gauges.empty()) {
+        throw std::logic_error(
+                "Metrics: " + name + " already registered as gauge");
+    }
+    std::unique_ptr<MetricCounter> &metric = family.counters[labels];
+    if (!metric) {
+        metric.reset(new MetricCounter());
+    }
+    return *metric;
+}
+
+MetricGauge &Metrics::gauge(const std::string &name, const std::string &help,
+        const std::string &labels) {
+    std::lock_guard<std::mutex> lock(registryMutex());
+    MetricFamily &family = registry()[name];
+    if (family.help.empty()) {
+        family.help = help;
+    }
+    if (!family.counters.empty()) {
+        throw std::logic_error(
+                "Metrics: " + name + " already registered as counter");
+    }
+    std::unique_ptr<MetricGauge> &metric = family.gauges[labels];
+    if (!metric) {
+        metric.reset(new MetricGauge());
+    }
+    return *metric;
+}
+
+std::string Metrics::exposition() {
+    std::ostringstream os;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex());
+        for (const auto &entry : registry()) {
+            const MetricFamily &family = entry.second;
+            os << "# HELP " << entry.first << " " << family.help << "\n";
+            os << "# TYPE " << entry.first << " "
+                    << (family.counters.empty() ? "gauge" : "counter") << "\n";
+            for (const auto &metric : family.counters) {
+                os << entry.first << labelSet(metric.first) << " "
+                        << metric.second->get() << "\n";
+            }
+            for (const auto &metric : family.gauges) {
+                os << entry.first << labelSet(metric.first) << " "
+                        << metric.second->get() << "\n";
+            }
+        }
+    }
+
+    // 各阶段耗时, 分位数为最近10s的滚动窗口; _sum和_count为启动以来的累计值,
+    // 只增不减, 可用rate()计算任意时间段的平均耗时
+    os << "# HELP acf_stage_latency_seconds Stage latency, quantiles over the last 10s\n";
+    os << "# TYPE acf_stage_latency_seconds summary\n";
+    for (const auto &entry : LatencyStats::snapshotAll()) {
+        const LatencyHistogram::Snapshot &s = entry.second;
+        std::string stage = "stage=\"" + entry.first + "\"";
+        os << "acf_stage_latency_seconds{" << stage << ",quantile=\"0.5\"} "
+                << s.p50_ns / 1e9 << "\n";
+        os << "acf_stage_latency_seconds{" << stage << ",quantile=\"0.9\"} "
+                << s.p90_ns / 1e9 << "\n";
+        os << "acf_stage_latency_seconds{" << stage << ",quantile=\"0.99\"} "
+                << s.p99_ns / 1e9 << "\n";
+        os << "acf_stage_latency_seconds_sum{" << stage << "} "
+                << s.total_ns / 1e9 << "\n";
+        os << "acf_stage_latency_seconds_count{" << stage << "} "
+                << s.total_count << "\n";
+    }
+    return os.str();
+}
+
+MetricsServer::MetricsServer(const std::string &address) :
+        address(address), stop_flag(false) {
+    if (address.compare(0, 5, "unix:") == 0) {
+        unix_path = address.substr(5);
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, unix_path.c_str(), sizeof(addr.sun_path) - 1);
+        listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        unlink(unix_path.c_str());
+        if (listen_fd >= 0
+                && bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr))
+                        < 0) {
+            close(listen_fd);
+            listen_fd = -1;
+        }
+    } else {
+        size_t colon = address.find_last_of(':');
+        std::string host = colon == std::string::npos ?
+                "127.0.0.1" : address.substr(0, colon);
+        std::string port = address.substr(
+                colon == std::string::npos ? 0 : colon + 1);
+        struct addrinfo hints, *result = NULL;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        if (getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(),
+                &hints, &result) == 0) {
+            listen_fd = socket(result->ai_family,
+                    result->ai_socktype | SOCK_CLOEXEC, result->ai_protocol);
+            int reuse = 1;
+            if (listen_fd >= 0) {
+                setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse,
+                        sizeof(reuse));
+            }
+            if (listen_fd >= 0
+                    && bind(listen_fd, result->ai_addr, result->ai_addrlen)
+                            < 0) {
+                close(listen_fd);
+                listen_fd = -1;
+            }
+            freeaddrinfo(result);
+        }
+    }
+
+    if (listen_fd < 0 || listen(listen_fd, 4) < 0) {
+        ACF_LOG(Error) << "MetricsServer: cannot listen on " << address
+                << ": " << strerror(errno);
+        if (listen_fd >= 0) {
+            close(listen_fd);
+            listen_fd = -1;
+        }
+        return;
+    }
+    ACF_LOG(Info) << "Metrics served on " << address;
+    thread = std::thread(&MetricsServer::run, this);
+}
+
+MetricsServer::~MetricsServer() {
+    stop_flag = true;
+    if (thread.joinable()) {
+        thread.join();
+    }
+    if (listen_fd >= 0) {
+        close(listen_fd);
+    }
+    if (!unix_path.empty()) {
+        unlink(unix_path.c_str());
+    }
+}
+
+void MetricsServer::run() {
+    while (!stop_flag) {
+        struct pollfd pfd = { listen_fd, POLLIN, 0 };
+        // 超时用于检查退出标志
+        int ret = poll(&pfd, 1, 500);
+        if (ret > 0) {
+            int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                serve(fd);
+                close(fd);
+            }
+        } else if (ret < 0 && errno != EINTR) {
+            ACF_LOG(Error) << "MetricsServer: poll failed: " << strerror(errno);
+            break;
+        }
+    }
+}
+
+// 读取请求头(最多等待1s), 只支持GET, 返回HTTP/1.0响应后关闭连接
+void MetricsServer::serve(int fd) {
+    char request[2048];
+    size_t len = 0;
+    while (len < sizeof(request) - 1) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 1000) <= 0) {
+            break;
+        }
+        ssize_t n = read(fd, request + len, sizeof(request) - 1 - len);
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+        request[len] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL
+                || strstr(request, "\n\n") != NULL) {
+            break;
+        }
+    }
+    request[len] = '\0';
+
+    std::string response;
+    if (strncmp(request, "GET ", 4) == 0) {
+        std::string body = Metrics::exposition();
+        response = "HTTP/1.0 200 OK\r\n"
+                "Content-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                "\r\n" + body;
+    } else {
+        response = "HTTP/1.0 405 Method Not Allowed\r\n"
+                "Content-Length: 0\r\n\r\n";
+    }
+
+    const char *p = response.data();
+    size_t remaining = response.size();
+    while (remaining > 0) {
+        ssize_t n = send(fd, p, remaining, MSG_NOSIGNAL);
+        if (n <= 0) {
+            break;
+        }
+        p += n;
+        remaining -= n;
+    }
+}
@@ -0,0 +1,106 @@
+/*
+ * Metrics.h
+ *
+ * 运行指标注册表(计数器, 仪表)和Prometheus文本格式导出. 更新指标只有一次原子操作,
+ * 可在检测线程和控制线程中直接调用; 导出由MetricsServer在独立线程中完成.
+ * LatencyStats中的各阶段耗时直方图以summary形式一并导出(滚动窗口内的分位数).
+ *
+ * 用法:
+ *     static MetricCounter &frames = Metrics::counter("acf_frames_processed_total",
+ *             "Frames processed by the detector");
+ *     frames.inc();
+ *     Metrics::gauge("acf_light_state", "Light state machine state").set(2);
+ *     MetricsServer server("127.0.0.1:9101");   // 或 "unix:/tmp/acf_metrics.sock"
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+class MetricCounter {
+public:
+    MetricCounter() :
+            value(0) {
+    }
+
+    void inc(uint64_t n = 1) {
+        value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t get() const {
+        return value.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> value;
+};
+
+class MetricGauge {
+public:
+    MetricGauge() :
+            value(0) {
+    }
+
+    void set(double v) {
+        value.store(v, std::memory_order_relaxed);
+    }
+
+    void add(double v) {
+        double old = value.load(std::memory_order_relaxed);
+        while (!value.compare_exchange_weak(old, old + v,
+                std::memory_order_relaxed)) {
+        }
+    }
+
+    double get() const {
+        return value.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<double> value;
+};
+
+class Metrics {
+public:
+    // labels为Prometheus标签, 如 state="on"; 同名指标的help以首次注册为准,
+    // 同名指标须为同一类型, 否则抛出std::logic_error
+    // 返回的引用在程序运行期间一直有效, 应在循环外获取
+    static MetricCounter &counter(const std::string &name,
+            const std::string &help, const std::string &labels = "");
+    static MetricGauge &gauge(const std::string &name, const std::string &help,
+            const std::string &labels = "");
+
+    // Prometheus文本格式(version 0.0.4)
+    static std::string exposition();
+};
+
+// 在独立线程中提供HTTP服务, 对任意路径返回Metrics::exposition()
+// address: "host:port" 监听TCP, "unix:/path" 监听Unix socket
+class MetricsServer {
+public:
+    explicit MetricsServer(const std::string &address);
+    ~MetricsServer();
+
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+
+    bool isListening() const {
+        return listen_fd >= 0;
+    }
+
+private:
+    void run();
+    void serve(int fd);
+
+    std::string address;
+    std::string unix_path;
+    int listen_fd = -1;
+    std::atomic<bool> stop_flag;
+    std::thread thread;
+};
+
+#endif /* METRICS_H_ */
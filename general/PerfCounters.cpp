@@ -0,0 +1,261 @@
+/*
+ * PerfCounters.cpp
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "PerfCounters.h"
+
+static const char *counter_names[PERF_N_COUNTERS] = { "cycles",
+        "instructions", "L1D-read-misses", "LLC-read-misses",
+        "branch-misses" };
+
+std::atomic<bool> PerfCounters::enabled(false);
+std::atomic<uint32_t> PerfCounters::available_mask(0);
+
+PerfStage::PerfStage() {
+    reset();
+}
+
+void PerfStage::add(const uint64_t *deltas, uint64_t n_units) {
+    calls.fetch_add(1, std::memory_order_relaxed);
+    units.fetch_add(n_units, std::memory_order_relaxed);
+    for (int i = 0; i < PERF_N_COUNTERS; i++) {
+        values[i].fetch_add(deltas[i], std::memory_order_relaxed);
+    }
+}
+
+void PerfStage::reset() {
+    calls.store(0);
+    units.store(0);
+    for (int i = 0; i < PERF_N_COUNTERS; i++) {
+        values[i].store(0);
+    }
+}
+
+static int openCounter(uint32_t type, uint64_t config, int group_fd) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    // 只统计用户态, perf_event_paranoid为2时也可使用
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED
+            | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int) syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+static uint64_t cacheMissConfig(uint64_t cache) {
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+// 当前线程的一组计数器, 第一个成功打开的计数器作为组长, 一次read读取全部计数
+struct PerfCounters::Group {
+    int fds[PERF_N_COUNTERS];
+    // 各计数器在组内的读取顺序, -1表示未打开
+    int slots[PERF_N_COUNTERS];
+    int n_open = 0;
+    int leader = -1;
+    int error = 0;
+
+    Group() {
+        const uint32_t types[PERF_N_COUNTERS] = { PERF_TYPE_HARDWARE,
+                PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE,
+                PERF_TYPE_HARDWARE };
+        const uint64_t configs[PERF_N_COUNTERS] = { PERF_COUNT_HW_CPU_CYCLES,
+                PERF_COUNT_HW_INSTRUCTIONS, cacheMissConfig(
+                        PERF_COUNT_HW_CACHE_L1D), cacheMissConfig(
+                        PERF_COUNT_HW_CACHE_LL), PERF_COUNT_HW_BRANCH_MISSES };
+        for (int i = 0; i < PERF_N_COUNTERS; i++) {
+            fds[i] = openCounter(types[i], configs[i], leader);
+            if (fds[i] < 0 && i == PERF_LLC_MISSES) {
+                // 部分ARM内核没有LL缓存事件, 退而使用通用的缓存缺失事件
+                fds[i] = openCounter(PERF_TYPE_HARDWARE,
+                        PERF_COUNT_HW_CACHE_MISSES, leader);
+            }
+            if (fds[i] < 0) {
+                error = errno;
+                slots[i] = -1;
+                continue;
+            }
+            if (leader < 0) {
+                leader = fds[i];
+            }
+            slots[i] = n_open++;
+        }
+        if (leader >= 0) {
+            ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+    }
+
+    ~Group() {
+        for (int i = 0; i < PERF_N_COUNTERS; i++) {
+            if (fds[i] >= 0) {
+                close(fds[i]);
+            }
+        }
+    }
+
+    bool read(uint64_t *values) const {
+        if (leader < 0) {
+            return false;
+        }
+        // nr, time_enabled, time_running, values[nr]
+        uint64_t buffer[3 + PERF_N_COUNTERS];
+        ssize_t size = ::read(leader, buffer, sizeof(buffer));
+        if (size < (ssize_t) (3 * sizeof(uint64_t))
+                || buffer[0] != (uint64_t) n_open) {
+            return false;
+        }
+        // 计数器被复用(多路分时)时按运行时间比例推算
+        double scale = 1.0;
+        if (buffer[2] > 0 && buffer[2] < buffer[1]) {
+            scale = (double) buffer[1] / buffer[2];
+        }
+        for (int i = 0; i < PERF_N_COUNTERS; i++) {
+            values[i] = slots[i] < 0 ?
+                    0 : (uint64_t) (buffer[3 + slots[i]] * scale);
+        }
+        return true;
+    }
+};
+
+PerfCounters::Group *PerfCounters::localGroup() {
+    static thread_local std::unique_ptr<Group> group;
+    if (!group) {
+        group.reset(new Group());
+    }
+    return group.get();
+}
+
+bool PerfCounters::setEnabled(bool enable) {
+    if (!enable) {
+        enabled.store(false);
+        return true;
+    }
+    Group *group = localGroup();
+    uint32_t mask = 0;
+    for (int i = 0; i < PERF_N_COUNTERS; i++) {
+        if (group->slots[i] >= 0) {
+            mask |= 1u << i;
+        }
+    }
+    available_mask.store(mask);
+    if (mask == 0) {
+        std::cout << "Hardware counters unavailable (" << strerror(group->error)
+                << "), check /proc/sys/kernel/perf_event_paranoid"
+                << std::endl;
+        enabled.store(false);
+        return false;
+    }
+    for (int i = 0; i < PERF_N_COUNTERS; i++) {
+        if (!(mask & (1u << i))) {
+            std::cout << "Hardware counter " << counter_names[i]
+                    << " unavailable" << std::endl;
+        }
+    }
+    enabled.store(true);
+    return true;
+}
+
+bool PerfCounters::isAvailable(PerfCounter counter) {
+    return available_mask.load() & (1u << counter);
+}
+
+bool PerfCounters::read(uint64_t *values) {
+    return localGroup()->read(values);
+}
+
+static std::mutex &registryMutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+static std::map<std::string, std::unique_ptr<PerfStage>> &registry() {
+    static std::map<std::string, std::unique_ptr<PerfStage>> stages;
+    return stages;
+}
+
+PerfStage &PerfCounters::get(const std::string &name) {
+    std::lock_guard<std::mutex> lock(registryMutex());
+    std::unique_ptr<PerfStage> &stage = registry()[name];
+    if (!stage) {
+        stage.reset(new PerfStage());
+    }
+    return *stage;
+}
+
+void PerfCounters::resetAll() {
+    std::lock_guard<std::mutex> lock(registryMutex());
+    for (auto &entry : registry()) {
+        entry.second->reset();
+    }
+}
+
+void PerfCounters::print(std::ostream &os) {
+    if (!isEnabled()) {
+        return;
+    }
+    std::ios::fmtflags flags = os.flags();
+    std::streamsize precision = os.precision();
+    os << std::setw(16) << std::left << "stage" << std::right << std::setw(10)
+            << "calls" << std::setw(14) << "units" << std::setw(8) << "IPC"
+            << std::setw(11) << "cyc/unit" << std::setw(11) << "L1D/unit"
+            << std::setw(11) << "LLC/unit" << std::setw(11) << "br/unit"
+            << std::setw(9) << "L1D/ki" << std::endl;
+    os << std::fixed;
+
+    // 计数器不可用时输出n/a
+    auto column = [&os](bool available, double value, int width,
+            int digits) {
+        if (available) {
+            os << std::setw(width) << std::setprecision(digits) << value;
+        } else {
+            os << std::setw(width) << "n/a";
+        }
+    };
+
+    std::lock_guard<std::mutex> lock(registryMutex());
+    for (const auto &entry : registry()) {
+        const PerfStage &s = *entry.second;
+        if (s.getCalls() == 0) {
+            continue;
+        }
+        double units = std::max<uint64_t>(1, s.getUnits());
+        double cycles = s.getValue(PERF_CYCLES);
+        double instructions = s.getValue(PERF_INSTRUCTIONS);
+        os << std::setw(16) << std::left << entry.first << std::right
+                << std::setw(10) << s.getCalls() << std::setw(14)
+                << s.getUnits();
+        column(isAvailable(PERF_CYCLES) && isAvailable(PERF_INSTRUCTIONS)
+                && cycles > 0, instructions / cycles, 8, 2);
+        column(isAvailable(PERF_CYCLES), cycles / units, 11, 2);
+        column(isAvailable(PERF_L1D_MISSES),
+                s.getValue(PERF_L1D_MISSES) / units, 11, 4);
+        column(isAvailable(PERF_LLC_MISSES),
+                s.getValue(PERF_LLC_MISSES) / units, 11, 4);
+        column(isAvailable(PERF_BRANCH_MISSES),
+                s.getValue(PERF_BRANCH_MISSES) / units, 11, 4);
+        column(isAvailable(PERF_L1D_MISSES) && isAvailable(PERF_INSTRUCTIONS)
+                && instructions > 0,
+                s.getValue(PERF_L1D_MISSES) * 1000 / instructions, 9, 2);
+        os << std::endl;
+    }
+    os.flags(flags);
+    os.precision(precision);
+}
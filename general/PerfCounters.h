@@ -0,0 +1,127 @@
+/*
+ * PerfCounters.h
+ *
+ * 通过perf_event_open读取硬件性能计数器(周期, 指令, L1D/LLC读缺失, 分支预测失败),
+ * 按处理阶段累计, 报告IPC以及每像素/每窗口的缺失次数, 用于判断gradHist和级联分类器
+ * 是受限于访存还是计算.
+ *
+ * 计数器按线程打开(每个线程首次采样时打开一组), ScopedPerf只统计当前线程在作用域内
+ * 的事件, 因此应放在TBB任务内部, 各线程的增量累加到同一个PerfStage中.
+ * 内核不支持, 权限不足(perf_event_paranoid)或某个事件不存在时, 对应计数器报告为n/a,
+ * 全部不可用时setEnabled返回false, 采样不产生任何开销.
+ *
+ * 用法:
+ *     PerfCounters::setEnabled(true);
+ *     static PerfStage &stage = PerfCounters::get("gradHist");
+ *     {
+ *         ScopedPerf perf(stage, width * height);
+ *         ...
+ *     }
+ *     PerfCounters::print();
+ */
+
+#ifndef PERFCOUNTERS_H_
+#define PERFCOUNTERS_H_
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+enum PerfCounter {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_N_COUNTERS
+};
+
+// 一个处理阶段的累计计数, units为处理的像素数或窗口数
+class PerfStage {
+public:
+    PerfStage();
+
+    void add(const uint64_t *deltas, uint64_t units);
+    void reset();
+
+    uint64_t getCalls() const {
+        return calls.load(std::memory_order_relaxed);
+    }
+
+    uint64_t getUnits() const {
+        return units.load(std::memory_order_relaxed);
+    }
+
+    uint64_t getValue(PerfCounter counter) const {
+        return values[counter].load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> calls;
+    std::atomic<uint64_t> units;
+    std::atomic<uint64_t> values[PERF_N_COUNTERS];
+};
+
+class PerfCounters {
+public:
+    // 打开时在当前线程上检测计数器是否可用, 全部不可用时保持关闭并返回false
+    static bool setEnabled(bool enable);
+
+    static bool isEnabled() {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    static bool isAvailable(PerfCounter counter);
+
+    // 读取当前线程的计数器, 不可用的计数器为0
+    static bool read(uint64_t *values);
+
+    static PerfStage &get(const std::string &name);
+    static void resetAll();
+    // 打印各阶段的IPC, 每单位周期数和每单位缺失次数
+    static void print(std::ostream &os = std::cout);
+
+private:
+    struct Group;
+    static Group *localGroup();
+
+    static std::atomic<bool> enabled;
+    // 在检测线程上成功打开的计数器
+    static std::atomic<uint32_t> available_mask;
+};
+
+// 作用域采样, 析构或调用stop()时将增量计入PerfStage
+class ScopedPerf {
+public:
+    explicit ScopedPerf(PerfStage &stage, uint64_t units = 0) :
+            stage(stage), units(units), active(
+                    PerfCounters::isEnabled() && PerfCounters::read(start)) {
+    }
+
+    ~ScopedPerf() {
+        stop();
+    }
+
+    void stop() {
+        if (!active) {
+            return;
+        }
+        active = false;
+        uint64_t end[PERF_N_COUNTERS];
+        if (PerfCounters::read(end)) {
+            for (int i = 0; i < PERF_N_COUNTERS; i++) {
+                end[i] = end[i] >= start[i] ? end[i] - start[i] : 0;
+            }
+            stage.add(end, units);
+        }
+    }
+
+private:
+    PerfStage &stage;
+    uint64_t units;
+    uint64_t start[PERF_N_COUNTERS];
+    bool active;
+};
+
+#endif /* PERFCOUNTERS_H_ */
@@ -0,0 +1,181 @@
+/*
+ * TraceRecorder.cpp
+ */
+
+#include <algorithm>
+#include <csignal>
+#include <fstream>
+#include <iomanip>
+
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "TraceRecorder.h"
+#include "Logger.h"
+
+std::atomic<bool> TraceRecorder::enabled(false);
+std::atomic<bool> TraceRecorder::dump_requested(false);
+
+namespace {
+
+struct TraceEvent {
+    const char *name;
+    int64_t start_ns;
+    int64_t dur_ns;
+    int32_t arg;
+    int32_t reserved;
+};
+
+}
+
+// 单个线程的环形缓冲区, 只由所属线程写入; head为已写入的事件总数
+// 缓冲区在线程退出后保留, 以便导出已退出线程的事件
+struct TraceRecorder::Buffer {
+    int tid;
+    std::atomic<const char*> thread_name;
+    std::atomic<uint64_t> head;
+    TraceEvent events[TRACE_BUFFER_EVENTS];
+};
+
+std::mutex &TraceRecorder::buffersMutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+std::vector<TraceRecorder::Buffer*> &TraceRecorder::buffers() {
+    static std::vector<Buffer*> list;
+    return list;
+}
+
+void TraceRecorder::setEnabled(bool enable) {
+    enabled.store(enable);
+}
+
+// 当前线程的名称, 缓冲区在第一次记录事件时才创建(约1MB), 名称先保存在这里
+thread_local const char *TraceRecorder::local_thread_name = NULL;
+thread_local TraceRecorder::Buffer *TraceRecorder::local_buffer = NULL;
+
+TraceRecorder::Buffer *TraceRecorder::localBuffer() {
+    if (local_buffer == NULL) {
+        // 事件只在head之前有效, 不需要清零
+        Buffer *buffer = new Buffer;
+        buffer->tid = (int) syscall(SYS_gettid);
+        buffer->thread_name.store(local_thread_name);
+        buffer->head.store(0);
+        std::lock_guard<std::mutex> lock(buffersMutex());
+        buffers().push_back(buffer);
+        local_buffer = buffer;
+    }
+    return local_buffer;
+}
+
+void TraceRecorder::record(const char *name, int64_t start_ns,
+        int64_t end_ns, int arg) {
+    Buffer *buffer = localBuffer();
+    uint64_t head = buffer->head.load(std::memory_order_relaxed);
+    TraceEvent &event = buffer->events[head % TRACE_BUFFER_EVENTS];
+    event.name = name;
+    event.start_ns = start_ns;
+    event.dur_ns = end_ns - start_ns;
+    event.arg = arg;
+    buffer->head.store(head + 1, std::memory_order_release);
+}
+
+// 记录关闭时(默认)不分配缓冲区
+void TraceRecorder::setThreadName(const char *name) {
+    local_thread_name = name;
+    if (local_buffer != NULL) {
+        local_buffer->thread_name.store(name);
+    }
+}
+
+bool TraceRecorder::dump(const std::string &path) {
+    struct ThreadEvents {
+        int tid;
+        const char *name;
+        std::vector<TraceEvent> events;
+    };
+    std::vector<ThreadEvents> threads;
+    {
+        std::lock_guard<std::mutex> lock(buffersMutex());
+        for (Buffer *buffer : buffers()) {
+            ThreadEvents t;
+            t.tid = buffer->tid;
+            t.name = buffer->thread_name.load();
+
+            // 拷贝期间写入线程可能继续覆盖最旧的事件, 拷贝后按新的head丢弃这部分
+            uint64_t head = buffer->head.load(std::memory_order_acquire);
+            uint64_t begin = head > TRACE_BUFFER_EVENTS ?
+                    head - TRACE_BUFFER_EVENTS : 0;
+            for (uint64_t i = begin; i < head; i++) {
+                t.events.push_back(buffer->events[i % TRACE_BUFFER_EVENTS]);
+            }
+            uint64_t head_after = buffer->head.load(std::memory_order_acquire);
+            if (head_after + 1 > begin + TRACE_BUFFER_EVENTS) {
+                size_t overwritten = std::min<uint64_t>(t.events.size(),
+                        head_after + 1 - begin - TRACE_BUFFER_EVENTS);
+                t.events.erase(t.events.begin(),
+                        t.events.begin() + overwritten);
+            }
+            threads.push_back(t);
+        }
+    }
+
+    // 时间戳以最早的事件为零点, 单位us
+    int64_t origin = INT64_MAX;
+    size_t n_events = 0;
+    for (const ThreadEvents &t : threads) {
+        for (const TraceEvent &e : t.events) {
+            origin = std::min(origin, e.start_ns);
+        }
+        n_events += t.events.size();
+    }
+
+    std::ofstream file(path);
+    if (!file.is_open()) {
+        ACF_LOG(Error) << "Failed to open trace file " << path;
+        return false;
+    }
+    int pid = getpid();
+    file << std::fixed << std::setprecision(3);
+    file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    for (const ThreadEvents &t : threads) {
+        file << (first ? "\n" : ",\n");
+        first = false;
+        file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid
+                << ",\"tid\":" << t.tid << ",\"args\":{\"name\":\""
+                << (t.name != NULL ? t.name : "thread") << " " << t.tid
+                << "\"}}";
+        for (const TraceEvent &e : t.events) {
+            file << ",\n{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":"
+                    << pid << ",\"tid\":" << t.tid << ",\"ts\":"
+                    << (e.start_ns - origin) / 1e3 << ",\"dur\":"
+                    << e.dur_ns / 1e3;
+            if (e.arg >= 0) {
+                file << ",\"args\":{\"i\":" << e.arg << "}";
+            }
+            file << "}";
+        }
+    }
+    file << "\n]}\n";
+    file.close();
+
+    ACF_LOG(Info) << "Trace written to " << path << " (" << n_events
+            << " events, " << threads.size() << " threads)";
+    return true;
+}
+
+void TraceRecorder::onSignal(int) {
+    dump_requested.store(true);
+}
+
+void TraceRecorder::installSignalHandler(int signum) {
+    std::signal(signum, TraceRecorder::onSignal);
+}
+
+void TraceRecorder::pollDump(const std::string &path) {
+    if (dump_requested.exchange(false)) {
+        dump(path);
+    }
+}
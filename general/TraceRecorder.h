@@ -0,0 +1,92 @@
+/*
+ * TraceRecorder.h
+ *
+ * 处理流程的时间线记录, 导出为Chrome trace格式(chrome://tracing 或 ui.perfetto.dev),
+ * 用于查看各阶段, 各金字塔层和各TBB任务在4个核心上的分布和空闲.
+ *
+ * 每个线程写入自己的环形缓冲区(只保留最近TRACE_BUFFER_EVENTS个事件), 记录一个事件
+ * 只需读两次时钟和写32字节, 关闭时只有一次原子读取, 因此可以在正式运行时打开.
+ * 收到信号(SIGUSR1)后由处理线程调用pollDump导出, 信号处理函数中只设置标志.
+ *
+ * 用法:
+ *     TraceRecorder::setEnabled(true);
+ *     {
+ *         TraceScope trace("layer.smooth", layer_i);
+ *         ...
+ *     }
+ *     TraceRecorder::dump("/home/pi/acf_trace.json");
+ */
+
+#ifndef TRACERECORDER_H_
+#define TRACERECORDER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "LatencyStats.h"
+
+// 每个线程缓冲区的事件数, 每个事件32字节
+#define TRACE_BUFFER_EVENTS 32768
+
+class TraceRecorder {
+public:
+    static void setEnabled(bool enable);
+
+    static bool isEnabled() {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    // name必须是静态字符串(字符串常量), 记录时不拷贝; arg<0表示无参数
+    static void record(const char *name, int64_t start_ns, int64_t end_ns,
+            int arg = -1);
+
+    // 设置当前线程在时间线中显示的名称, 同样必须是静态字符串
+    static void setThreadName(const char *name);
+
+    // 导出全部线程缓冲区中的事件, 成功返回true
+    static bool dump(const std::string &path);
+
+    // 信号处理函数, 只设置导出请求标志, 可用于std::signal或gpioSetSignalFunc
+    static void onSignal(int signum);
+    static void installSignalHandler(int signum);
+    // 若收到过导出请求则导出到path并清除请求
+    static void pollDump(const std::string &path);
+
+private:
+    struct Buffer;
+    static Buffer *localBuffer();
+    static std::vector<Buffer*> &buffers();
+    static std::mutex &buffersMutex();
+    static thread_local Buffer *local_buffer;
+    static thread_local const char *local_thread_name;
+
+    static std::atomic<bool> enabled;
+    static std::atomic<bool> dump_requested;
+};
+
+// 作用域事件, 构造时开始, 析构时结束; 记录关闭时不读取时钟
+class TraceScope {
+public:
+    explicit TraceScope(const char *name, int arg = -1) :
+            name(name), arg(arg), start_ns(
+                    TraceRecorder::isEnabled() ?
+                            LatencyHistogram::now_ns() : -1) {
+    }
+
+    ~TraceScope() {
+        if (start_ns >= 0) {
+            TraceRecorder::record(name, start_ns, LatencyHistogram::now_ns(),
+                    arg);
+        }
+    }
+
+private:
+    const char *name;
+    int arg;
+    int64_t start_ns;
+};
+
+#endif /* TRACERECORDER_H_ */
@@ -18,6 +18,11 @@ void gradHist(const float *magnitude, const float *orientation,
         float *histogram, int src_height, int src_width, int block_size,
         int nOrients, bool full_2pi);
 void gradMagNorm(float *M, float *S, int h, int w, float norm);
+void gradQuantize(const float *orientation_column,
+        const float *magnitude_column, int *O0, int *O1, float *M0, float *M1,
+        int n_blocks, int n, float norm, int n_orients, bool full_2pi);
 
 void rgb2luv_sse(unsigned char *I, float *J, int n, float nrm);
+void yuv2luv_sse(const uint8_t *Y, const uint8_t *U, const uint8_t *V,
+        float *J, int w, int h, float nrm, bool full_range = false);
 #endif
@@ -5,6 +5,7 @@
  * Licensed under the Simplified BSD License [see external/bsd.txt]
  *******************************************************************************/
 
+#include <algorithm>
 #include <cmath>
 #include <cassert>
 #include <cstdlib>
@@ -50,6 +51,66 @@ float* rgb2luv_setup(float z, float *mr, float *mg, float *mb, float &minu,
     return lTable;
 }
 
+// Convert m float rgb values (R1, G1, B1) to luv using sse, planes of J1 are n apart
+static void rgb2luv_block(const float *R1, const float *G1, const float *B1,
+        float *J1, int m, int n, const float *lTable, const float *mr,
+        const float *mg, const float *mb, float minu, float minv, float un,
+        float vn) {
+    int i1;
+    // compute RGB -> XYZ
+    for (int j = 0; j < 3; j++) {
+        __m128 _mr, _mg, _mb, *_J = (__m128 *) (J1 + j * n);
+        const __m128 *_R = (const __m128 *) R1, *_G = (const __m128 *) G1,
+                *_B = (const __m128 *) B1;
+        _mr = SET(mr[j]);
+        _mg = SET(mg[j]);
+        _mb = SET(mb[j]);
+        for (i1 = 0; i1 < m; i1 += 4)
+            *(_J++) = ADD(ADD(MUL(*(_R++), _mr), MUL(*(_G++), _mg)),
+                    MUL(*(_B++), _mb));
+    }
+    { // compute XZY -> LUV (without doing L lookup/normalization)
+        __m128 _c15, _c3, _cEps, _c52, _c117, _c1024, _cun, _cvn;
+        _c15 = SET(15.0f);
+        _c3 = SET(3.0f);
+        _cEps = SET(1e-35f);
+        _c52 = SET(52.0f);
+        _c117 = SET(117.0f), _c1024 = SET(1024.0f);
+        _cun = SET(13 * un);
+        _cvn = SET(13 * vn);
+        __m128 *_X, *_Y, *_Z, _x, _y, _z;
+        _X = (__m128 *) J1;
+        _Y = (__m128 *) (J1 + n);
+        _Z = (__m128 *) (J1 + 2 * n);
+        for (i1 = 0; i1 < m; i1 += 4) {
+            _x = *_X;
+            _y = *_Y;
+            _z = *_Z;
+            _z = RCP(ADD(_x, ADD(_cEps, ADD(MUL(_c15, _y), MUL(_c3, _z)))));
+            *(_X++) = MUL(_c1024, _y);
+            *(_Y++) = SUB(MUL(MUL(_c52, _x), _z), _cun);
+            *(_Z++) = SUB(MUL(MUL(_c117, _y), _z), _cvn);
+        }
+    }
+    { // perform lookup for L and finalize computation of U and V
+        for (i1 = 0; i1 < m; i1++)
+            J1[i1] = lTable[(int) J1[i1]];
+        __m128 *_L, *_U, *_V, _l, _cminu, _cminv;
+        _L = (__m128 *) J1;
+        _U = (__m128 *) (J1 + n);
+        _V = (__m128 *) (J1 + 2 * n);
+        _cminu = SET(minu);
+        _cminv = SET(minv);
+        for (i1 = 0; i1 < m; i1 += 4) {
+            _l = *(_L++);
+            *(_U) = SUB(MUL(_l, *_U), _cminu);
+            _U++;
+            *(_V) = SUB(MUL(_l, *_V), _cminv);
+            _V++;
+        }
+    }
+}
+
 // Convert from rgb to luv using sse
 void rgb2luv_sse(uint8_t *I, float *J, int n, float nrm) {
     const int k = 256;
@@ -69,71 +130,75 @@ void rgb2luv_sse(uint8_t *I, float *J, int n, float nrm) {
         n1 = i + k;
         if (n1 > n)
             n1 = n;
-        float *J1 = J + i;
-        float *R1, *G1, *B1;
         // convert to floats (and load input into cache)
-        R1 = R;
-        G1 = G;
-        B1 = B;
         unsigned char *Ri = I + i, *Gi = Ri + n, *Bi = Gi + n;
         for (i1 = 0; i1 < (n1 - i); i1++) {
-            R1[i1] = (float) *Ri++;
-            G1[i1] = (float) *Gi++;
-            B1[i1] = (float) *Bi++;
-        }
-        // compute RGB -> XYZ
-        for (int j = 0; j < 3; j++) {
-            __m128 _mr, _mg, _mb, *_J = (__m128 *) (J1 + j * n);
-            __m128 *_R = (__m128 *) R1, *_G = (__m128 *) G1,
-                    *_B = (__m128 *) B1;
-            _mr = SET(mr[j]);
-            _mg = SET(mg[j]);
-            _mb = SET(mb[j]);
-            for (i1 = i; i1 < n1; i1 += 4)
-                *(_J++) = ADD(ADD(MUL(*(_R++), _mr), MUL(*(_G++), _mg)),
-                        MUL(*(_B++), _mb));
+            R[i1] = (float) *Ri++;
+            G[i1] = (float) *Gi++;
+            B[i1] = (float) *Bi++;
         }
-        { // compute XZY -> LUV (without doing L lookup/normalization)
-            __m128 _c15, _c3, _cEps, _c52, _c117, _c1024, _cun, _cvn;
-            _c15 = SET(15.0f);
-            _c3 = SET(3.0f);
-            _cEps = SET(1e-35f);
-            _c52 = SET(52.0f);
-            _c117 = SET(117.0f), _c1024 = SET(1024.0f);
-            _cun = SET(13 * un);
-            _cvn = SET(13 * vn);
-            __m128 *_X, *_Y, *_Z, _x, _y, _z;
-            _X = (__m128 *) J1;
-            _Y = (__m128 *) (J1 + n);
-            _Z = (__m128 *) (J1 + 2 * n);
-            for (i1 = i; i1 < n1; i1 += 4) {
-                _x = *_X;
-                _y = *_Y;
-                _z = *_Z;
-                _z = RCP(ADD(_x, ADD(_cEps, ADD(MUL(_c15, _y), MUL(_c3, _z)))));
-                *(_X++) = MUL(_c1024, _y);
-                *(_Y++) = SUB(MUL(MUL(_c52, _x), _z), _cun);
-                *(_Z++) = SUB(MUL(MUL(_c117, _y), _z), _cvn);
+        rgb2luv_block(R, G, B, J + i, n1 - i, n, lTable, mr, mg, mb, minu,
+                minv, un, vn);
+        i = n1;
+    }
+    free(R);
+    free(G);
+    free(B);
+}
+
+// Convert from planar yuv420 (I420, row-major, BT.601) to column-major luv
+// using sse. full_range selects full-range (JFIF, as output by the Raspberry Pi
+// camera) instead of limited-range (Y in [16,235], as produced by OpenCV and
+// most V4L2 devices) input. Chroma upsampling and the transpose are fused into
+// the load: the image is processed in strips of k columns, which are
+// contiguous in the column-major output.
+void yuv2luv_sse(const uint8_t *Y, const uint8_t *U, const uint8_t *V,
+        float *J, int w, int h, float nrm, bool full_range) {
+    const int k = 8;
+    float *R = (float *) aligned_alloc(16, k * h * sizeof(float));
+    float *G = (float *) aligned_alloc(16, k * h * sizeof(float));
+    float *B = (float *) aligned_alloc(16, k * h * sizeof(float));
+    assert(R);
+    assert(G);
+    assert(B);
+    assert(((size_t )J & 15) == 0);
+    assert(w % 2 == 0 && h % 2 == 0);
+    const int n = w * h, w2 = w / 2;
+    float minu, minv, un, vn, mr[3], mg[3], mb[3];
+    float *lTable = rgb2luv_setup(nrm, mr, mg, mb, minu, minv, un, vn);
+    const __m128 _c0 = SET(0.0f), _c255 = SET(255.0f), _c128 = SET(128.0f);
+    const __m128 _yoff = SET(full_range ? 0.0f : 16.0f),
+            _ys = SET(full_range ? 1.0f : 1.164383f);
+    const __m128 _crv = SET(full_range ? 1.402f : 1.596027f),
+            _cgu = SET(full_range ? -0.344136f : -0.391762f),
+            _cgv = SET(full_range ? -0.714136f : -0.812968f),
+            _cbu = SET(full_range ? 1.772f : 2.017232f);
+    for (int x0 = 0; x0 < w; x0 += k) {
+        const int cols = std::min(k, w - x0), m = cols * h;
+        // load the strip transposed: R, G, B temporarily hold Y, U, V
+        for (int y = 0; y < h; y++) {
+            const uint8_t *Yi = Y + y * w + x0;
+            const uint8_t *Ui = U + (y / 2) * w2 + x0 / 2;
+            const uint8_t *Vi = V + (y / 2) * w2 + x0 / 2;
+            for (int c = 0; c < cols; c++) {
+                R[c * h + y] = (float) Yi[c];
+                G[c * h + y] = (float) Ui[c / 2];
+                B[c * h + y] = (float) Vi[c / 2];
             }
         }
-        { // perform lookup for L and finalize computation of U and V
-            for (i1 = i; i1 < n1; i1++)
-                J[i1] = lTable[(int) J[i1]];
-            __m128 *_L, *_U, *_V, _l, _cminu, _cminv;
-            _L = (__m128 *) J1;
-            _U = (__m128 *) (J1 + n);
-            _V = (__m128 *) (J1 + 2 * n);
-            _cminu = SET(minu);
-            _cminv = SET(minv);
-            for (i1 = i; i1 < n1; i1 += 4) {
-                _l = *(_L++);
-                *(_U) = SUB(MUL(_l, *_U), _cminu);
-                _U++;
-                *(_V) = SUB(MUL(_l, *_V), _cminv);
-                _V++;
-            }
+        // compute YUV -> RGB in place, clamped to [0,255] for the L lookup
+        for (int i1 = 0; i1 < m; i1 += 4) {
+            __m128 _y = MUL(_ys, SUB(LD(R[i1]), _yoff));
+            __m128 _u = SUB(LD(G[i1]), _c128);
+            __m128 _v = SUB(LD(B[i1]), _c128);
+            STR(R[i1], MIN_(MAX_(ADD(_y, MUL(_crv, _v)), _c0), _c255));
+            STR(G[i1],
+                    MIN_(MAX_(ADD(_y, MUL(_cgu, _u), MUL(_cgv, _v)), _c0),
+                            _c255));
+            STR(B[i1], MIN_(MAX_(ADD(_y, MUL(_cbu, _u)), _c0), _c255));
         }
-        i = n1;
+        rgb2luv_block(R, G, B, J + x0 * h, m, n, lTable, mr, mg, mb, minu,
+                minv, un, vn);
     }
     free(R);
     free(G);
@@ -6,8 +6,12 @@
  *******************************************************************************/
 #ifndef _SSE_HPP_
 #define _SSE_HPP_
-// #include <emmintrin.h> // SSE2:<e*.h>, SSE3:<p*.h>, SSE4:<s*.h>
-#include "SSE2NEON.h" // SSE2:<e*.h>, SSE3:<p*.h>, SSE4:<s*.h>
+// x86上直接使用SSE2, ARM上由SSE2NEON.h将SSE2指令映射为NEON
+#if defined(__SSE2__)
+#include <emmintrin.h> // SSE2:<e*.h>, SSE3:<p*.h>, SSE4:<s*.h>
+#else
+#include "SSE2NEON.h"
+#endif
 
 #define RETf static inline __attribute__((always_inline)) __m128
 #define RETi static inline __attribute__((always_inline)) __m128i
@@ -86,6 +90,9 @@ RETf DEC(float &x, const __m128 y) {
 RETf MIN_(const __m128 x, const __m128 y) {
     return _mm_min_ps(x, y);
 }
+RETf MAX_(const __m128 x, const __m128 y) {
+    return _mm_max_ps(x, y);
+}
 RETf RCP(const __m128 x) {
     return _mm_rcp_ps(x);
 }
@@ -6,28 +6,36 @@
 #include <chrono>
 #include <ctime>
 #include <mutex>
+#include <vector>
+#include <algorithm>
 // c standard library
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <cstdlib>
 #include <cerrno>
+#include <csignal>
 // precompiled shared library
 #include <opencv2/opencv.hpp>
 #include <tbb/tbb_stddef.h>
 #include <tbb/tbb.h>
-#include <raspicam/raspicam.h>
 #include <matio.h>
 #include <pigpio.h>
 // this project
 #include "acf/ACFDetector.h"
+#include "server/DetectionServer.h"
 #include "general/DetectionList.h"
-#include "general/NonMaximumSuppression.h"
+#include "general/LatencyStats.h"
+#include "general/Logger.h"
+#include "general/TraceRecorder.h"
+#include "general/PerfCounters.h"
+#include "general/Metrics.h"
 
 #include "control/InfraredRemote.h"
 #include "control/Relay.h"
 #include "control/LinpRemote.h"
 #include "control/HumanInfrared.h"
+#include "control/ControlEvents.h"
 
 static const int IMAGE_WIDTH = 960;
 static const int IMAGE_HEIGHT = 720;
@@ -36,32 +44,67 @@ static const int WINDOW_WIDTH = 480;
 static const int WINDOW_HEIGHT = 320;
 
 bool no_window = false;
-int score_threshold_low = 55;
-int score_threshold_high = 70;
-int distance_threshold = 40;
-int dur_threshold_low = 3;
-int RELAY_DELAY = 5;
-int ir_threshold_light = 64;
+// 以下参数由界面线程修改, 控制线程读取
+std::atomic<int> score_threshold_low(55);
+std::atomic<int> score_threshold_high(70);
+std::atomic<int> distance_threshold(40);
+std::atomic<int> dur_threshold_low(3);
+std::atomic<int> RELAY_DELAY(5);
+std::atomic<int> ir_threshold_light(64);
 int aircdt_open_delay = 10;
 int aircdt_close_delay = 10;
-
-static bool ImageReady = false;
-static bool FakeVideoHasHuman = false;
-static bool FakeVideoNoHuman = false;
-static bool PauseFlag = false;
-static bool ExitFlag = false;
+// 细尺度(远处人体)层的最大刷新间隔(帧), 大于1时未刷新的层沿用上次的检测结果; 1表示每帧检测全部层
+int layer_refresh_period = 1;
+// 特征金字塔的尺度配置: fast, balanced, accurate
+std::string pyramid_profile = "balanced";
+int classifier_budget_ms = 0;
+// 检测器模型, 文件被替换后自动重新加载
+std::string model_path = ACF_DEFAULT_MODEL;
+bool model_hot_reload = true;
+// 记录处理流程的时间线, 收到SIGUSR1时导出最近的事件到trace_path
+bool trace_recording = false;
+std::string trace_path = "/home/pi/acf_trace.json";
+// 按阶段采样硬件性能计数器, 退出时打印IPC和每像素/每窗口的缺失次数
+bool perf_counters = false;
+// Prometheus指标服务地址, "host:port"或"unix:/path", 为空时不启动
+std::string metrics_address = "127.0.0.1:9101";
+// 采集来源: raspicam, v4l2:/dev/video0, video:/path/file.mp4, images:/path/dir
+#ifdef WITH_RASPICAM
+std::string capture_source = "raspicam";
+#else
+std::string capture_source = "v4l2:/dev/video0";
+#endif
+// 其他摄像头, 与capture_source共用检测模型和TBB线程池; 画面只显示capture_source,
+// 任一路检测到人即视为有人
+std::vector<std::string> extra_capture_sources;
+// 每路的目标检测帧率, 过载时最低降到min_detect_fps; 采集到得出结果的最大延迟(ms), 0表示不限制
+double detect_fps = 15;
+double min_detect_fps = 2;
+int max_latency_ms = 0;
+// 同时检测的流数
+int max_concurrent_streams = 2;
+// 回放视频或图片时按录制速度输出, false时全速输出(测试吞吐量); 回放结束后程序退出
+bool replay_realtime = true;
+// 检测分辨率, 采集的画面(先按detect_roi裁剪)缩放到该尺寸后送入检测器
+// 与采集分辨率相同且不裁剪时直接使用采集的数据; 宽高比应与检测区域一致, 否则人体被拉伸
+int detect_width = IMAGE_WIDTH;
+int detect_height = IMAGE_HEIGHT;
+// 检测区域(采集画面坐标), 宽高为0时检测整个画面; 区域外的像素检测器不会处理
+cv::Rect detect_roi;
+// 以YUV420(I420)格式采集, 检测器直接由YUV计算LUV, 显示时按窗口分辨率转换为BGR
+// 帧大小为RGB的一半, 省去ISP的RGB转换和金字塔中的转置/拆分通道
+bool capture_yuv = false;
+// 人体红外去抖时间(微秒), 电平保持不足该时间的跳变视为干扰
+int pir_glitch_us = PIR_GLITCH_US;
+// 不访问GPIO, 人体红外由界面按键p模拟
+bool pir_simulated = false;
+
+static std::atomic<bool> FakeVideoHasHuman(false);
+static std::atomic<bool> FakeVideoNoHuman(false);
+static std::atomic<bool> PauseFlag(false);
+static std::atomic<bool> ExitFlag(false);
 static bool BlackScreen = false;
 
-static bool CaptureThreadDone = false;
-static bool ProcessThreadDone = false;
-
-static std::mutex LastImage_Mutex;
-static std::shared_ptr<uint8_t> LastImage;
-
-static std::mutex DetectResult_Mutex;
-static std::string DetectorInfo;
-static DetectionList DetectResult;
-
 typedef enum {
     VIDEO_NO_HUMAN,     // score < 50
     VIDEO_LIKE_HUMAN,   // 50 <= score < 70
@@ -85,227 +128,67 @@ typedef enum {
 static AirConditionerState_t AirConditionerState = AIRCDT_CLOSED;
 static std::chrono::steady_clock::time_point AirConditionerStateTimer;
 
-void thread_func_capture() {
-    CaptureThreadDone = false;
-
-    // 初始化相机
-    raspicam::RaspiCam Camera;
-    Camera.setWidth(IMAGE_WIDTH);                             // 画面宽度
-    Camera.setHeight(IMAGE_HEIGHT);                                // 画面高度
-    Camera.setBrightness(60);                         // 提升20%亮度(50+10=60)
-    Camera.setContrast(10);
-    Camera.setSaturation(30);                            // 提升20%颜色饱和度(0+20%)
-    Camera.setExposure(raspicam::RASPICAM_EXPOSURE_AUTO);
-    Camera.setMetering(raspicam::RASPICAM_METERING_MATRIX);
-//    Camera.setShutterSpeed(330000);
-    Camera.setFrameRate(15);                          // FPS: 15
-    Camera.setAWB(raspicam::RASPICAM_AWB_FLUORESCENT);
-    Camera.setFormat(raspicam::RASPICAM_FORMAT_RGB);
-
-    std::cout << "Camera opening..." << std::flush;
-    if (!Camera.open()) {
-        std::cout << "Fail" << std::endl;
-        ExitFlag = true;
-    } else {
-        std::cout << "OK" << std::endl;
+// 状态机一次决策所依据的画面, 时间均为steady_clock纳秒(LatencyHistogram::now_ns)
+struct DecisionStamp {
+    int64_t grab_ns = 0;        // 帧的采集时间, 0表示决策由计时或人体红外触发, 不对应画面
+    int64_t decision_ns = 0;    // 状态机读取检测结果的时间
+};
+
+// 执行器动作完成后调用, 记录决策到执行以及采集到执行的延迟; actuator为relay, linp或ir
+static void recordActuation(const std::string &actuator,
+        const DecisionStamp &stamp) {
+    int64_t now_ns = LatencyHistogram::now_ns();
+    LatencyStats::get("latency.decision_to_" + actuator).record(
+            now_ns - stamp.decision_ns);
+    if (stamp.grab_ns > 0) {
+        LatencyStats::get("latency.glass_to_" + actuator).record(
+                now_ns - stamp.grab_ns);
     }
-
-    for (; !ExitFlag;) {
-        // 获取图像并保存在缓冲区中
-        if (Camera.grab()) {
-            uint8_t *RawData = (uint8_t *) aligned_alloc(16,
-                    Camera.getImageBufferSize());
-            Camera.retrieve(RawData);
-
-            LastImage_Mutex.lock();
-            LastImage = std::shared_ptr<uint8_t>(RawData, free);
-            LastImage_Mutex.unlock();
-
-            ImageReady = true;
-        }
-
-        std::this_thread::yield();
-    }
-
-    Camera.release();
-    CaptureThreadDone = true;
 }
 
-void thread_func_process() {
-    ProcessThreadDone = false;
-
-    try {
-        // 初始化ACF检测器
-        DetectResult_Mutex.lock();
-        DetectorInfo = "Loading detector model...";
-        DetectResult_Mutex.unlock();
-        ACFDetector acf_detector("/home/pi/AcfHSMy18Detector.mat");
-
-        for (; !ExitFlag;) {
-            // 等待图像就绪
-            if (!ImageReady) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                std::this_thread::yield();
-                continue;
-            }
-
-            // 读取图像
-            LastImage_Mutex.lock();
-            std::shared_ptr<uint8_t> raw_data = LastImage;
-            LastImage_Mutex.unlock();
-
-            DetectionList dets, nms_dets;
-            // 计算并显示耗时
-            auto measure_time = std::chrono::steady_clock::now();
-
-            // ACF目标检测
-            dets = acf_detector.applyDetector(
-                    cv::Mat(IMAGE_HEIGHT, IMAGE_WIDTH, CV_8UC3, raw_data.get()));
-            // 非极大值抑制
-            nms_dets = NonMaximumSuppression::dollarNMS(dets);
-
-            int ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-                    std::chrono::steady_clock::now() - measure_time).count();
-
-            std::stringstream info;
-            info << IMAGE_WIDTH << "x" << IMAGE_HEIGHT << " ";
-            info << "ftr:" << std::setw(2) << acf_detector.calc_feature_ms << "ms ";
-            info << "clf:" << std::setw(3) << acf_detector.apply_classifier_ms
-                    << "ms ";
-            info << "total:" << std::setw(3) << ms << "ms ";
-            info << "nDet:" << std::setw(2) << dets.getSize() << " ";
-            info << "nHS:" << nms_dets.getSize();
-
-            DetectResult_Mutex.lock();
-            DetectorInfo = info.str();
-            DetectResult = nms_dets;
-            DetectResult_Mutex.unlock();
-
-            std::this_thread::yield();
+// 领普无线开关命令放入发送队列后立即返回, 写入串口后记录执行延迟
+static void switchLinp(LinpRemote &linp_remote, bool state,
+        const DecisionStamp &stamp) {
+    linp_remote.set_switch(0x80003c32, state, [stamp](const LinpReply &reply) {
+        if (reply.status == LINP_OK) {
+            recordActuation("linp", stamp);
         }
-    } catch (const std::exception& err) {
-        std::cout << "thread_func_process exit with exception: " << err.what() << std::endl;
-    }
-
-    ProcessThreadDone = true;
+    });
 }
 
-static void onMouseScreen(int event, int x, int y, int, void*) {
-    if (event == cv::EVENT_LBUTTONDOWN) {
-        if (y < WINDOW_HEIGHT - STATUSBAR_HEIGHT) {
-            // 点击屏幕中央 暂停
-//            PauseFlag = !PauseFlag;
-            if (x >= 0 && x < 50) {
-                if (y >= 50 && y < 70) {
-                    // 延时
-                    if (x < 25) {
-                        RELAY_DELAY += 1;
-                    } else {
-                        RELAY_DELAY -= 1;
-                    }
-                } else if (y >= 70 && y < 90) {
-                    // 距离
-                    if (x < 25) {
-                        distance_threshold += 1;
-                    } else {
-                        distance_threshold -= 1;
-                    }
-                } else if (y >= 90 && y < 110) {
-                    // 阈值高
-                    if (x < 25) {
-                        score_threshold_high += 1;
-                    } else {
-                        score_threshold_high -= 1;
-                    }
-                } else if (y >= 110 && y < 130) {
-                    // 阈值低
-                    if (x < 25) {
-                        score_threshold_low += 1;
-                    } else {
-                        score_threshold_low -= 1;
-                    }
-                } else if (y >= 130 && y < 150) {
-                    // 低阈值持续
-                    if (x < 25) {
-                        dur_threshold_low += 1;
-                    } else {
-                        dur_threshold_low -= 1;
-                    }
-                } else if (y >= 150 && y < 170) {
-                    // 低阈值持续
-                    if (x < 25) {
-                        ir_threshold_light += 1;
-                    } else {
-                        ir_threshold_light -= 1;
-                    }
-                }
-            } else if (x >= WINDOW_WIDTH - 15 && y <= 15) {
-                // 切换黑屏模式
-                BlackScreen = !BlackScreen;
-            }
-
-        } else {
-            // 点击屏幕底部 退出
-            PauseFlag = false;
-            ExitFlag = true;
-        }
-    }
+// 控制线程发布给界面的状态
+struct ControlSnapshot {
+    VideoState_t video_state = VIDEO_NO_HUMAN;
+    LightState_t light_state = STATE_NO_HUMAN;
+    AirConditionerState_t aircdt_state = AIRCDT_CLOSED;
+    bool pir = false;
+    int brightness = 0;
+    // 第一路流按尺寸过滤后的检测结果(采集画面坐标)和检测器状态信息
+    DetectionList result;
+    std::string info;
+    // 最近一次判定有人的时间, 用于状态栏的关灯倒计时
+    std::chrono::steady_clock::time_point last_human;
+};
+
+static ControlEventQueue ControlEvents;
+static StatePublisher<ControlSnapshot> ControlState;
+
+static void postControlEvent(ControlEventType type, int stream = 0,
+        bool level = false) {
+    ControlEvent event;
+    event.type = type;
+    event.stream = stream;
+    event.level = level;
+    event.time_ns = LatencyHistogram::now_ns();
+    ControlEvents.post(event);
 }
 
-int main(int argc, char **argv) {
-
-    int major, minor, release;
-    Mat_GetLibraryVersion(&major, &minor, &release);
-    std::cout << "matio version: " << major << '.' << minor << '.' << release
-            << std::endl;
-
-    std::cout << "tbb version: " << TBB_VERSION_MAJOR << '.'
-            << TBB_VERSION_MINOR << std::endl;
-
-    std::cout << "opencv version: " << CV_VERSION << std::endl;
-
-    std::cout << "pigpio version: " << gpioVersion() << std::endl;
-    std::cout << "pigpio hardware revision: " << gpioHardwareRevision()
-            << std::endl;
-
-    // 初始化采样线程
-    std::cout << "Start capturing..." << std::flush;
-    std::thread capture_thread(thread_func_capture);
-    std::cout << "OK" << std::endl;
-
-    // 初始化识别线程
-    std::cout << "Start processing..." << std::flush;
-    std::thread process_thread(thread_func_process);
-    std::cout << "OK" << std::endl;
+// 灯光和空调控制: 处理检测结果, 人体红外和界面参数事件, 计时到期时检查延时开关
+void thread_func_control(DetectionServer &server, LinpRemote &linp_remote,
+        HumanInfrared &ir_human, InfraredRemote &ir_remote, Relay &relay) {
+    TraceRecorder::setThreadName("control");
 
     try {
-        int ret = gpioInitialise();
-        if (ret < 0) {
-            throw std::runtime_error(
-                    std::string("PiGPIO init failed with code ")
-                            + std::to_string(ret));
-        }
-
-        // 初始化领普无线远程控制
-        LinpRemote linp_remote;
-        std::cout << "linp ping..." << std::flush;
-        if (linp_remote.ping(1000) == 0) {
-            std::cout << "OK" << std::endl;
-            std::string linp_remote_ver;
-            std::cout << "linp receiver version: " << std::flush;
-            linp_remote.read_fw_ver(linp_remote_ver);
-            std::cout << linp_remote_ver << std::endl;
-            linp_remote.set_switch(0x80003c32, false);
-        } else {
-            std::cout << "Failed" << std::endl;
-        }
-
-        // 初始化人体红外热释电
-        HumanInfrared ir_human(22, true);
-
-        // 初始化红外控制
-        InfraredRemote ir_remote(27, true);
-
         // 初始化继电器控制逻辑
         bool is_relay_on = false;
         auto last_human = std::chrono::steady_clock::now()
@@ -314,54 +197,101 @@ int main(int argc, char **argv) {
                 - std::chrono::seconds(RELAY_DELAY);
         auto last_like_human = std::chrono::steady_clock::now()
                 - std::chrono::seconds(RELAY_DELAY);
-        Relay relay;
-
-        // 初始化窗口
-        const char WindowImage[] = "人体检测";
-        if (!no_window) {
-            std::cout << "Creating window..." << std::flush;
-            cv::namedWindow(WindowImage, cv::WINDOW_AUTOSIZE);
-            cv::moveWindow(WindowImage, -2, -30);
-            cv::setMouseCallback(WindowImage, onMouseScreen, NULL);
-            std::cout << "OK" << std::endl;
-        }
 
-        uint8_t *raw_data = NULL;
+        // 运行指标, 由MetricsServer线程导出, 本线程只做原子更新
+        const std::string relay_help = "Relay switch actions";
+        MetricCounter &relay_actions_on = Metrics::counter(
+                "acf_relay_actions_total", relay_help, "state=\"on\"");
+        MetricCounter &relay_actions_off = Metrics::counter(
+                "acf_relay_actions_total", relay_help, "state=\"off\"");
+        const std::string linp_help = "Linp remote switch commands";
+        MetricCounter &linp_actions_on = Metrics::counter(
+                "acf_linp_actions_total", linp_help, "state=\"on\"");
+        MetricCounter &linp_actions_off = Metrics::counter(
+                "acf_linp_actions_total", linp_help, "state=\"off\"");
+        const std::string ir_help = "Air conditioner IR remote commands";
+        MetricCounter &ir_actions_on = Metrics::counter(
+                "acf_ir_actions_total", ir_help, "power=\"on\"");
+        MetricCounter &ir_actions_off = Metrics::counter(
+                "acf_ir_actions_total", ir_help, "power=\"off\"");
+        const std::string transitions_help = "State machine transitions";
+        MetricCounter &video_transitions = Metrics::counter(
+                "acf_state_transitions_total", transitions_help,
+                "machine=\"video\"");
+        MetricCounter &light_transitions = Metrics::counter(
+                "acf_state_transitions_total", transitions_help,
+                "machine=\"light\"");
+        MetricCounter &aircdt_transitions = Metrics::counter(
+                "acf_state_transitions_total", transitions_help,
+                "machine=\"aircdt\"");
+        MetricGauge &video_state_gauge = Metrics::gauge("acf_video_state",
+                "Video state (0 no human, 1 like human, 2 has human)");
+        MetricGauge &light_state_gauge = Metrics::gauge("acf_light_state",
+                "Light state (0 no human, 1 check human, 2 has human)");
+        MetricGauge &aircdt_state_gauge = Metrics::gauge("acf_aircdt_state",
+                "Air conditioner state (0 closed, 1 delay open, 2 opened, 3 delay close)");
+        MetricGauge &pir_gauge = Metrics::gauge("acf_pir",
+                "Human infrared sensor output");
+        MetricGauge &brightness_gauge = Metrics::gauge("acf_brightness",
+                "Mean image brightness");
+        VideoState_t last_video_state = VideoState;
+        LightState_t last_light_state = LightState;
+        AirConditionerState_t last_aircdt_state = AirConditionerState;
+
+        // 各流已交给状态机的最新结果(帧序号), 每个结果只统计一次检测到决策的延迟
+        std::vector<uint64_t> decided_seq(server.getStreamCount(), 0);
+        LatencyHistogram &detect_to_decision_hist = LatencyStats::get(
+                "latency.detect_to_decision");
+        LatencyHistogram &event_hist = LatencyStats::get("control.event");
+        // 人体红外跳变(pigpio记录的时间)到控制线程处理的延迟
+        LatencyHistogram &pir_hist = LatencyStats::get("latency.pir_to_control");
+
+        bool pir = ir_human.get();
         std::string last_info;
-        cv::Mat source;
+        auto deadline = std::chrono::steady_clock::now();
         for (; !ExitFlag;) {
-            // 固定窗口位置
-            if (!no_window) {
-                cv::moveWindow(WindowImage, -2, -30);
+            // 等待事件, 到期时间内没有事件时检查延时开关
+            ControlEvent event;
+            if (!ControlEvents.waitUntil(deadline, event)) {
+                event.type = EVENT_TIMER;
+            }
+            if (event.type == EVENT_EXIT) {
+                break;
+            } else if (event.type == EVENT_PIR) {
+                pir = event.level;
+                pir_hist.record(LatencyHistogram::now_ns() - event.time_ns);
             }
+            // 没有空闲事件时至少每秒检查一次
+            deadline = std::chrono::steady_clock::now()
+                    + std::chrono::seconds(1);
 
-            // 等待图像就绪
-            if (!ImageReady) {
-                if (!no_window) {
-                    cv::waitKey(100);
-                } else {
-                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                }
+            // 图像就绪前不做判断
+            std::shared_ptr<CapturedFrame> frame = server.latestFrame(0);
+            if (!frame) {
                 continue;
             }
-
-            // 获取图像
-            LastImage_Mutex.lock();
-            std::shared_ptr<uint8_t> raw_data = LastImage;
-            LastImage_Mutex.unlock();
-
-            source = cv::Mat(IMAGE_HEIGHT, IMAGE_WIDTH, CV_8UC3,
-                    raw_data.get());
+            ScopedLatency event_timer(event_hist);
+            TraceScope trace_event("control.event");
 
             // 计算图像整体亮度
-            cv::Scalar avg = cv::mean(source);
+            cv::Scalar avg = cv::mean(frame->display);
             int brightness = (avg.val[0] + avg.val[1] + avg.val[2]) / 3;
 
             // 获取结果
-            DetectResult_Mutex.lock();
-            std::string info = DetectorInfo;
-            DetectionList result = DetectResult;
-            DetectResult_Mutex.unlock();
+            std::vector<StreamResult> stream_results;
+            for (size_t i = 0; i < server.getStreamCount(); i++) {
+                stream_results.push_back(server.latestResult(i));
+            }
+            int64_t decision_ns = LatencyHistogram::now_ns();
+            for (size_t i = 0; i < stream_results.size(); i++) {
+                const StreamResult &r = stream_results[i];
+                if (r.frame && r.frame->seq != decided_seq[i]) {
+                    detect_to_decision_hist.record(decision_ns - r.detected_ns);
+                    decided_seq[i] = r.frame->seq;
+                }
+            }
+            std::string info = stream_results[0].info;
+            DetectionList result = stream_results[0].detections;
 
             // 打印状态信息
 //            if (info != last_info && !info.empty()) {
@@ -370,11 +300,28 @@ int main(int argc, char **argv) {
 //            }
 
             // 根据尺寸过滤结果
-            result = result.filterSize(source.cols / (float) distance_threshold,
-                    source.cols / (float) distance_threshold);
+            result = result.filterSize(IMAGE_WIDTH / (float) distance_threshold,
+                    IMAGE_WIDTH / (float) distance_threshold);
 
-            // 计算最高得分
+            // 计算最高得分, 包括其他摄像头的结果; 决策依据得分最高的画面
             float max_score = result.maxScore();
+            DecisionStamp stamp;
+            stamp.decision_ns = decision_ns;
+            if (stream_results[0].frame) {
+                stamp.grab_ns = stream_results[0].frame->grab_ns;
+            }
+            for (size_t i = 1; i < stream_results.size(); i++) {
+                DetectionList other = stream_results[i].detections.filterSize(
+                        IMAGE_WIDTH / (float) distance_threshold,
+                        IMAGE_WIDTH / (float) distance_threshold);
+                if (other.getSize() > 0 && other.maxScore() > max_score) {
+                    max_score = other.maxScore();
+                    stamp.grab_ns = stream_results[i].frame->grab_ns;
+                }
+            }
+            // 由计时或人体红外触发的动作
+            DecisionStamp timer_stamp;
+            timer_stamp.decision_ns = decision_ns;
 
             switch (VideoState) {
             case VIDEO_NO_HUMAN:
@@ -425,40 +372,52 @@ int main(int argc, char **argv) {
                     LightState = STATE_HAS_HUMAN;
                     // turn on relay
                     relay.set(true);
+                    relay_actions_on.inc();
+                    recordActuation("relay", stamp);
                     // turn on Linp remote relay
-                    linp_remote.set_switch(0x80003c32, true);
-                    std::cout << "Light ON" << std::endl;
-                } else if (ir_human.get() && brightness < ir_threshold_light) {
+                    switchLinp(linp_remote, true, stamp);
+                    linp_actions_on.inc();
+                    ACF_LOG(Info) << "Light ON";
+                } else if (pir && brightness < ir_threshold_light) {
                     LightState = STATE_CHECK_HUMAN;
                     // turn on relay
                     relay.set(true);
+                    relay_actions_on.inc();
+                    recordActuation("relay", timer_stamp);
                     // turn on Linp remote relay
-                    linp_remote.set_switch(0x80003c32, true);
-                    std::cout << "Light ON" << std::endl;
+                    switchLinp(linp_remote, true, timer_stamp);
+                    linp_actions_on.inc();
+                    ACF_LOG(Info) << "Light ON";
                 }
                 break;
             case STATE_CHECK_HUMAN:
                 if (VideoState == VIDEO_HAS_HUMAN) {
                     LightState = STATE_HAS_HUMAN;
-                    std::cout << "Light ON" << std::endl;
-                } else if (!ir_human.get()) {
+                    ACF_LOG(Info) << "Light ON";
+                } else if (!pir) {
                     LightState = STATE_NO_HUMAN;
                     // turn off relay
                     relay.set(false);
+                    relay_actions_off.inc();
+                    recordActuation("relay", timer_stamp);
                     // turn off Linp remote relay
-                    linp_remote.set_switch(0x80003c32, false);
-                    std::cout << "Light OFF" << std::endl;
+                    switchLinp(linp_remote, false, timer_stamp);
+                    linp_actions_off.inc();
+                    ACF_LOG(Info) << "Light OFF";
                 }
                 break;
             case STATE_HAS_HUMAN:
                 if (dur_no_human > std::chrono::seconds(RELAY_DELAY)
-                        && !ir_human.get()) {
+                        && !pir) {
                     LightState = STATE_NO_HUMAN;
                     // turn off relay
                     relay.set(false);
+                    relay_actions_off.inc();
+                    recordActuation("relay", timer_stamp);
                     // turn off Linp remote relay
-                    linp_remote.set_switch(0x80003c32, false);
-                    std::cout << "Light OFF" << std::endl;
+                    switchLinp(linp_remote, false, timer_stamp);
+                    linp_actions_off.inc();
+                    ACF_LOG(Info) << "Light OFF";
                 }
                 break;
             }
@@ -469,42 +428,44 @@ int main(int argc, char **argv) {
                 if (LightState == STATE_HAS_HUMAN) {
                     AirConditionerStateTimer = std::chrono::steady_clock::now();
                     AirConditionerState = AIRCDT_DELAY_OPEN;
-                    std::cout << "[AIRCDT_DELAY_OPEN]" << std::endl;
+                    ACF_LOG(Info) << "[AIRCDT_DELAY_OPEN]";
                 }
                 break;
             case AIRCDT_DELAY_OPEN:
                 if (LightState != STATE_HAS_HUMAN) {
                     AirConditionerState = AIRCDT_CLOSED;
-                    std::cout << "[AIRCDT_CLOSED]" << std::endl;
+                    ACF_LOG(Info) << "[AIRCDT_CLOSED]";
                 } else if (std::chrono::steady_clock::now()
                         - AirConditionerStateTimer
                         > std::chrono::seconds(aircdt_open_delay)) {
                     AirConditionerState = AIRCDT_OPENED;
-                    std::cout << "[AIRCDT_OPENED] Air conditioner ON"
-                            << std::endl;
+                    ACF_LOG(Info) << "[AIRCDT_OPENED] Air conditioner ON";
                     ir_remote.set_power(ir_remote.POWER_ON);
                     ir_remote.send();
+                    ir_actions_on.inc();
+                    recordActuation("ir", timer_stamp);
                 }
                 break;
             case AIRCDT_OPENED:
                 if (LightState != STATE_HAS_HUMAN) {
                     AirConditionerStateTimer = std::chrono::steady_clock::now();
                     AirConditionerState = AIRCDT_DELAY_CLOSE;
-                    std::cout << "[AIRCDT_DELAY_CLOSE]" << std::endl;
+                    ACF_LOG(Info) << "[AIRCDT_DELAY_CLOSE]";
                 }
                 break;
             case AIRCDT_DELAY_CLOSE:
                 if (LightState == STATE_HAS_HUMAN) {
                     AirConditionerState = AIRCDT_OPENED;
-                    std::cout << "[AIRCDT_OPENED]" << std::endl;
+                    ACF_LOG(Info) << "[AIRCDT_OPENED]";
                 } else if (std::chrono::steady_clock::now()
                         - AirConditionerStateTimer
                         > std::chrono::seconds(aircdt_close_delay)) {
                     AirConditionerState = AIRCDT_CLOSED;
-                    std::cout << "[AIRCDT_CLOSED] Air conditioner OFF"
-                            << std::endl;
+                    ACF_LOG(Info) << "[AIRCDT_CLOSED] Air conditioner OFF";
                     ir_remote.set_power(ir_remote.POWER_OFF);
                     ir_remote.send();
+                    ir_actions_off.inc();
+                    recordActuation("ir", timer_stamp);
                 }
                 break;
             }
@@ -519,155 +480,459 @@ int main(int argc, char **argv) {
 //                std::cout << "Relay off" << std::endl;
 //            }
 
-            // 显示画面
-            if (!no_window) {
-                // 绘制界面
-                cv::Mat show = cv::Mat(IMAGE_HEIGHT + 20, IMAGE_WIDTH, CV_8UC3);
-                cv::resize(source, show, cv::Size(WINDOW_WIDTH, WINDOW_HEIGHT));
-
-                // 绘制画面亮度
-                cv::putText(show, std::to_string(brightness),
-                        cv::Point(WINDOW_WIDTH - 200, 50), 1, 2,
-                        cv::Scalar(128, 255, 128), 2);
-
-                // 绘制红外热释电状态
-                if (ir_human.get()) {
-                    cv::circle(show, cv::Point(30, 30), 15,
-                            cv::Scalar(128, 128, 255),
-                            CV_FILLED);
-                }
+            // 更新状态指标
+            if (VideoState != last_video_state) {
+                video_transitions.inc();
+                last_video_state = VideoState;
+            }
+            if (LightState != last_light_state) {
+                light_transitions.inc();
+                last_light_state = LightState;
+            }
+            if (AirConditionerState != last_aircdt_state) {
+                aircdt_transitions.inc();
+                last_aircdt_state = AirConditionerState;
+            }
+            video_state_gauge.set(VideoState);
+            light_state_gauge.set(LightState);
+            aircdt_state_gauge.set(AirConditionerState);
+            pir_gauge.set(pir);
+            brightness_gauge.set(brightness);
+
+            // 发布状态, 界面线程据此绘制
+            ControlSnapshot state;
+            state.video_state = VideoState;
+            state.light_state = LightState;
+            state.aircdt_state = AirConditionerState;
+            state.pir = pir;
+            state.brightness = brightness;
+            state.result = result;
+            state.info = info;
+            state.last_human = last_human;
+            ControlState.publish(state);
+
+            // 下一次需要检查的时间: 低阈值持续, 无人关灯和空调延时, 均在超过设定时间后触发
+            auto margin = std::chrono::milliseconds(1);
+            if (VideoState == VIDEO_LIKE_HUMAN) {
+                deadline = std::min(deadline,
+                        last_like_human + std::chrono::seconds(dur_threshold_low)
+                                + margin);
+            }
+            if (LightState == STATE_HAS_HUMAN) {
+                deadline = std::min(deadline,
+                        last_human + std::chrono::seconds(RELAY_DELAY) + margin);
+            }
+            if (AirConditionerState == AIRCDT_DELAY_OPEN) {
+                deadline = std::min(deadline,
+                        AirConditionerStateTimer
+                                + std::chrono::seconds(aircdt_open_delay)
+                                + margin);
+            } else if (AirConditionerState == AIRCDT_DELAY_CLOSE) {
+                deadline = std::min(deadline,
+                        AirConditionerStateTimer
+                                + std::chrono::seconds(aircdt_close_delay)
+                                + margin);
+            }
+        }
+    } catch (const std::exception &err) {
+        ACF_LOG(Error) << "thread_func_control exit with exception: "
+                << err.what();
+        ExitFlag = true;
+    }
+}
 
-                // 绘制参数栏
-                cv::putText(show, "[+] [-] tout=" + std::to_string(RELAY_DELAY),
-                        cv::Point(0, 70), 1, 1, cv::Scalar(255, 64, 255), 1);
-                cv::putText(show,
-                        "[+] [-] dist=" + std::to_string(distance_threshold),
-                        cv::Point(0, 90), 1, 1, cv::Scalar(255, 64, 255), 1);
-                cv::putText(show,
-                        "[+] [-] thrH=" + std::to_string(score_threshold_high),
-                        cv::Point(0, 110), 1, 1, cv::Scalar(255, 64, 255), 1);
-                cv::putText(show,
-                        "[+] [-] thrL=" + std::to_string(score_threshold_low),
-                        cv::Point(0, 130), 1, 1, cv::Scalar(255, 64, 255), 1);
-                cv::putText(show,
-                        "[+] [-] delay=" + std::to_string(dur_threshold_low),
-                        cv::Point(0, 150), 1, 1, cv::Scalar(255, 64, 255), 1);
-                cv::putText(show,
-                        "[+] [-] thrIR=" + std::to_string(ir_threshold_light),
-                        cv::Point(0, 170), 1, 1, cv::Scalar(255, 64, 255), 1);
-
-                // 绘制头肩检测情况指示灯
-                if (VideoState == VIDEO_HAS_HUMAN) {
-                    cv::circle(show, cv::Point(80, 30), 15,
-                            cv::Scalar(128, 255, 128),
-                            CV_FILLED);
-                } else if (VideoState == VIDEO_LIKE_HUMAN) {
-                    cv::circle(show, cv::Point(80, 30), 15,
-                            cv::Scalar(128, 255, 255),
-                            CV_FILLED);
+static void onMouseScreen(int event, int x, int y, int, void*) {
+    if (event == cv::EVENT_LBUTTONDOWN) {
+        if (y < WINDOW_HEIGHT - STATUSBAR_HEIGHT) {
+            // 点击屏幕中央 暂停
+//            PauseFlag = !PauseFlag;
+            if (x >= 0 && x < 50) {
+                if (y >= 50 && y < 70) {
+                    // 延时
+                    if (x < 25) {
+                        RELAY_DELAY += 1;
+                    } else {
+                        RELAY_DELAY -= 1;
+                    }
+                } else if (y >= 70 && y < 90) {
+                    // 距离
+                    if (x < 25) {
+                        distance_threshold += 1;
+                    } else {
+                        distance_threshold -= 1;
+                    }
+                } else if (y >= 90 && y < 110) {
+                    // 阈值高
+                    if (x < 25) {
+                        score_threshold_high += 1;
+                    } else {
+                        score_threshold_high -= 1;
+                    }
+                } else if (y >= 110 && y < 130) {
+                    // 阈值低
+                    if (x < 25) {
+                        score_threshold_low += 1;
+                    } else {
+                        score_threshold_low -= 1;
+                    }
+                } else if (y >= 130 && y < 150) {
+                    // 低阈值持续
+                    if (x < 25) {
+                        dur_threshold_low += 1;
+                    } else {
+                        dur_threshold_low -= 1;
+                    }
+                } else if (y >= 150 && y < 170) {
+                    // 低阈值持续
+                    if (x < 25) {
+                        ir_threshold_light += 1;
+                    } else {
+                        ir_threshold_light -= 1;
+                    }
                 }
+                // 参数修改后立即重新判断
+                postControlEvent(EVENT_SETTINGS);
+            } else if (x >= WINDOW_WIDTH - 15 && y <= 15) {
+                // 切换黑屏模式
+                BlackScreen = !BlackScreen;
+            }
 
-                // 绘制人数
-                result.resizeDetections(WINDOW_WIDTH / (float) source.cols,
-                        WINDOW_HEIGHT / (float) source.rows);
-                int count_good = result.Draw(show, 130);
-                if (count_good) {
-                    std::stringstream num;
-                    num << count_good;
-                    cv::putText(show, num.str(),
-                            cv::Point(WINDOW_WIDTH - 50, 50), 1, 3,
-                            cv::Scalar(128, 255, 128), 3);
-                }
+        } else {
+            // 点击屏幕底部 退出
+            PauseFlag = false;
+            ExitFlag = true;
+        }
+    }
+}
+int main(int argc, char **argv) {
 
-                // 绘制状态栏
-                cv::Mat statusBar(cv::Size(WINDOW_WIDTH, STATUSBAR_HEIGHT),
-                        CV_8UC3, cv::Scalar(255, 255, 255));
-                if (LightState == STATE_HAS_HUMAN) {
-                    cv::rectangle(statusBar, cv::Point(0, 0),
-                            cv::Point(
-                                    static_cast<int>(WINDOW_WIDTH
-                                            - WINDOW_WIDTH * dur_no_human
-                                                    / std::chrono::seconds(
-                                                            RELAY_DELAY)),
-                                    STATUSBAR_HEIGHT),
-                            cv::Scalar(128, 255, 128),
-                            CV_FILLED);
-                }
-                cv::putText(statusBar, info, cv::Point(0, statusBar.rows - 5),
-                        1, 1, cv::Scalar(0, 0, 0));
-                statusBar.copyTo(
-                        show(
-                                cv::Rect(0, show.rows - statusBar.rows,
-                                        statusBar.cols, statusBar.rows)));
-
-                // 黑屏模式
-                if (BlackScreen) {
-                    show.setTo(cv::Scalar(0, 0, 0));
+    int major, minor, release;
+    Mat_GetLibraryVersion(&major, &minor, &release);
+    std::cout << "matio version: " << major << '.' << minor << '.' << release
+            << std::endl;
+
+    std::cout << "tbb version: " << TBB_VERSION_MAJOR << '.'
+            << TBB_VERSION_MINOR << std::endl;
+
+    std::cout << "opencv version: " << CV_VERSION << std::endl;
+
+    std::cout << "pigpio version: " << gpioVersion() << std::endl;
+    std::cout << "pigpio hardware revision: " << gpioHardwareRevision()
+            << std::endl;
+
+    // 初始化检测服务: 每路摄像头一个采集线程, 检测由共用TBB线程池的调度线程完成
+    DetectionServer server(model_path);
+    server.pyramid_options = PyramidOptions::fromProfile(pyramid_profile);
+    server.max_refresh_period = layer_refresh_period;
+    server.classifier_budget_ms = classifier_budget_ms;
+    server.model_hot_reload = model_hot_reload;
+    server.perf_counters = perf_counters;
+    server.max_concurrent = max_concurrent_streams;
+
+    StreamOptions stream_options;
+    stream_options.source = capture_source;
+    stream_options.capture.size = cv::Size(IMAGE_WIDTH, IMAGE_HEIGHT);
+    stream_options.capture.format = capture_yuv ? FRAME_I420 : FRAME_BGR;
+    stream_options.capture.fps = 15;
+    stream_options.capture.realtime = replay_realtime;
+    stream_options.detect_size = cv::Size(detect_width, detect_height);
+    stream_options.detect_roi = detect_roi;
+    stream_options.target_fps = detect_fps;
+    stream_options.min_fps = min_detect_fps;
+    stream_options.max_latency_ms = max_latency_ms;
+    stream_options.display_size = cv::Size(WINDOW_WIDTH, WINDOW_HEIGHT);
+    server.addStream(stream_options);
+    // 其他摄像头不显示, 也不计算亮度
+    stream_options.display_size = cv::Size();
+    for (const std::string &source : extra_capture_sources) {
+        stream_options.source = source;
+        server.addStream(stream_options);
+    }
+
+    // 检测结果更新后通知控制线程
+    server.on_result = [](int stream) {
+        postControlEvent(EVENT_DETECTION, stream);
+    };
+
+    std::cout << "Start detection server..." << std::flush;
+    bool server_started = server.start();
+    if (server_started) {
+        std::cout << "OK" << std::endl;
+    } else {
+        std::cout << "Fail" << std::endl;
+        ExitFlag = true;
+    }
+
+    try {
+        int ret = gpioInitialise();
+        if (ret < 0) {
+            throw std::runtime_error(
+                    std::string("PiGPIO init failed with code ")
+                            + std::to_string(ret));
+        }
+
+        // pigpio接管了全部信号, 需通过pigpio注册时间线导出信号
+        TraceRecorder::setEnabled(trace_recording);
+        if (trace_recording) {
+            gpioSetSignalFunc(SIGUSR1, TraceRecorder::onSignal);
+        }
+
+        // 初始化领普无线远程控制
+        LinpRemote linp_remote;
+        std::cout << "linp ping..." << std::flush;
+        if (linp_remote.ping(1000) == 0) {
+            std::cout << "OK" << std::endl;
+            std::string linp_remote_ver;
+            std::cout << "linp receiver version: " << std::flush;
+            if (linp_remote.read_fw_ver(linp_remote_ver) == 0) {
+                std::cout << linp_remote_ver << std::endl;
+            } else {
+                std::cout << "unknown" << std::endl;
+            }
+            linp_remote.set_switch(0x80003c32, false);
+        } else {
+            std::cout << "Failed" << std::endl;
+        }
+
+        // 初始化人体红外热释电
+        HumanInfrared *ir_human;
+        SimulatedHumanInfrared *ir_human_sim = NULL;
+        if (pir_simulated) {
+            ir_human_sim = new SimulatedHumanInfrared();
+            ir_human = ir_human_sim;
+        } else {
+            ir_human = new HumanInfrared(22, true, pir_glitch_us);
+        }
+        // 电平变化时由pigpio回调线程投递事件, 时间取跳变时刻
+        ir_human->setCallback([](bool active, int64_t time_ns) {
+            ControlEvent event;
+            event.type = EVENT_PIR;
+            event.level = active;
+            event.time_ns = time_ns;
+            ControlEvents.post(event);
+        });
+
+        // 初始化红外控制
+        InfraredRemote ir_remote(27, true);
+
+        Relay relay;
+
+        // 运行指标, 由MetricsServer线程导出, 本线程只做原子更新
+        std::unique_ptr<MetricsServer> metrics_server;
+        if (!metrics_address.empty()) {
+            metrics_server.reset(new MetricsServer(metrics_address));
+        }
+        // 初始化窗口
+        const char WindowImage[] = "人体检测";
+        if (!no_window) {
+            std::cout << "Creating window..." << std::flush;
+            cv::namedWindow(WindowImage, cv::WINDOW_AUTOSIZE);
+            cv::moveWindow(WindowImage, -2, -30);
+            cv::setMouseCallback(WindowImage, onMouseScreen, NULL);
+            std::cout << "OK" << std::endl;
+        }
+
+        // 控制线程, 界面只读取其发布的状态
+        std::thread control_thread(thread_func_control, std::ref(server),
+                std::ref(linp_remote), std::ref(*ir_human), std::ref(ir_remote),
+                std::ref(relay));
+
+        try {
+            uint64_t state_version = 0;
+            for (; !ExitFlag;) {
+                // 固定窗口位置
+                if (!no_window) {
+                    cv::moveWindow(WindowImage, -2, -30);
                 }
 
-                // 绘制黑屏按钮
-                cv::rectangle(show,
-                        cv::Rect(cv::Point(WINDOW_WIDTH - 15, 0),
-                                cv::Size(15, 15)), cv::Scalar(64, 64, 64));
-
-                cv::imshow(WindowImage, show);
-                int key_pressed = cv::waitKey(200);
-
-                if ((uint8_t) key_pressed - (uint8_t) 'v' == 0) {
-                    FakeVideoNoHuman = false;
-                    FakeVideoHasHuman = !FakeVideoHasHuman;
-                    std::cout << "FakeVideoHasHuman = " << FakeVideoHasHuman
-                            << std::endl;
-                } else if ((uint8_t) key_pressed - (uint8_t) 'b' == 0) {
-                    FakeVideoHasHuman = false;
-                    FakeVideoNoHuman = !FakeVideoNoHuman;
-                    std::cout << "FakeVideoNoHuman = " << FakeVideoNoHuman
-                            << std::endl;
+                TraceRecorder::pollDump(trace_path);
+
+                // 全部采集源结束(回放完毕或打开失败)后退出
+                if (server.finished()) {
+                    ACF_LOG(Info) << "Capture source finished";
+                    ExitFlag = true;
+                    break;
                 }
 
-                if (PauseFlag) {
-                    cv::setWindowTitle(WindowImage, "人体检测[暂停]");
-
-                    // 保存界面截图
-                    char time_str[30];
-                    std::time_t t = std::chrono::system_clock::to_time_t(
-                            std::chrono::system_clock::now());
-                    std::strftime(time_str, sizeof(time_str),
-                            "capture_%Y%m%d_%H%M%S.png", std::localtime(&t));
-                    std::string folder_path = "/home/pi/acf_detector_capture/";
-                    std::string save_path = folder_path + std::string(time_str);
-                    std::cout << "Save capture to " + save_path + "..."
-                            << std::flush;
-                    // 所有用户可读写模式, 创建文件夹
-                    if (mkdir(folder_path.c_str(), ALLPERMS)
-                            != 0&& errno != EEXIST) {
-                        std::cout << "cannot create folder " << folder_path
-                                << ": " << strerror(errno) << std::endl;
+                // 获取图像, 等待图像就绪
+                std::shared_ptr<CapturedFrame> frame = server.latestFrame(0);
+                if (!frame) {
+                    if (!no_window) {
+                        cv::waitKey(100);
                     } else {
-                        try {
-                            if (cv::imwrite(save_path, show)) {
-                                std::cout << "OK" << std::endl;
-                            } else {
-                                std::cout << "Fail" << std::endl;
+                        std::this_thread::sleep_for(
+                                std::chrono::milliseconds(100));
+                    }
+                    continue;
+                }
+
+                // 控制线程最近发布的状态
+                ControlSnapshot state = ControlState.get(&state_version);
+                DetectionList result = state.result;
+                auto dur_no_human = std::chrono::steady_clock::now()
+                        - state.last_human;
+
+                // 显示画面
+                if (!no_window) {
+                    // 绘制界面
+                    cv::Mat show = frame->display.clone();
+
+                    // 绘制画面亮度
+                    cv::putText(show, std::to_string(state.brightness),
+                            cv::Point(WINDOW_WIDTH - 200, 50), 1, 2,
+                            cv::Scalar(128, 255, 128), 2);
+
+                    // 绘制红外热释电状态
+                    if (state.pir) {
+                        cv::circle(show, cv::Point(30, 30), 15,
+                                cv::Scalar(128, 128, 255),
+                                CV_FILLED);
+                    }
+
+                    // 绘制参数栏
+                    cv::putText(show, "[+] [-] tout=" + std::to_string(RELAY_DELAY),
+                            cv::Point(0, 70), 1, 1, cv::Scalar(255, 64, 255), 1);
+                    cv::putText(show,
+                            "[+] [-] dist=" + std::to_string(distance_threshold),
+                            cv::Point(0, 90), 1, 1, cv::Scalar(255, 64, 255), 1);
+                    cv::putText(show,
+                            "[+] [-] thrH=" + std::to_string(score_threshold_high),
+                            cv::Point(0, 110), 1, 1, cv::Scalar(255, 64, 255), 1);
+                    cv::putText(show,
+                            "[+] [-] thrL=" + std::to_string(score_threshold_low),
+                            cv::Point(0, 130), 1, 1, cv::Scalar(255, 64, 255), 1);
+                    cv::putText(show,
+                            "[+] [-] delay=" + std::to_string(dur_threshold_low),
+                            cv::Point(0, 150), 1, 1, cv::Scalar(255, 64, 255), 1);
+                    cv::putText(show,
+                            "[+] [-] thrIR=" + std::to_string(ir_threshold_light),
+                            cv::Point(0, 170), 1, 1, cv::Scalar(255, 64, 255), 1);
+
+                    // 绘制头肩检测情况指示灯
+                    if (state.video_state == VIDEO_HAS_HUMAN) {
+                        cv::circle(show, cv::Point(80, 30), 15,
+                                cv::Scalar(128, 255, 128),
+                                CV_FILLED);
+                    } else if (state.video_state == VIDEO_LIKE_HUMAN) {
+                        cv::circle(show, cv::Point(80, 30), 15,
+                                cv::Scalar(128, 255, 255),
+                                CV_FILLED);
+                    }
+
+                    // 绘制人数
+                    result.resizeDetections(WINDOW_WIDTH / (float) IMAGE_WIDTH,
+                            WINDOW_HEIGHT / (float) IMAGE_HEIGHT);
+                    int count_good = result.Draw(show, 130);
+                    if (count_good) {
+                        std::stringstream num;
+                        num << count_good;
+                        cv::putText(show, num.str(),
+                                cv::Point(WINDOW_WIDTH - 50, 50), 1, 3,
+                                cv::Scalar(128, 255, 128), 3);
+                    }
+
+                    // 绘制状态栏
+                    cv::Mat statusBar(cv::Size(WINDOW_WIDTH, STATUSBAR_HEIGHT),
+                            CV_8UC3, cv::Scalar(255, 255, 255));
+                    if (state.light_state == STATE_HAS_HUMAN) {
+                        cv::rectangle(statusBar, cv::Point(0, 0),
+                                cv::Point(
+                                        static_cast<int>(WINDOW_WIDTH
+                                                - WINDOW_WIDTH * dur_no_human
+                                                        / std::chrono::seconds(
+                                                                RELAY_DELAY)),
+                                        STATUSBAR_HEIGHT),
+                                cv::Scalar(128, 255, 128),
+                                CV_FILLED);
+                    }
+                    cv::putText(statusBar, state.info, cv::Point(0, statusBar.rows - 5),
+                            1, 1, cv::Scalar(0, 0, 0));
+                    statusBar.copyTo(
+                            show(
+                                    cv::Rect(0, show.rows - statusBar.rows,
+                                            statusBar.cols, statusBar.rows)));
+
+                    // 黑屏模式
+                    if (BlackScreen) {
+                        show.setTo(cv::Scalar(0, 0, 0));
+                    }
+
+                    // 绘制黑屏按钮
+                    cv::rectangle(show,
+                            cv::Rect(cv::Point(WINDOW_WIDTH - 15, 0),
+                                    cv::Size(15, 15)), cv::Scalar(64, 64, 64));
+
+                    cv::imshow(WindowImage, show);
+                    int key_pressed = cv::waitKey(200);
+
+                    if ((uint8_t) key_pressed - (uint8_t) 'v' == 0) {
+                        FakeVideoNoHuman = false;
+                        FakeVideoHasHuman = !FakeVideoHasHuman;
+                        ACF_LOG(Info) << "FakeVideoHasHuman = " << FakeVideoHasHuman;
+                        postControlEvent(EVENT_SETTINGS);
+                    } else if ((uint8_t) key_pressed - (uint8_t) 'b' == 0) {
+                        FakeVideoHasHuman = false;
+                        FakeVideoNoHuman = !FakeVideoNoHuman;
+                        ACF_LOG(Info) << "FakeVideoNoHuman = " << FakeVideoNoHuman;
+                        postControlEvent(EVENT_SETTINGS);
+                    } else if ((uint8_t) key_pressed - (uint8_t) 'p' == 0
+                            && ir_human_sim) {
+                        ir_human_sim->set(!ir_human_sim->get());
+                        ACF_LOG(Info) << "SimulatedPIR = " << ir_human_sim->get();
+                    }
+
+                    if (PauseFlag) {
+                        cv::setWindowTitle(WindowImage, "人体检测[暂停]");
+
+                        // 保存界面截图
+                        char time_str[30];
+                        std::time_t t = std::chrono::system_clock::to_time_t(
+                                std::chrono::system_clock::now());
+                        std::strftime(time_str, sizeof(time_str),
+                                "capture_%Y%m%d_%H%M%S.png", std::localtime(&t));
+                        std::string folder_path = "/home/pi/acf_detector_capture/";
+                        std::string save_path = folder_path + std::string(time_str);
+                        std::cout << "Save capture to " + save_path + "..."
+                                << std::flush;
+                        // 所有用户可读写模式, 创建文件夹
+                        if (mkdir(folder_path.c_str(), ALLPERMS)
+                                != 0&& errno != EEXIST) {
+                            std::cout << "cannot create folder " << folder_path
+                                    << ": " << strerror(errno) << std::endl;
+                        } else {
+                            try {
+                                if (cv::imwrite(save_path, show)) {
+                                    std::cout << "OK" << std::endl;
+                                } else {
+                                    std::cout << "Fail" << std::endl;
+                                }
+                            } catch (std::runtime_error& ex) {
+                                std::cout << "Fail " << ex.what() << std::endl;
                             }
-                        } catch (std::runtime_error& ex) {
-                            std::cout << "Fail " << ex.what() << std::endl;
                         }
-                    }
 
-                    while (PauseFlag) {
-                        cv::waitKey(1);
+                        while (PauseFlag) {
+                            cv::waitKey(1);
+                        }
+                        cv::setWindowTitle(WindowImage, "人体检测");
                     }
-                    cv::setWindowTitle(WindowImage, "人体检测");
+                } else {
+                    // 无界面时只等待控制线程发布新状态
+                    ControlState.waitNewer(state_version, 200);
                 }
-            } else {
-                std::this_thread::sleep_for(std::chrono::milliseconds(200));
-            }
 
+            }
+        } catch (const std::exception &err) {
+            ACF_LOG(Error) << "Exit with exception: " << err.what();
         }
+
+        ExitFlag = true;
+        postControlEvent(EVENT_EXIT);
+        control_thread.join();
+        delete ir_human;
         gpioTerminate();
     } catch (const std::exception &err) {
-        std::cout << "Exit with exception: " << err.what() << std::endl;
+        ACF_LOG(Error) << "Exit with exception: " << err.what();
     }
 
     ExitFlag = true;
@@ -680,13 +945,21 @@ int main(int argc, char **argv) {
 
 // wait thread finish
     std::cout << "Waiting thread finish..." << std::endl;
-    while (!CaptureThreadDone || !ProcessThreadDone) {
-        if (!no_window) {
-            cv::waitKey(100);
-        } else {
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    server.stop();
+    std::cout << "All thread finished" << std::endl;
+    if (server_started) {
+#ifdef ACF_INSTRUMENT
+        for (size_t i = 0; i < server.getStreamCount(); i++) {
+            std::string path = "/home/pi/acf_cascade_profile.txt";
+            if (i > 0) {
+                path += "." + server.getStreamOptions(i).name;
+            }
+            server.getDetector(i).dumpCascadeProfile(path);
         }
+#endif
+        LatencyStats::print();
+        PerfCounters::print();
     }
-    std::cout << "All thread finished" << std::endl;
+    Logger::flush();
     return 0;
 }
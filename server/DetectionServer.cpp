@@ -0,0 +1,571 @@
+/*
+ * DetectionServer.cpp
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <sstream>
+
+#include "DetectionServer.h"
+#include "../general/NonMaximumSuppression.h"
+#include "../general/TraceRecorder.h"
+#include "../general/PerfCounters.h"
+#include "../general/Logger.h"
+
+// 每隔该时间按各流的耗时重新分配帧率
+#define SHEDDING_PERIOD_NS 1000000000LL
+
+// 裁剪并缩放I420帧, 三个平面各缩放一次; roi和size的宽高须为偶数
+static cv::Mat scaleI420(const cv::Mat &frame, cv::Rect roi, cv::Size size) {
+    const int width = frame.cols, height = frame.rows * 2 / 3;
+    const int area = width * height;
+    cv::Mat y(height, width, CV_8UC1, frame.data);
+    cv::Mat u(height / 2, width / 2, CV_8UC1, frame.data + area);
+    cv::Mat v(height / 2, width / 2, CV_8UC1, frame.data + area * 5 / 4);
+
+    cv::Rect half_roi(roi.x / 2, roi.y / 2, roi.width / 2, roi.height / 2);
+    cv::Size half(size.width / 2, size.height / 2);
+    cv::Mat scaled(size.height * 3 / 2, size.width, CV_8UC1);
+    cv::Mat scaled_y(size, CV_8UC1, scaled.data);
+    cv::Mat scaled_u(half, CV_8UC1, scaled.data + size.area());
+    cv::Mat scaled_v(half, CV_8UC1, scaled.data + size.area() * 5 / 4);
+    cv::resize(y(roi), scaled_y, size, 0, 0, cv::INTER_AREA);
+    cv::resize(u(half_roi), scaled_u, half, 0, 0, cv::INTER_AREA);
+    cv::resize(v(half_roi), scaled_v, half, 0, 0, cv::INTER_AREA);
+    return scaled;
+}
+
+// I420转BGR. cv::COLOR_YUV2BGR_I420按有限范围转换, 全范围(JFIF)的帧上采样色度后
+// 按YCrCb转换, OpenCV的YCrCb即为全范围
+static void i420ToBgr(const cv::Mat &frame, cv::Mat &bgr, bool full_range) {
+    if (!full_range) {
+        cv::cvtColor(frame, bgr, cv::COLOR_YUV2BGR_I420);
+        return;
+    }
+    const int width = frame.cols, height = frame.rows * 2 / 3;
+    const int area = width * height;
+    cv::Mat planes[3];
+    planes[0] = cv::Mat(height, width, CV_8UC1, frame.data);
+    cv::resize(cv::Mat(height / 2, width / 2, CV_8UC1, frame.data + area * 5 / 4),
+            planes[1], planes[0].size(), 0, 0, cv::INTER_LINEAR);
+    cv::resize(cv::Mat(height / 2, width / 2, CV_8UC1, frame.data + area),
+            planes[2], planes[0].size(), 0, 0, cv::INTER_LINEAR);
+    cv::Mat ycrcb;
+    cv::merge(planes, 3, ycrcb);
+    cv::cvtColor(ycrcb, bgr, cv::COLOR_YCrCb2BGR);
+}
+
+DetectionServer::DetectionServer(const std::string &modelfile) :
+        modelfile(modelfile), stop_flag(false) {
+}
+
+DetectionServer::~DetectionServer() {
+    stop();
+    for (Stream *stream : streams) {
+        delete stream->detector;
+        delete stream->source;
+        delete stream;
+    }
+    delete arena;
+}
+
+int DetectionServer::addStream(const StreamOptions &options) {
+    Stream *stream = new Stream();
+    stream->options = options;
+    StreamOptions &o = stream->options;
+    int index = streams.size();
+    stream->index = index;
+    if (o.name.empty()) {
+        o.name = "cam" + std::to_string(index);
+    }
+    if (o.detect_size.area() == 0) {
+        o.detect_size = o.capture.size;
+    }
+    // 帧率须为正数, 用于计算检测间隔
+    o.target_fps = std::max(o.target_fps, 0.1);
+    o.min_fps = std::max(std::min(o.min_fps, o.target_fps), 0.1);
+    stream->effective_fps = o.target_fps;
+
+    // 各流的耗时和指标以流名称区分
+    std::string label = "stream=\"" + o.name + "\"";
+    stream->detect_hist = &LatencyStats::get("stream." + o.name + ".detect");
+    stream->latency_hist = &LatencyStats::get("stream." + o.name + ".latency");
+    stream->captured_total = &Metrics::counter("acf_frames_captured_total",
+            "Frames grabbed from the camera", label);
+    stream->processed_total = &Metrics::counter("acf_frames_processed_total",
+            "Frames processed by the detector", label);
+    stream->dropped_total = &Metrics::counter("acf_frames_dropped_total",
+            "Captured frames overwritten before the detector read them",
+            label);
+    stream->shed_total = &Metrics::counter("acf_frames_shed_total",
+            "Frames discarded because they would exceed the latency target",
+            label);
+    stream->detections_total = &Metrics::counter("acf_detections_total",
+            "Detections after NMS", label);
+    stream->detections_gauge = &Metrics::gauge("acf_detections",
+            "Detections after NMS in the last frame", label);
+    stream->fps_gauge = &Metrics::gauge("acf_fps",
+            "Detector frames per second", label);
+    stream->target_fps_gauge = &Metrics::gauge("acf_target_fps",
+            "Detector frame rate allowed by load shedding", label);
+    stream->target_fps_gauge->set(o.target_fps);
+
+    streams.push_back(stream);
+    return index;
+}
+
+bool DetectionServer::start() {
+    model = std::make_shared<const ACFModel>(modelfile);
+    if (!model->isLoaded()) {
+        ACF_LOG(Error) << "Detection server: failed to load model "
+                << modelfile;
+        return false;
+    }
+
+    // 每个调度线程占用一个保留的master位置, 其余位置由TBB工作线程填充
+    max_concurrent = std::max(max_concurrent, 1);
+    arena = new tbb::task_arena(tbb::task_arena::automatic, max_concurrent);
+
+    for (Stream *stream : streams) {
+        stream->detector = new ACFDetector(model);
+        stream->detector->pyramid_options = pyramid_options;
+        // 精细尺度(远处的人)隔帧轮流计算, 最粗的八度每帧计算
+        stream->detector->max_refresh_period = max_refresh_period;
+        // 分类耗时超出预算时提高提前拒绝阈值, 0表示关闭
+        stream->detector->classifier_budget_ms = classifier_budget_ms;
+        stream->source = FrameSource::create(stream->options.source,
+                stream->options.capture);
+        stream->capture_thread = std::thread(&DetectionServer::captureLoop,
+                this, stream);
+    }
+    for (int i = 0; i < max_concurrent; i++) {
+        workers.push_back(std::thread(&DetectionServer::workerLoop, this, i));
+    }
+    // 监视模型文件, 在监视线程中加载新模型, 各流在下一帧开始时切换
+    if (model_hot_reload) {
+        model_watcher.reset(new ModelWatcher(modelfile,
+                [this](const std::string &path) {
+                    return reloadModel(path);
+                }));
+    }
+    started = true;
+    ACF_LOG(Info) << "Detection server: " << (int) streams.size()
+            << " streams, " << max_concurrent << " concurrent";
+    return true;
+}
+
+void DetectionServer::stop() {
+    if (!started) {
+        return;
+    }
+    started = false;
+    model_watcher.reset();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop_flag = true;
+    }
+    cond.notify_all();
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+    for (Stream *stream : streams) {
+        if (stream->capture_thread.joinable()) {
+            stream->capture_thread.join();
+        }
+    }
+}
+
+std::shared_ptr<CapturedFrame> DetectionServer::latestFrame(int stream) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return streams.at(stream)->frame;
+}
+
+StreamResult DetectionServer::latestResult(int stream) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return streams.at(stream)->result;
+}
+
+bool DetectionServer::finished() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const Stream *stream : streams) {
+        // 已采集的最后一帧还未检测时不算结束
+        if (!stream->ended || stream->busy
+                || (stream->frame && stream->frame->seq > stream->last_seq)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool DetectionServer::reloadModel(const std::string &modelfile) {
+    std::shared_ptr<const ACFModel> model = std::make_shared<const ACFModel>(
+            modelfile);
+    if (!model->isLoaded()) {
+        ACF_LOG(Warn) << "Keep current model, failed to load " << modelfile;
+        return false;
+    }
+    // 全部流共用同一个新模型
+    for (Stream *stream : streams) {
+        stream->detector->setModel(model);
+    }
+    return true;
+}
+
+void DetectionServer::captureLoop(Stream *stream) {
+    TraceRecorder::setThreadName("capture");
+    const StreamOptions &o = stream->options;
+    FrameSource *camera = stream->source;
+
+    if (!camera || !camera->open()) {
+        ACF_LOG(Error) << "Stream " << o.name << ": cannot open "
+                << o.source;
+        stream->ended = true;
+        cond.notify_all();
+        return;
+    }
+    ACF_LOG(Info) << "Stream " << o.name << ": capturing from " << o.source;
+
+    // 检测区域限制在画面内, 并按I420色度平面对齐到偶数
+    bool yuv = o.capture.format == FRAME_I420;
+    bool full_range = yuv && camera->isFullRange();
+    cv::Rect full_frame(cv::Point(0, 0), o.capture.size);
+    cv::Rect roi = o.detect_roi & full_frame;
+    if (roi.area() == 0) {
+        roi = full_frame;
+    }
+    roi.x &= ~1;
+    roi.y &= ~1;
+    roi.width &= ~1;
+    roi.height &= ~1;
+    cv::Size detect_size(o.detect_size.width & ~1, o.detect_size.height & ~1);
+    bool detect_raw = roi == full_frame && detect_size == full_frame.size();
+    uint64_t seq = 0;
+    int read_failures = 0;
+
+    while (!stop_flag) {
+        // 获取图像并保存为本流的最新帧
+        TraceScope trace_grab("capture.grab");
+        std::shared_ptr<uint8_t> raw_data;
+        if (camera->read(raw_data)) {
+            std::shared_ptr<CapturedFrame> frame(new CapturedFrame());
+            frame->grab_ns = camera->getGrabTime();
+            if (frame->grab_ns == 0) {
+                frame->grab_ns = LatencyHistogram::now_ns();
+            }
+            frame->raw = raw_data;
+            frame->roi = roi;
+            frame->yuv_full_range = full_range;
+            cv::Mat raw = camera->wrap(raw_data.get());
+            {
+                // 由采集的画面直接缩放出检测帧和显示帧
+                TraceScope trace_scale("capture.scale");
+                if (detect_raw) {
+                    frame->detect = raw;
+                } else if (yuv) {
+                    frame->detect = scaleI420(raw, roi, detect_size);
+                } else {
+                    cv::resize(raw(roi), frame->detect, detect_size, 0, 0,
+                            cv::INTER_AREA);
+                }
+                if (o.display_size.area() > 0 && yuv) {
+                    // 颜色转换只处理显示分辨率的像素
+                    i420ToBgr(scaleI420(raw, full_frame, o.display_size),
+                            frame->display, full_range);
+                } else if (o.display_size.area() > 0) {
+                    cv::resize(raw, frame->display, o.display_size, 0, 0,
+                            cv::INTER_AREA);
+                }
+            }
+            // 不再引用采集的数据, V4L2后端此时即可归还缓冲区
+            if (!detect_raw) {
+                frame->raw.reset();
+            }
+            raw_data.reset();
+
+            frame->seq = ++seq;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stream->frame = frame;
+            }
+            cond.notify_all();
+            stream->captured_total->inc();
+            read_failures = 0;
+        } else if (camera->atEnd()) {
+            ACF_LOG(Info) << "Stream " << o.name
+                    << ": capture source finished";
+            break;
+        } else {
+            // 读取失败时逐步延长重试间隔(最长1s), 避免空转
+            read_failures = std::min(read_failures + 1, 7);
+            std::this_thread::sleep_for(
+                    std::chrono::milliseconds(
+                            std::min(1000, 10 << read_failures)));
+            continue;
+        }
+
+        std::this_thread::yield();
+    }
+
+    camera->release();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stream->ended = true;
+    }
+    cond.notify_all();
+}
+
+void DetectionServer::workerLoop(int worker) {
+    TraceRecorder::setThreadName("detect");
+    // 计数器按线程打开, 每个调度线程各自打开
+    if (perf_counters) {
+        PerfCounters::setEnabled(true);
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stop_flag) {
+        int64_t now_ns = LatencyHistogram::now_ns();
+        updateLoadShedding(now_ns);
+        // 没有可检测的流时等待新帧, 或等到最近一路流到期
+        int64_t wake_ns = now_ns + 100000000LL;
+        Stream *stream = pickStream(now_ns, wake_ns);
+        if (stream == NULL) {
+            cond.wait_for(lock, std::chrono::nanoseconds(wake_ns - now_ns));
+            continue;
+        }
+
+        std::shared_ptr<CapturedFrame> frame = stream->frame;
+        stream->busy = true;
+        lock.unlock();
+        try {
+            // 在共用的arena中检测, 检测器内部的parallel_for使用同一组工作线程
+            arena->execute([this, stream, &frame] {
+                process(stream, frame);
+            });
+        } catch (const std::exception &err) {
+            ACF_LOG(Error) << "Stream " << stream->options.name
+                    << ": detection failed: " << err.what();
+        }
+        if (on_result) {
+            on_result(stream->index);
+        }
+        lock.lock();
+        stream->busy = false;
+        // 当前流可能已有新帧, 唤醒其他调度线程
+        cond.notify_all();
+    }
+}
+
+DetectionServer::Stream *DetectionServer::pickStream(int64_t now_ns,
+        int64_t &wake_ns) {
+    Stream *best = NULL;
+    for (Stream *stream : streams) {
+        if (stream->busy || !stream->frame
+                || stream->frame->seq == stream->last_seq) {
+            continue;
+        }
+        if (stream->next_due_ns > now_ns) {
+            wake_ns = std::min(wake_ns, stream->next_due_ns);
+            continue;
+        }
+
+        // 预计得出结果时已超出延迟目标的帧直接丢弃, 等待下一帧;
+        // 检测本身就超出目标时丢弃无济于事, 只提示一次, 由降帧率处理
+        int64_t max_latency_ns = stream->options.max_latency_ms * 1000000LL;
+        if (max_latency_ns > 0) {
+            if (stream->cost_ns >= max_latency_ns) {
+                if (!stream->latency_warned) {
+                    ACF_LOG(Warn) << "Stream " << stream->options.name
+                            << ": detection takes "
+                            << (int) (stream->cost_ns / 1e6)
+                            << "ms, latency target "
+                            << stream->options.max_latency_ms
+                            << "ms cannot be met";
+                    stream->latency_warned = true;
+                }
+            } else if (now_ns - stream->frame->grab_ns + stream->cost_ns
+                    > max_latency_ns) {
+                stream->last_seq = stream->frame->seq;
+                stream->shed_total->inc();
+                continue;
+            }
+        }
+
+        // 最早到期的流优先, 过载时各流因此按帧率比例轮流检测
+        if (best == NULL || stream->next_due_ns < best->next_due_ns
+                || (stream->next_due_ns == best->next_due_ns
+                        && stream->options.priority > best->options.priority)) {
+            best = stream;
+        }
+    }
+    if (best == NULL) {
+        return NULL;
+    }
+
+    uint64_t seq = best->frame->seq;
+    if (best->last_seq > 0 && seq > best->last_seq + 1) {
+        best->dropped_total->inc(seq - best->last_seq - 1);
+    }
+    best->last_seq = seq;
+    // 到期时间最多落后一个周期, 过载后恢复时不会连续补检
+    int64_t interval_ns = (int64_t) (1e9 / best->effective_fps);
+    best->next_due_ns = std::max(best->next_due_ns + interval_ns,
+            now_ns - interval_ns);
+    return best;
+}
+
+void DetectionServer::updateLoadShedding(int64_t now_ns) {
+    if (now_ns - last_shedding_ns < SHEDDING_PERIOD_NS) {
+        return;
+    }
+    last_shedding_ns = now_ns;
+
+    // 负载以每秒所需的检测时间(s)计, 可用时间为max_concurrent路同时检测
+    std::vector<Stream*> active;
+    double load = 0;
+    for (Stream *stream : streams) {
+        if (!stream->ended) {
+            active.push_back(stream);
+            load += stream->cost_ns / 1e9 * stream->options.target_fps;
+        }
+    }
+    double capacity = overload_threshold * max_concurrent;
+    bool overload = load > capacity;
+
+    if (!overload) {
+        for (Stream *stream : active) {
+            stream->effective_fps = stream->options.target_fps;
+        }
+    } else {
+        // 先保证各流的最低帧率, 剩余时间按优先级从高到低分配, 同一优先级按比例分配
+        double remaining = capacity;
+        for (Stream *stream : active) {
+            stream->effective_fps = stream->options.min_fps;
+            remaining -= stream->cost_ns / 1e9 * stream->options.min_fps;
+        }
+        std::stable_sort(active.begin(), active.end(),
+                [](const Stream *a, const Stream *b) {
+                    return a->options.priority > b->options.priority;
+                });
+        for (size_t begin = 0, end; begin < active.size(); begin = end) {
+            double need = 0;
+            for (end = begin;
+                    end < active.size()
+                            && active[end]->options.priority
+                                    == active[begin]->options.priority;
+                    end++) {
+                need += active[end]->cost_ns / 1e9
+                        * (active[end]->options.target_fps
+                                - active[end]->options.min_fps);
+            }
+            double fraction =
+                    need > 0 ? std::max(0.0, std::min(1.0, remaining / need)) : 1;
+            for (size_t i = begin; i < end; i++) {
+                const StreamOptions &o = active[i]->options;
+                active[i]->effective_fps = o.min_fps
+                        + fraction * (o.target_fps - o.min_fps);
+            }
+            remaining -= fraction * need;
+        }
+    }
+
+    for (Stream *stream : streams) {
+        stream->target_fps_gauge->set(stream->effective_fps);
+    }
+    static MetricGauge &load_gauge = Metrics::gauge("acf_detect_load",
+            "Detection time needed per second at the target frame rates, "
+            "relative to the concurrent streams");
+    load_gauge.set(load / max_concurrent);
+
+    if (overload != overloaded) {
+        overloaded = overload;
+        if (overload) {
+            std::ostringstream rates;
+            rates << std::fixed << std::setprecision(1);
+            for (Stream *stream : active) {
+                rates << " " << stream->options.name << "="
+                        << stream->effective_fps;
+            }
+            ACF_LOG(Warn) << "Detection overloaded (load "
+                    << load / max_concurrent << "), shedding fps:"
+                    << rates.str();
+        } else {
+            ACF_LOG(Info) << "Detection load back to normal ("
+                    << load / max_concurrent << ")";
+        }
+    }
+}
+
+void DetectionServer::process(Stream *stream,
+        std::shared_ptr<CapturedFrame> frame) {
+    static LatencyHistogram &features_hist = LatencyStats::get(
+            "detector.features");
+    static LatencyHistogram &classifier_hist = LatencyStats::get(
+            "detector.classifier");
+    static LatencyHistogram &nms_hist = LatencyStats::get("frame.nms");
+    static LatencyHistogram &total_hist = LatencyStats::get("frame.total");
+    static LatencyHistogram &capture_to_detect_hist = LatencyStats::get(
+            "latency.capture_to_detect");
+
+    int64_t start_ns = LatencyHistogram::now_ns();
+    DetectionList dets, nms_dets;
+    {
+        ScopedLatency total_timer(total_hist);
+        TraceScope trace_frame("frame");
+
+        // ACF目标检测, I420帧按采集端记录的范围转换颜色
+        stream->detector->pyramid_options.yuv_full_range =
+                frame->yuv_full_range;
+        dets = stream->detector->applyDetector(frame->detect);
+        // 非极大值抑制
+        ScopedLatency nms_timer(nms_hist);
+        TraceScope trace_nms("frame.nms");
+        nms_dets = NonMaximumSuppression::dollarNMS(dets);
+    }
+    int64_t end_ns = LatencyHistogram::now_ns();
+    stream->detect_hist->record(end_ns - start_ns);
+    stream->latency_hist->record(end_ns - frame->grab_ns);
+    capture_to_detect_hist.record(end_ns - frame->grab_ns);
+
+    // 检测结果换算回采集画面的坐标
+    cv::Size detect_size = ACFFeaturePyramid::imageSize(frame->detect);
+    nms_dets.resizeDetections(frame->roi.width / (float) detect_size.width,
+            frame->roi.height / (float) detect_size.height);
+    nms_dets.moveDetections(frame->roi.x, frame->roi.y);
+
+    stream->processed_total->inc();
+    stream->detections_total->inc(nms_dets.getSize());
+    stream->detections_gauge->set(nms_dets.getSize());
+
+    // 显示最近10s内的中位数, 总耗时附带p99
+    LatencyHistogram::Snapshot total = stream->detect_hist->snapshot();
+    std::stringstream info;
+    info << std::fixed << std::setprecision(0);
+    info << detect_size.width << "x" << detect_size.height << " ";
+    info << "ftr:" << std::setw(2) << features_hist.snapshot().p50_ms()
+            << "ms ";
+    info << "clf:" << std::setw(3) << classifier_hist.snapshot().p50_ms()
+            << "ms ";
+    info << "total:" << std::setw(3) << total.p50_ms() << "/"
+            << total.p99_ms() << "ms ";
+    info << "nDet:" << std::setw(2) << dets.getSize() << " ";
+    info << "nHS:" << nms_dets.getSize();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    // 单帧耗时和帧率取滑动平均
+    double cost_ns = end_ns - start_ns;
+    stream->cost_ns =
+            stream->cost_ns == 0 ? cost_ns : 0.9 * stream->cost_ns + 0.1 * cost_ns;
+    if (stream->last_result_ns > 0 && end_ns > stream->last_result_ns) {
+        double fps = 1e9 / (end_ns - stream->last_result_ns);
+        stream->fps_gauge->set(
+                stream->fps_gauge->get() == 0 ?
+                        fps : 0.9 * stream->fps_gauge->get() + 0.1 * fps);
+    }
+    stream->last_result_ns = end_ns;
+    stream->result.frame = frame;
+    stream->result.detections = nms_dets;
+    stream->result.info = info.str();
+    stream->result.detected_ns = end_ns;
+}
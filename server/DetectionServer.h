@@ -0,0 +1,209 @@
+/*
+ * DetectionServer.h
+ *
+ * 多路摄像头检测: 每路流有独立的采集线程, 最新帧, 检测器状态(特征金字塔, 尺度调度,
+ * 耗时预算)和检测结果, 全部检测器共用一个只读模型(ACFModel), 由max_concurrent个
+ * 调度线程在同一个TBB arena中执行检测.
+ *
+ * 调度: 每路流按target_fps确定下一帧的到期时间, 空闲的调度线程选择有新帧且最早到期
+ * 的流, 因此过载时各路流按帧率比例轮流检测, 不会被某一路独占.
+ * 降载: 预计负载(各流单帧耗时 x 帧率 / max_concurrent)超过overload_threshold时,
+ * 先保证各流的min_fps, 剩余的检测时间按priority从高到低分配; 等待过久、检测完成时
+ * 将超出max_latency_ms的帧直接丢弃.
+ *
+ * 用法:
+ *     DetectionServer server(model_path);
+ *     StreamOptions cam;
+ *     cam.name = "door";
+ *     cam.source = "v4l2:/dev/video0";
+ *     server.addStream(cam);
+ *     server.start();
+ *     StreamResult result = server.latestResult(0);
+ */
+
+#ifndef SERVER_DETECTIONSERVER_H_
+#define SERVER_DETECTIONSERVER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+#include <tbb/tbb.h>
+
+#include "../acf/ACFDetector.h"
+#include "../acf/ModelWatcher.h"
+#include "../capture/FrameSource.h"
+#include "../general/DetectionList.h"
+#include "../general/LatencyStats.h"
+#include "../general/Metrics.h"
+
+struct StreamOptions {
+    // 日志和指标中的名称, 为空时使用"cam<序号>"
+    std::string name;
+    // FrameSource地址, 见capture/FrameSource.h
+    std::string source;
+    CaptureOptions capture;
+    // 检测分辨率, 采集的画面(先按detect_roi裁剪)缩放到该尺寸后送入检测器, 为0时与采集相同
+    cv::Size detect_size;
+    // 检测区域(采集画面坐标), 宽高为0时检测整个画面
+    cv::Rect detect_roi;
+    // 显示帧(BGR)的尺寸, 为0时不生成显示帧
+    cv::Size display_size;
+    // 期望的检测帧率, 以及过载时降低到的最低帧率
+    double target_fps = 15;
+    double min_fps = 1;
+    // 采集到得出结果的最大延迟, 预计超出的帧不再检测; 0表示不限制
+    int max_latency_ms = 0;
+    // 过载时优先保证priority高的流
+    int priority = 0;
+};
+
+// 一次采集得到的检测帧和显示帧, 各自只缩放一次
+struct CapturedFrame {
+    std::shared_ptr<uint8_t> raw;   // 采集的原始数据, 检测帧不缩放时直接引用
+    cv::Mat detect;     // 检测分辨率, BGR或I420
+    bool yuv_full_range = false;    // I420帧为全范围(JFIF), 见FrameSource::isFullRange
+    cv::Rect roi;       // 检测帧对应的采集画面区域
+    cv::Mat display;    // 显示分辨率的BGR, 同时用于计算亮度
+    uint64_t seq = 0;   // 采集的帧序号, 从1开始
+    int64_t grab_ns = 0;    // 采集时间(steady_clock), 见FrameSource::getGrabTime
+};
+
+struct StreamResult {
+    // 结果对应的帧, 还没有结果时为NULL
+    std::shared_ptr<CapturedFrame> frame;
+    // 非极大值抑制后的检测结果, 采集画面坐标
+    DetectionList detections;
+    // 检测器状态信息, 用于界面状态栏
+    std::string info;
+    // 得出结果(非极大值抑制完成)的时间, 与CapturedFrame::grab_ns同一时钟
+    int64_t detected_ns = 0;
+};
+
+class DetectionServer {
+public:
+    explicit DetectionServer(const std::string &modelfile);
+    ~DetectionServer();
+
+    DetectionServer(const DetectionServer&) = delete;
+    DetectionServer& operator=(const DetectionServer&) = delete;
+
+    // 添加一路流, 返回流序号; 须在start()之前调用
+    int addStream(const StreamOptions &options);
+
+    // 加载模型, 打开全部采集源并启动采集和调度线程; 模型无效时返回false.
+    // 打开失败的采集源记录错误并视为已结束, 不影响其他流
+    bool start();
+
+    // 停止并等待全部线程结束
+    void stop();
+
+    size_t getStreamCount() const {
+        return this->streams.size();
+    }
+
+    const StreamOptions &getStreamOptions(int stream) const {
+        return this->streams.at(stream)->options;
+    }
+
+    // 最新的采集帧, 还没有采集到时返回NULL
+    std::shared_ptr<CapturedFrame> latestFrame(int stream) const;
+
+    // 最新的检测结果
+    StreamResult latestResult(int stream) const;
+
+    // 全部采集源都已结束(回放完毕或打开失败)
+    bool finished() const;
+
+    // 加载模型并发布给全部流的检测器, 加载失败时保留原模型
+    bool reloadModel(const std::string &modelfile);
+
+    // 用于设置各流检测器的参数或导出级联统计
+    ACFDetector &getDetector(int stream) {
+        return *this->streams.at(stream)->detector;
+    }
+
+    // 以下参数在start()之前设置, 对全部流生效
+    PyramidOptions pyramid_options;
+    int max_refresh_period = 1;
+    int classifier_budget_ms = 0;
+    // 模型文件被替换后自动重新加载
+    bool model_hot_reload = true;
+    // 在调度线程上采样硬件性能计数器
+    bool perf_counters = false;
+    // 同时检测的流数, 即调度线程数; 各流的检测共用一个TBB arena
+    int max_concurrent = 2;
+    // 预计负载超过该值时开始降低各流的帧率
+    double overload_threshold = 0.9;
+    // 某一路流的检测结果更新后在调度线程中调用, 参数为流序号; 应尽快返回(如投递事件)
+    std::function<void(int)> on_result;
+
+private:
+    struct Stream {
+        StreamOptions options;
+        int index = 0;
+        FrameSource *source = NULL;
+        ACFDetector *detector = NULL;
+        std::thread capture_thread;
+        std::atomic<bool> ended;
+
+        // 以下由DetectionServer::mutex保护
+        std::shared_ptr<CapturedFrame> frame;
+        uint64_t last_seq = 0;      // 最近一次调度(检测或丢弃)的帧序号
+        bool busy = false;
+        int64_t next_due_ns = 0;
+        double cost_ns = 0;         // 单帧检测耗时的滑动平均
+        double effective_fps = 0;   // 降载后的帧率
+        bool latency_warned = false;
+        StreamResult result;
+
+        LatencyHistogram *detect_hist = NULL;
+        LatencyHistogram *latency_hist = NULL;
+        MetricCounter *captured_total = NULL;
+        MetricCounter *processed_total = NULL;
+        MetricCounter *dropped_total = NULL;
+        MetricCounter *shed_total = NULL;
+        MetricCounter *detections_total = NULL;
+        MetricGauge *detections_gauge = NULL;
+        MetricGauge *fps_gauge = NULL;
+        MetricGauge *target_fps_gauge = NULL;
+        int64_t last_result_ns = 0;
+
+        Stream() :
+                ended(false) {
+        }
+    };
+
+    void captureLoop(Stream *stream);
+    void workerLoop(int worker);
+    void process(Stream *stream, std::shared_ptr<CapturedFrame> frame);
+
+    // 选择下一路要检测的流, 没有可检测的流时返回NULL并给出下次到期时间; 需持有mutex
+    Stream *pickStream(int64_t now_ns, int64_t &wake_ns);
+    // 按各流的耗时和优先级重新分配帧率; 需持有mutex
+    void updateLoadShedding(int64_t now_ns);
+
+    std::string modelfile;
+    std::shared_ptr<const ACFModel> model;
+    std::vector<Stream*> streams;
+
+    tbb::task_arena *arena = NULL;
+    std::vector<std::thread> workers;
+    std::unique_ptr<ModelWatcher> model_watcher;
+
+    mutable std::mutex mutex;
+    std::condition_variable cond;
+    std::atomic<bool> stop_flag;
+    bool started = false;
+    bool overloaded = false;
+    int64_t last_shedding_ns = 0;
+};
+
+#endif /* SERVER_DETECTIONSERVER_H_ */
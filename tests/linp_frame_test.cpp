@@ -0,0 +1,85 @@
+/*
+ * linp_frame_test.cpp
+ *
+ * LinpFrameParser的分帧测试: 一帧分多次到达, 以及损坏的数据之后的有效帧.
+ * 运行: ctest, 或直接执行linp_frame_test, 全部通过时返回0
+ */
+
+#include <iostream>
+#include <vector>
+
+#include "../control/LinpFrame.h"
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond \
+                    ") failed" << std::endl; \
+            failures++; \
+        } \
+    } while (0)
+
+// 开关上报帧, 数据和可选数据中都含有引导码0x55
+static std::vector<uint8_t> makeFrame(LinpReceiverFrame &frame) {
+    frame.type = 0x01;
+    frame.data = std::vector<uint8_t> { 0x5F, 0x00, 0x55, 0x12, 0x34, 0x81,
+            0x02, 0x01, 0x01 };
+    frame.opt_data = std::vector<uint8_t> { 0x01, 0x55, 0x00 };
+    return frame.make_frame();
+}
+
+static bool sameFrame(const LinpReceiverFrame &a, const LinpReceiverFrame &b) {
+    return a.type == b.type && a.data == b.data && a.opt_data == b.opt_data
+            && a.crc_header == b.crc_header && a.crc_data == b.crc_data;
+}
+
+// 在每个位置把一帧分成两次到达
+static void testSplitFrame() {
+    LinpReceiverFrame sent;
+    std::vector<uint8_t> raw = makeFrame(sent);
+    for (size_t split = 1; split < raw.size(); split++) {
+        LinpFrameParser parser;
+        LinpReceiverFrame received;
+        parser.append(raw.data(), split);
+        CHECK(!parser.next(received));
+        CHECK(parser.size() == split);
+        parser.append(raw.data() + split, raw.size() - split);
+        CHECK(parser.next(received));
+        CHECK(sameFrame(sent, received));
+        CHECK(parser.size() == 0);
+    }
+}
+
+// 噪声和数据CRC错误的帧之后的有效帧仍能解析, 之后剩余的半帧保留
+static void testResync() {
+    LinpReceiverFrame sent;
+    std::vector<uint8_t> raw = makeFrame(sent);
+    std::vector<uint8_t> corrupted = raw;
+    corrupted[8] ^= 0xFF;
+
+    std::vector<uint8_t> stream = { 0x00, 0x55, 0x13 };
+    stream.insert(stream.end(), corrupted.begin(), corrupted.end());
+    stream.insert(stream.end(), raw.begin(), raw.end());
+    stream.insert(stream.end(), raw.begin(), raw.begin() + 4);
+
+    LinpFrameParser parser;
+    LinpReceiverFrame received;
+    parser.append(stream.data(), stream.size());
+    CHECK(parser.next(received));
+    CHECK(sameFrame(sent, received));
+    CHECK(!parser.next(received));
+    CHECK(parser.size() == 4);
+}
+
+int main() {
+    testSplitFrame();
+    testResync();
+    if (failures) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "linp_frame_test passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,299 @@
+/*
+ * benchmark.cpp
+ *
+ * 离线性能测试: 不依赖raspicam, pigpio和显示, 将图片目录或视频文件中的帧重复送入
+ * ACFDetector::applyDetector和dollarNMS, 统计各阶段耗时的最小值, 中位数和p99.
+ *
+ * 用法: acf_benchmark <model> <images_dir|video> [options]
+ *   --iterations N   统计的帧数, 默认200
+ *   --warmup N       预热帧数(不统计), 默认20
+ *   --threads N      TBB线程数, 默认由TBB决定
+ *   --profile P      金字塔尺度配置: fast, balanced, accurate, 默认balanced
+ *   --refresh N      精细尺度的最大刷新周期, 默认1(每帧计算全部尺度)
+ *   --size WxH       帧缩放尺寸, 默认960x720(与main.cpp一致)
+ *   --max-frames N   最多读取的帧数, 默认100
+ *   --trace PATH     记录时间线, 结束时导出最后若干帧的Chrome trace到PATH
+ *   --perf 1         采样硬件性能计数器, 报告各阶段的IPC和每像素/每窗口的缺失次数
+ *   --yuv 1          将帧转换为I420后送入检测器, 测试YUV采集模式(main.cpp中capture_yuv)
+ *   --extra-model M  与<model>共用特征金字塔的附加模型, 可重复指定; 指定后改用
+ *                    ACFMultiDetector::applyDetectors, 各模型分别做NMS
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cmath>
+
+#include <opencv2/opencv.hpp>
+#include <tbb/tbb.h>
+
+#include "../acf/ACFDetector.h"
+#include "../acf/ACFMultiDetector.h"
+#include "../general/NonMaximumSuppression.h"
+#include "../general/TraceRecorder.h"
+#include "../general/PerfCounters.h"
+
+// 读取图片目录或视频文件中的帧, 统一缩放至frame_size
+static std::vector<cv::Mat> loadFrames(const std::string &source,
+        cv::Size frame_size, int max_frames) {
+    std::vector<cv::Mat> frames;
+    std::vector<cv::String> files;
+    cv::glob(source + "/*", files, false);
+    if (files.empty()) {
+        cv::VideoCapture video(source);
+        cv::Mat frame;
+        while (frames.size() < max_frames && video.read(frame)) {
+            cv::Mat resized;
+            cv::resize(frame, resized, frame_size);
+            frames.push_back(resized);
+        }
+    } else {
+        for (const std::string &file : files) {
+            if (frames.size() >= max_frames) {
+                break;
+            }
+            cv::Mat image = cv::imread(file, cv::IMREAD_COLOR);
+            if (image.empty()) {
+                continue;
+            }
+            cv::Mat resized;
+            cv::resize(image, resized, frame_size);
+            frames.push_back(resized);
+        }
+    }
+    return frames;
+}
+
+static double percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t i = std::min(values.size() - 1,
+            (size_t) std::ceil(p * values.size()) - (p > 0 ? 1 : 0));
+    return values[i];
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        std::cout << "usage: " << argv[0]
+                << " <model> <images_dir|video> [--iterations N] [--warmup N]"
+                        " [--threads N] [--profile P] [--refresh N] [--size WxH]"
+                        " [--max-frames N] [--trace PATH] [--perf 1] [--yuv 1]"
+                        " [--extra-model M]..."
+                << std::endl;
+        return 1;
+    }
+    std::string modelfile = argv[1];
+    std::string source = argv[2];
+    int iterations = 200;
+    int warmup = 20;
+    int threads = tbb::task_arena::automatic;
+    std::string profile = "balanced";
+    int refresh = 1;
+    cv::Size frame_size(960, 720);
+    int max_frames = 100;
+    std::string trace_path;
+    bool perf = false;
+    bool yuv = false;
+    std::vector<std::string> extra_models;
+    for (int i = 3; i + 1 < argc; i += 2) {
+        std::string opt = argv[i];
+        std::string val = argv[i + 1];
+        if (opt == "--iterations") {
+            iterations = std::stoi(val);
+        } else if (opt == "--warmup") {
+            warmup = std::stoi(val);
+        } else if (opt == "--threads") {
+            threads = std::stoi(val);
+        } else if (opt == "--profile") {
+            profile = val;
+        } else if (opt == "--refresh") {
+            refresh = std::stoi(val);
+        } else if (opt == "--size") {
+            sscanf(val.c_str(), "%dx%d", &frame_size.width,
+                    &frame_size.height);
+        } else if (opt == "--max-frames") {
+            max_frames = std::stoi(val);
+        } else if (opt == "--trace") {
+            trace_path = val;
+        } else if (opt == "--perf") {
+            perf = std::stoi(val) != 0;
+        } else if (opt == "--yuv") {
+            yuv = std::stoi(val) != 0;
+        } else if (opt == "--extra-model") {
+            extra_models.push_back(val);
+        } else {
+            std::cout << "Unknown option " << opt << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<cv::Mat> frames = loadFrames(source, frame_size, max_frames);
+    if (frames.empty()) {
+        std::cout << "No frame loaded from " << source << std::endl;
+        return 1;
+    }
+    // OpenCV输出有限范围的I420, 与PyramidOptions::yuv_full_range的默认值一致
+    if (yuv) {
+        for (cv::Mat &frame : frames) {
+            cv::Mat i420;
+            cv::cvtColor(frame, i420, cv::COLOR_BGR2YUV_I420);
+            frame = i420;
+        }
+    }
+
+    // 指定了附加模型时所有模型共用一个特征金字塔
+    ACFDetector *detector = NULL;
+    ACFMultiDetector *multi_detector = NULL;
+    std::vector<std::string> model_names;
+    if (extra_models.empty()) {
+        detector = new ACFDetector(modelfile);
+        if (!detector->getModel()->isLoaded()) {
+            delete detector;
+            return 1;
+        }
+        detector->pyramid_options = PyramidOptions::fromProfile(profile);
+        detector->max_refresh_period = refresh;
+        model_names.push_back(detector->getModel()->name);
+    } else {
+        multi_detector = new ACFMultiDetector();
+        extra_models.insert(extra_models.begin(), modelfile);
+        for (const std::string &path : extra_models) {
+            if (!multi_detector->addModel(path)) {
+                std::cout << "Cannot add model " << path << std::endl;
+                delete multi_detector;
+                return 1;
+            }
+            model_names.push_back(multi_detector->getDetector(
+                    model_names.size()).getModel()->name);
+        }
+        multi_detector->pyramid_options = PyramidOptions::fromProfile(
+                profile);
+        multi_detector->max_refresh_period = refresh;
+    }
+
+    // 各阶段每帧的耗时(ms)
+    std::map<std::string, std::vector<double>> stages;
+    std::vector<long> n_detections(model_names.size(), 0);
+    ACFFeaturePyramid *pyramid = NULL;
+
+    TraceRecorder::setEnabled(!trace_path.empty());
+    if (perf) {
+        PerfCounters::setEnabled(true);
+    }
+
+    tbb::task_arena arena(threads);
+    arena.execute([&]() {
+        for (int i = 0; i < warmup + iterations; i++) {
+            const cv::Mat &frame = frames[i % frames.size()];
+
+            TraceScope trace_frame("frame");
+            auto measure_time = std::chrono::steady_clock::now();
+            std::vector<DetectionList> dets;
+            if (multi_detector) {
+                dets = multi_detector->applyDetectors(frame);
+            } else {
+                dets.push_back(detector->applyDetector(frame));
+            }
+            auto detect_time = std::chrono::steady_clock::now();
+            std::vector<int> n_frame_detections;
+            for (DetectionList &model_dets : dets) {
+                n_frame_detections.push_back(
+                        NonMaximumSuppression::dollarNMS(model_dets).getSize());
+            }
+            auto nms_time = std::chrono::steady_clock::now();
+
+            if (i < warmup) {
+                // 预热帧不计入计数器统计
+                PerfCounters::resetAll();
+                continue;
+            }
+
+            // 各层的特征计算耗时, 本帧未调度的层不计入
+            pyramid = multi_detector ?
+                    multi_detector->feature_pyramid : detector->feature_pyramid;
+            int64_t init = 0, smooth = 0, pad = 0;
+            for (int L = 0; L < pyramid->getAmount(); L++) {
+                if (pyramid->isLayerFresh(L)) {
+                    init += pyramid->getLayer(L)->init_ns;
+                    smooth += pyramid->getLayer(L)->smooth_ns;
+                    pad += pyramid->getLayer(L)->pad_ns;
+                }
+            }
+            stages["pre"].push_back(pyramid->pre_ns / 1e6);
+            stages["layer init"].push_back(init / 1e6);
+            stages["layer smooth"].push_back(smooth / 1e6);
+            stages["layer pad"].push_back(pad / 1e6);
+            stages["features"].push_back(multi_detector ?
+                    multi_detector->calc_feature_ms : detector->calc_feature_ms);
+            stages["classifier"].push_back(multi_detector ?
+                    multi_detector->apply_classifier_ms :
+                    detector->apply_classifier_ms);
+            stages["detect"].push_back(
+                    std::chrono::duration<double, std::milli>(
+                            detect_time - measure_time).count());
+            stages["nms"].push_back(
+                    std::chrono::duration<double, std::milli>(
+                            nms_time - detect_time).count());
+            stages["total"].push_back(
+                    std::chrono::duration<double, std::milli>(
+                            nms_time - measure_time).count());
+            for (size_t m = 0; m < n_frame_detections.size(); m++) {
+                n_detections[m] += n_frame_detections[m];
+            }
+        }
+    });
+
+    std::cout << "Frames:      " << frames.size() << " (" << frame_size.width
+            << "x" << frame_size.height << "), " << iterations
+            << " iterations after " << warmup << " warm-up" << std::endl;
+    std::cout << "Threads:     "
+            << (threads == tbb::task_arena::automatic ?
+                    std::string("auto") : std::to_string(threads))
+            << ", profile " << profile << ", refresh " << refresh
+            << (yuv ? ", I420 input" : "") << std::endl;
+    if (pyramid) {
+        std::cout << "Pyramid:     " << pyramid->getAmount() << " layers ("
+                << pyramid->getRealScaleCount() << " real)" << std::endl;
+    }
+    for (size_t m = 0; m < model_names.size(); m++) {
+        std::cout << "Detections:  " << (double) n_detections[m] / iterations
+                << " per frame";
+        if (multi_detector) {
+            std::cout << " (" << model_names[m] << ")";
+        }
+        std::cout << std::endl;
+    }
+    std::cout << "Stage (ms, layer stages summed over layers)" << std::endl;
+    std::cout << std::setw(14) << std::left << "stage" << std::right
+            << std::setw(10) << "min" << std::setw(10) << "median"
+            << std::setw(10) << "p99" << std::endl;
+    std::cout << std::fixed << std::setprecision(2);
+    for (const char *name : { "pre", "layer init", "layer smooth",
+            "layer pad", "features", "classifier", "detect", "nms", "total" }) {
+        const std::vector<double> &values = stages[name];
+        std::cout << std::setw(14) << std::left << name << std::right
+                << std::setw(10) << percentile(values, 0)
+                << std::setw(10) << percentile(values, 0.5)
+                << std::setw(10) << percentile(values, 0.99) << std::endl;
+    }
+
+    if (PerfCounters::isEnabled()) {
+        std::cout << std::endl << "Hardware counters (units: pixels, "
+                "windows for cascade)" << std::endl;
+        PerfCounters::print();
+    }
+
+    if (!trace_path.empty()) {
+        TraceRecorder::dump(trace_path);
+    }
+    delete detector;
+    delete multi_detector;
+    return 0;
+}
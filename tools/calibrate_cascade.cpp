@@ -0,0 +1,177 @@
+/*
+ * calibrate_cascade.cpp
+ *
+ * 离线标定逐树拒绝阈值轨迹(soft cascade, 参考Bourdev & Brandt, Zhang & Viola).
+ * 将正样本逐一送入检测器的所有决策树, 记录每棵树之后的累计得分, 取保留正样本
+ * 在每棵树处的最小累计得分作为该树的拒绝阈值, 写入与模型同名的.trace文件.
+ *
+ * 用法: acf_calibrate <model.mat> <positives_dir> <negatives_dir> [recall] [window_step]
+ *   positives_dir  正样本图片, 会被缩放至模型的modelDsPad尺寸
+ *   negatives_dir  不含目标的图片, 用于统计每个窗口平均评估的树的数量
+ *   recall         标定时保留的正样本比例, 默认1.0
+ *   window_step    负样本窗口的采样间隔, 默认4
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <opencv2/opencv.hpp>
+
+#include "../acf/ACFDetector.h"
+#include "../acf/ACFFeaturePyramid.h"
+
+static std::vector<std::string> listImages(const std::string &dir) {
+    std::vector<cv::String> files;
+    cv::glob(dir + "/*", files, false);
+    return std::vector<std::string>(files.begin(), files.end());
+}
+
+// 窗口在给定逐树拒绝阈值下评估的树的数量
+static int countTrees(const std::vector<float> &trace,
+        const std::vector<float> &rejection) {
+    for (int t = 0; t < trace.size(); t++) {
+        if (trace[t] <= rejection[t]) {
+            return t + 1;
+        }
+    }
+    return trace.size();
+}
+
+static bool passes(const std::vector<float> &trace,
+        const std::vector<float> &rejection) {
+    return countTrees(trace, rejection) == trace.size()
+            && trace.back() > rejection.back();
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        std::cout << "usage: " << argv[0]
+                << " <model.mat> <positives_dir> <negatives_dir> [recall] [window_step]"
+                << std::endl;
+        return 1;
+    }
+    std::string modelfile = argv[1];
+    float recall = argc > 4 ? std::stof(argv[4]) : 1.0f;
+    int window_step = argc > 5 ? std::stoi(argv[5]) : 4;
+
+    ACFDetector detector(modelfile);
+    std::shared_ptr<const ACFModel> model = detector.getModel();
+    int n_trees = detector.getTreeCount();
+    float cascThr = detector.getCascadeThreshold();
+    int shrink = detector.getShrinking();
+    cv::Size model_size(detector.getWidth(), detector.getHeight());
+    cv::Size model_size_pad(detector.getWidthPad(), detector.getHeightPad());
+
+    // 计算所有正样本的累计得分轨迹
+    std::vector<std::vector<float>> pos_traces;
+    for (const std::string &file : listImages(argv[2])) {
+        cv::Mat image = cv::imread(file, cv::IMREAD_COLOR);
+        if (image.empty()) {
+            continue;
+        }
+        cv::Mat sample;
+        cv::resize(image, sample, model_size_pad);
+        // 窗口与图像等大, 不填充, 金字塔仅有一层且只有一个窗口
+        ACFFeaturePyramid pyramid(sample, PyramidOptions(), model_size_pad,
+                shrink, model->lambdas, 0, 0);
+        pos_traces.push_back(detector.traceWindow(pyramid.getLayer(0), 0, 0));
+    }
+
+    // 只有原级联能检出的正样本参与标定, 按最终得分保留recall比例
+    std::vector<float> base_rejection(n_trees, cascThr);
+    std::vector<const std::vector<float>*> kept;
+    for (const auto &trace : pos_traces) {
+        if (passes(trace, base_rejection)) {
+            kept.push_back(&trace);
+        }
+    }
+    if (kept.empty()) {
+        std::cout << "No positive sample passes the cascade" << std::endl;
+        return 1;
+    }
+    std::sort(kept.begin(), kept.end(),
+            [](const std::vector<float> *a, const std::vector<float> *b) {
+                return a->back() > b->back();
+            });
+    kept.resize(std::max<size_t>(1, std::ceil(recall * kept.size())));
+
+    // 每棵树的拒绝阈值取保留正样本累计得分的最小值(略小, 保证其全部通过)
+    std::vector<float> trace(n_trees, std::numeric_limits<float>::max());
+    for (const std::vector<float> *pos : kept) {
+        for (int t = 0; t < n_trees; t++) {
+            trace[t] = std::min(trace[t], (*pos)[t]);
+        }
+    }
+    std::vector<float> rejection(n_trees);
+    for (int t = 0; t < n_trees; t++) {
+        trace[t] = std::nextafter(trace[t],
+                -std::numeric_limits<float>::infinity());
+        rejection[t] = std::max(cascThr, trace[t]);
+    }
+
+    int n_pos_base = 0, n_pos_calibrated = 0;
+    for (const auto &pos : pos_traces) {
+        n_pos_base += passes(pos, base_rejection);
+        n_pos_calibrated += passes(pos, rejection);
+    }
+
+    // 在负样本上统计每个窗口平均评估的树的数量
+    long n_windows = 0, n_trees_base = 0, n_trees_calibrated = 0;
+    long n_fp_base = 0, n_fp_calibrated = 0;
+    for (const std::string &file : listImages(argv[3])) {
+        cv::Mat image = cv::imread(file, cv::IMREAD_COLOR);
+        if (image.empty() || image.cols < model_size.width
+                || image.rows < model_size.height) {
+            continue;
+        }
+        ACFFeaturePyramid pyramid(image, detector.pyramid_options,
+                model_size, shrink, model->lambdas, model->pad_width,
+                model->pad_height);
+        for (int i = 0; i < pyramid.getAmount(); i++) {
+            ChannelFeatures *layer = pyramid.getLayer(i);
+            int height1 = std::ceil(static_cast<float>(
+                    layer->getChannelHeight() * shrink
+                            - model_size_pad.height + 1) / shrink);
+            int width1 = std::ceil(static_cast<float>(
+                    layer->getChannelWidth() * shrink - model_size_pad.width
+                            + 1) / shrink);
+            for (int c = 0; c < width1; c += window_step) {
+                for (int r = 0; r < height1; r += window_step) {
+                    std::vector<float> neg = detector.traceWindow(layer, r, c);
+                    n_windows++;
+                    n_trees_base += countTrees(neg, base_rejection);
+                    n_trees_calibrated += countTrees(neg, rejection);
+                    n_fp_base += passes(neg, base_rejection);
+                    n_fp_calibrated += passes(neg, rejection);
+                }
+            }
+        }
+    }
+
+    std::string tracefile = ACFModel::getRejectionTracePath(modelfile);
+    if (!ACFModel::WriteRejectionTrace(tracefile, trace)) {
+        std::cout << "Failed to write " << tracefile << std::endl;
+        return 1;
+    }
+
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "Positives:            " << pos_traces.size() << " (kept "
+            << kept.size() << ")" << std::endl;
+    std::cout << "Positives detected:   " << n_pos_base << " -> "
+            << n_pos_calibrated << std::endl;
+    std::cout << "Negative windows:     " << n_windows << std::endl;
+    if (n_windows > 0) {
+        std::cout << "Trees per window:     "
+                << (double) n_trees_base / n_windows << " -> "
+                << (double) n_trees_calibrated / n_windows << std::endl;
+        std::cout << "False positives:      " << n_fp_base << " -> "
+                << n_fp_calibrated << std::endl;
+    }
+    std::cout << "Trace saved to " << tracefile << std::endl;
+    return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * convert_model.cpp
+ *
+ * 将Piotr toolbox导出的.mat检测器模型转换为可直接mmap的.acfm二进制格式.
+ * 若模型旁存在同名的.trace拒绝阈值轨迹文件, 一并写入.acfm文件.
+ *
+ * 用法: acf_convert_model <model.mat> [model.acfm]
+ *   model.acfm  输出文件, 默认与输入文件同名, 扩展名为.acfm
+ */
+
+#include <iostream>
+#include <string>
+
+#include "../acf/ACFModel.h"
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cout << "usage: " << argv[0] << " <model.mat> [model.acfm]"
+                << std::endl;
+        return 1;
+    }
+    std::string modelfile = argv[1];
+    std::string outfile;
+    if (argc > 2) {
+        outfile = argv[2];
+    } else {
+        size_t dot = modelfile.find_last_of('.');
+        size_t slash = modelfile.find_last_of('/');
+        if (dot != std::string::npos
+                && (slash == std::string::npos || dot > slash)) {
+            outfile = modelfile.substr(0, dot) + ".acfm";
+        } else {
+            outfile = modelfile + ".acfm";
+        }
+    }
+
+    ACFModel model(modelfile);
+    if (!model.isLoaded()) {
+        std::cout << "Failed to load " << modelfile << std::endl;
+        return 1;
+    }
+    if (!model.Write(outfile)) {
+        std::cout << "Failed to write " << outfile << std::endl;
+        return 1;
+    }
+
+    // 重新映射输出文件, 校验格式
+    ACFModel mapped(outfile);
+    if (!mapped.isLoaded() || mapped.nTrees != model.nTrees) {
+        std::cout << "Failed to verify " << outfile << std::endl;
+        return 1;
+    }
+    std::cout << "Model saved to " << outfile << std::endl;
+    return 0;
+}
@@ -0,0 +1,348 @@
+/*
+ * golden.cpp
+ *
+ * 特征计算和检测结果的一致性检查. capture模式用当前实现计算一组固定图片的各阶段输出
+ * 并保存为参考数据; check模式用新实现重新计算, 与参考数据逐阶段比较, 报告最大和平均误差.
+ * 修改SIMD实现, 数据排列或量化方式后, 用于确认检测结果没有被悄悄改变.
+ *
+ * 比较的阶段(均为原图尺寸, 即金字塔的第0层, 除chns外):
+ *   luv          LUV颜色平面
+ *   grad_mag     梯度幅值(归一化后)
+ *   grad_orient  梯度方向
+ *   grad_hist    梯度方向直方图(bin = shrink)
+ *   chns         金字塔各层填充后的特征图
+ *   detections   NMS后的检测结果, 按IoU匹配
+ *
+ * 用法:
+ *   acf_golden capture <model> <images_dir> <golden_dir>
+ *   acf_golden check <model> <images_dir> <golden_dir> [options]
+ *     --tol STAGE=V      阶段的最大绝对误差(STAGE为all时设置全部阶段), 默认1e-4
+ *     --iou V            检测结果匹配的IoU阈值, 默认0.5
+ *     --score-tol V      匹配的检测结果得分的最大误差, 默认1e-3
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cmath>
+
+#include <opencv2/opencv.hpp>
+
+#include "../acf/ACFDetector.h"
+#include "../acf/ACFFeaturePyramid.h"
+#include "../acf/ColorChannel.h"
+#include "../acf/GradMagChannel.h"
+#include "../acf/GradHistChannel.h"
+#include "../general/NonMaximumSuppression.h"
+
+// 一张图片的各阶段输出, 阶段名 -> 数据
+typedef std::map<std::string, std::vector<float>> StageOutputs;
+
+struct Box {
+    float x, y, width, height, score;
+};
+
+static void addStage(StageOutputs &outputs, const std::string &name,
+        const float *data, size_t n) {
+    outputs[name].assign(data, data + n);
+}
+
+// 用当前实现计算一张图片的各阶段输出
+static void computeOutputs(ACFDetector &detector, const cv::Mat &image,
+        StageOutputs &outputs, std::vector<Box> &boxes) {
+    int w = image.cols, h = image.rows;
+    int shrink = detector.getShrinking();
+
+    float *luv = ACFFeaturePyramid::convertToLuv(image);
+    addStage(outputs, "luv", luv, (size_t) w * h * 3);
+
+    ColorChannel color_channel(luv, w, h);
+    GradMagChannel grad_mag_channel(color_channel);
+    addStage(outputs, "grad_mag", grad_mag_channel.getMagnitude(),
+            (size_t) w * h);
+    addStage(outputs, "grad_orient", grad_mag_channel.getOrientation(),
+            (size_t) w * h);
+    {
+        GradHistChannel grad_hist_channel(grad_mag_channel, shrink);
+        addStage(outputs, "grad_hist", grad_hist_channel.getData(),
+                (size_t) grad_hist_channel.getWidth()
+                        * grad_hist_channel.getHeight()
+                        * grad_hist_channel.getnChns());
+        // 通道数据的释放由外部负责
+        free(grad_hist_channel.getData());
+    }
+    free(grad_mag_channel.getData());
+    free(luv);
+
+    // 每帧计算全部尺度, 使各层均有输出
+    DetectionList dets = detector.applyDetector(image);
+    ACFFeaturePyramid *pyramid = detector.feature_pyramid;
+    for (int L = 0; L < pyramid->getAmount(); L++) {
+        ChannelFeatures *layer = pyramid->getLayer(L);
+        addStage(outputs, "chns." + std::to_string(L), layer->chns,
+                (size_t) layer->getChannelWidth() * layer->getChannelHeight()
+                        * layer->getnChannels());
+    }
+
+    DetectionList nms_dets = NonMaximumSuppression::dollarNMS(dets);
+    for (const Detection &det : nms_dets.detections) {
+        boxes.push_back( { det.getX(), det.getY(), det.getWidth(),
+                det.getHeight(), det.getScore() });
+    }
+}
+
+// 参考数据格式: 阶段数, 之后每个阶段为名称长度, 名称, 元素数量, float数组;
+// 最后为检测结果数量及各检测结果的x, y, width, height, score
+static bool writeGolden(const std::string &file, const StageOutputs &outputs,
+        const std::vector<Box> &boxes) {
+    std::ofstream out(file, std::ios::binary);
+    uint32_t n_stages = outputs.size();
+    out.write((const char *) &n_stages, sizeof(n_stages));
+    for (const auto &stage : outputs) {
+        uint32_t name_size = stage.first.size();
+        uint64_t n = stage.second.size();
+        out.write((const char *) &name_size, sizeof(name_size));
+        out.write(stage.first.data(), name_size);
+        out.write((const char *) &n, sizeof(n));
+        out.write((const char *) stage.second.data(), n * sizeof(float));
+    }
+    uint32_t n_boxes = boxes.size();
+    out.write((const char *) &n_boxes, sizeof(n_boxes));
+    out.write((const char *) boxes.data(), n_boxes * sizeof(Box));
+    return static_cast<bool>(out);
+}
+
+static bool readGolden(const std::string &file, StageOutputs &outputs,
+        std::vector<Box> &boxes) {
+    std::ifstream in(file, std::ios::binary);
+    uint32_t n_stages = 0;
+    if (!in.read((char *) &n_stages, sizeof(n_stages))) {
+        return false;
+    }
+    for (uint32_t i = 0; i < n_stages; i++) {
+        uint32_t name_size = 0;
+        uint64_t n = 0;
+        in.read((char *) &name_size, sizeof(name_size));
+        std::string name(name_size, '\0');
+        in.read(&name[0], name_size);
+        in.read((char *) &n, sizeof(n));
+        if (!in) {
+            return false;
+        }
+        std::vector<float> &data = outputs[name];
+        data.resize(n);
+        in.read((char *) data.data(), n * sizeof(float));
+    }
+    uint32_t n_boxes = 0;
+    in.read((char *) &n_boxes, sizeof(n_boxes));
+    boxes.resize(n_boxes);
+    in.read((char *) boxes.data(), n_boxes * sizeof(Box));
+    return static_cast<bool>(in);
+}
+
+static float iou(const Box &a, const Box &b) {
+    float x0 = std::max(a.x, b.x), y0 = std::max(a.y, b.y);
+    float x1 = std::min(a.x + a.width, b.x + b.width);
+    float y1 = std::min(a.y + a.height, b.y + b.height);
+    float inter = std::max(0.0f, x1 - x0) * std::max(0.0f, y1 - y0);
+    float uni = a.width * a.height + b.width * b.height - inter;
+    return uni > 0 ? inter / uni : 0;
+}
+
+// 金字塔各层的chns汇总为一个阶段进行统计
+static std::string stageGroup(const std::string &name) {
+    return name.substr(0, name.find('.'));
+}
+
+struct StageError {
+    double max_error = 0;
+    double sum_error = 0;
+    uint64_t count = 0;
+    uint64_t non_finite = 0;    // 误差为NaN或无穷的元素数
+    bool size_mismatch = false;
+};
+
+int main(int argc, char **argv) {
+    if (argc < 5 || (std::string(argv[1]) != "capture"
+            && std::string(argv[1]) != "check")) {
+        std::cout << "usage: " << argv[0]
+                << " capture|check <model> <images_dir> <golden_dir>"
+                        " [--tol STAGE=V] [--iou V] [--score-tol V]"
+                << std::endl;
+        return 1;
+    }
+    bool capture = std::string(argv[1]) == "capture";
+    std::string golden_dir = argv[4];
+
+    std::map<std::string, double> tolerances;
+    for (const char *stage : { "luv", "grad_mag", "grad_orient", "grad_hist",
+            "chns" }) {
+        tolerances[stage] = 1e-4;
+    }
+    float iou_threshold = 0.5f;
+    float score_tolerance = 1e-3f;
+    for (int i = 5; i + 1 < argc; i += 2) {
+        std::string opt = argv[i];
+        std::string val = argv[i + 1];
+        if (opt == "--tol") {
+            size_t eq = val.find('=');
+            std::string stage = val.substr(0, eq);
+            double tol = std::stod(val.substr(eq + 1));
+            for (auto &t : tolerances) {
+                if (stage == "all" || stage == t.first) {
+                    t.second = tol;
+                }
+            }
+        } else if (opt == "--iou") {
+            iou_threshold = std::stof(val);
+        } else if (opt == "--score-tol") {
+            score_tolerance = std::stof(val);
+        } else {
+            std::cout << "Unknown option " << opt << std::endl;
+            return 1;
+        }
+    }
+
+    ACFDetector detector(argv[2]);
+    if (!detector.getModel()->isLoaded()) {
+        return 1;
+    }
+    detector.max_refresh_period = 1;
+
+    std::vector<cv::String> files;
+    cv::glob(std::string(argv[3]) + "/*", files, false);
+
+    std::map<std::string, StageError> errors;
+    int n_images = 0, n_ref_boxes = 0, n_matched = 0, n_extra = 0;
+    int n_score_errors = 0;
+    double max_score_error = 0;
+    bool failed = false;
+    for (const std::string &file : files) {
+        cv::Mat image = cv::imread(file, cv::IMREAD_COLOR);
+        if (image.empty()) {
+            continue;
+        }
+        std::string name = file.substr(file.find_last_of('/') + 1);
+        std::string golden_file = golden_dir + "/" + name + ".golden";
+
+        StageOutputs outputs;
+        std::vector<Box> boxes;
+        computeOutputs(detector, image, outputs, boxes);
+        n_images++;
+
+        if (capture) {
+            if (!writeGolden(golden_file, outputs, boxes)) {
+                std::cout << "Failed to write " << golden_file << std::endl;
+                return 1;
+            }
+            continue;
+        }
+
+        StageOutputs ref_outputs;
+        std::vector<Box> ref_boxes;
+        if (!readGolden(golden_file, ref_outputs, ref_boxes)) {
+            std::cout << "Failed to read " << golden_file << std::endl;
+            failed = true;
+            continue;
+        }
+
+        // 逐阶段比较, 层数或尺寸不一致时该阶段失败
+        for (const auto &ref : ref_outputs) {
+            StageError &error = errors[stageGroup(ref.first)];
+            auto it = outputs.find(ref.first);
+            if (it == outputs.end() || it->second.size() != ref.second.size()) {
+                error.size_mismatch = true;
+                continue;
+            }
+            for (size_t i = 0; i < ref.second.size(); i++) {
+                // std::max会忽略NaN, 非有限的误差(任一侧为NaN或无穷)单独计数并判为失败
+                if (it->second[i] == ref.second[i]) {
+                    continue;
+                }
+                double e = std::abs((double) it->second[i] - ref.second[i]);
+                if (!std::isfinite(e)) {
+                    error.max_error = INFINITY;
+                    error.non_finite++;
+                    continue;
+                }
+                error.max_error = std::max(error.max_error, e);
+                error.sum_error += e;
+            }
+            error.count += ref.second.size();
+        }
+        for (const auto &out : outputs) {
+            if (ref_outputs.find(out.first) == ref_outputs.end()) {
+                errors[stageGroup(out.first)].size_mismatch = true;
+            }
+        }
+
+        // 检测结果按得分从高到低贪心匹配
+        std::sort(ref_boxes.begin(), ref_boxes.end(),
+                [](const Box &a, const Box &b) {
+                    return a.score > b.score;
+                });
+        std::vector<bool> used(boxes.size(), false);
+        for (const Box &ref : ref_boxes) {
+            int best = -1;
+            float best_iou = iou_threshold;
+            for (size_t j = 0; j < boxes.size(); j++) {
+                float overlap = iou(ref, boxes[j]);
+                if (!used[j] && overlap >= best_iou) {
+                    best = j;
+                    best_iou = overlap;
+                }
+            }
+            if (best >= 0) {
+                used[best] = true;
+                n_matched++;
+                float score_error = std::abs(ref.score - boxes[best].score);
+                max_score_error = std::isfinite(score_error) ?
+                        std::max(max_score_error, (double) score_error) :
+                        INFINITY;
+                n_score_errors += !(score_error <= score_tolerance);
+            }
+        }
+        n_ref_boxes += ref_boxes.size();
+        n_extra += std::count(used.begin(), used.end(), false);
+    }
+
+    if (capture) {
+        std::cout << "Captured " << n_images << " images to " << golden_dir
+                << std::endl;
+        return 0;
+    }
+
+    std::cout << "Images: " << n_images << std::endl;
+    std::cout << std::setw(12) << std::left << "stage" << std::right
+            << std::setw(14) << "max error" << std::setw(14) << "mean error"
+            << std::setw(12) << "tolerance" << std::setw(12) << "non-finite"
+            << "  result" << std::endl;
+    for (const auto &t : tolerances) {
+        const StageError &error = errors[t.first];
+        bool pass = !error.size_mismatch && error.non_finite == 0
+                && error.max_error <= t.second;
+        failed = failed || !pass;
+        std::cout << std::setw(12) << std::left << t.first << std::right
+                << std::scientific << std::setprecision(3)
+                << std::setw(14) << error.max_error << std::setw(14)
+                << (error.count ? error.sum_error / error.count : 0.0)
+                << std::setw(12) << t.second << std::setw(12)
+                << error.non_finite << "  "
+                << (error.size_mismatch ?
+                        "FAIL (size mismatch)" : (pass ? "ok" : "FAIL"))
+                << std::endl;
+    }
+    bool dets_pass = n_matched == n_ref_boxes && n_extra == 0
+            && n_score_errors == 0;
+    failed = failed || !dets_pass;
+    std::cout << "detections: " << n_matched << "/" << n_ref_boxes
+            << " matched (IoU >= " << std::fixed << std::setprecision(2)
+            << iou_threshold << "), " << n_extra << " extra, max score error "
+            << std::scientific << std::setprecision(3) << max_score_error
+            << "  " << (dets_pass ? "ok" : "FAIL") << std::endl;
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,341 @@
+/*
+ * kernel_bench.cpp
+ *
+ * low-level/中各个函数的微基准测试. 参数与特征计算中的调用一致:
+ *   rgb2luv_sse         整幅图像, 对比cv::cvtColor(BGR->Luv, float)
+ *   yuv2luv_sse         I420整幅图像(含转置和色度上采样), 对比BGR帧的转置+拆分通道+rgb2luv_sse
+ *   gradMag             L通道, 对比cv::Sobel + cv::cartToPolar
+ *   convTri(r=5)        梯度幅值归一化系数, 对比cv::sepFilter2D
+ *   gradMagNorm         对比cv::divide
+ *   gradQuantize        逐列调用, 对比标量实现
+ *   gradHist(bin=shrink)对比标量实现
+ *   convTri1(p=2)       shrink后的通道平滑, 对比cv::sepFilter2D
+ * 数据按列存储(与特征计算一致), OpenCV对比项使用转置的cv::Mat, 仅用于比较吞吐量.
+ *
+ * 用法: acf_kernel_bench [--json out.json] [--min-time ms] [image]
+ *   image  用于测试的图片, 默认使用随机图像
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <chrono>
+#include <cstring>
+#include <cmath>
+
+#include <opencv2/opencv.hpp>
+
+#include "../low-level/Functions.h"
+
+struct BenchResult {
+    std::string kernel;
+    cv::Size size;
+    int shrink;
+    double pixels;      // 每次调用处理的像素数
+    double bytes;       // 每次调用读写的字节数
+    double ns;          // 每次调用耗时的中位数
+    double ref_ns;      // 对比实现每次调用耗时的中位数
+};
+
+static double min_time_ms = 200;
+
+// 重复调用直到总耗时超过min_time_ms(至少5次), 返回单次耗时的中位数(ns)
+static double measure(const std::function<void()> &func) {
+    func();
+    std::vector<double> times;
+    double total = 0;
+    while (times.size() < 5 || total < min_time_ms * 1e6) {
+        auto start = std::chrono::steady_clock::now();
+        func();
+        double ns = std::chrono::duration<double, std::nano>(
+                std::chrono::steady_clock::now() - start).count();
+        times.push_back(ns);
+        total += ns;
+    }
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+static float* alignedFloats(size_t n) {
+    float *p = (float *) aligned_alloc(16, ((n * sizeof(float) + 15) / 16) * 16);
+    if (p == NULL) {
+        throw std::runtime_error("Failed to aligned_alloc");
+    }
+    memset(p, 0, n * sizeof(float));
+    return p;
+}
+
+// gradQuantize的标量实现(与其SSE主循环之后的尾部处理一致)
+static void gradQuantizeScalar(const float *orientation, const float *magnitude,
+        int *O0, int *O1, float *M0, float *M1, int n_blocks, int n,
+        float norm, int n_orients) {
+    const float rad_to_orient = (float) n_orients / 3.14159265f;
+    const int oMax = n_orients * n_blocks;
+    for (int i = 0; i < n; i++) {
+        float o = orientation[i] * rad_to_orient;
+        o = std::min(std::max(o, 0.0f), n_orients - 0.001f);
+        int o0 = (int) o;
+        float od = o - o0;
+        o0 *= n_blocks;
+        O0[i] = o0;
+        O1[i] = (o0 + n_blocks) % oMax;
+        float m = magnitude[i] * norm;
+        M1[i] = od * m;
+        M0[i] = m - M1[i];
+    }
+}
+
+// gradHist的标量实现: 仅在方向上内插, 每个bin x bin区域累加
+static void gradHistScalar(const float *magnitude, const float *orientation,
+        float *histogram, int h, int w, int bin, int n_orients) {
+    int hb = h / bin, wb = w / bin, n_blocks = hb * wb;
+    const float rad_to_orient = (float) n_orients / 3.14159265f;
+    const float norm = 1.0f / bin / bin;
+    for (int x = 0; x < wb * bin; x++) {
+        for (int y = 0; y < hb * bin; y++) {
+            float o = orientation[x * h + y] * rad_to_orient;
+            o = std::min(std::max(o, 0.0f), n_orients - 0.001f);
+            int o0 = (int) o;
+            float od = o - o0;
+            int o1 = (o0 + 1) % n_orients;
+            float m = magnitude[x * h + y] * norm;
+            float *cell = histogram + (x / bin) * hb + y / bin;
+            cell[o0 * n_blocks] += m - od * m;
+            cell[o1 * n_blocks] += od * m;
+        }
+    }
+}
+
+static cv::Mat triangleKernel(int r) {
+    cv::Mat kernel(1, 2 * r + 1, CV_32F);
+    for (int i = -r; i <= r; i++) {
+        kernel.at<float>(0, i + r) = r + 1 - std::abs(i);
+    }
+    return kernel / cv::sum(kernel)[0];
+}
+
+static std::vector<BenchResult> benchSize(const cv::Mat &source,
+        cv::Size size) {
+    std::vector<BenchResult> results;
+    int w = size.width, h = size.height, n = w * h;
+
+    cv::Mat bgr;
+    cv::resize(source, bgr, size);
+
+    // 按列存储的R, G, B平面(与ACFFeaturePyramid一致)
+    uint8_t *rgb = (uint8_t *) aligned_alloc(16, n * 3);
+    cv::Mat transposed;
+    cv::transpose(bgr, transposed);
+    cv::Mat planes[3] = { cv::Mat(w, h, CV_8UC1, rgb + 2 * n), cv::Mat(w, h,
+            CV_8UC1, rgb + n), cv::Mat(w, h, CV_8UC1, rgb) };
+    cv::split(transposed, planes);
+
+    float *luv = alignedFloats(n * 3);
+    float *M = alignedFloats(n);
+    float *O = alignedFloats(n);
+    float *S = alignedFloats(n);
+    float *M_copy = alignedFloats(n);
+
+    // rgb2luv_sse
+    cv::Mat bgr_float, luv_ref;
+    bgr.convertTo(bgr_float, CV_32FC3, 1.0 / 255);
+    results.push_back( { "rgb2luv_sse", size, 1, (double) n,
+            n * (3.0 + 3 * sizeof(float)), measure([&]() {
+                rgb2luv_sse(rgb, luv, n, 1.0f / 255);
+            }), measure([&]() {
+                cv::cvtColor(bgr_float, luv_ref, cv::COLOR_BGR2Luv);
+            }) });
+
+    // yuv2luv_sse, 对比RGB采集时金字塔的预处理(ACFFeaturePyramid::convertToLuv)
+    cv::Mat i420;
+    cv::cvtColor(bgr, i420, cv::COLOR_BGR2YUV_I420);
+    results.push_back( { "yuv2luv_sse", size, 1, (double) n,
+            n * (1.5 + 3 * sizeof(float)), measure([&]() {
+                yuv2luv_sse(i420.data, i420.data + n, i420.data + n * 5 / 4,
+                        luv, w, h, 1.0f / 255);
+            }), measure([&]() {
+                cv::transpose(bgr, transposed);
+                cv::split(transposed, planes);
+                rgb2luv_sse(rgb, luv, n, 1.0f / 255);
+            }) });
+
+    // gradMag, 仅L通道
+    cv::Mat L(w, h, CV_32FC1, luv), gx, gy, mag_ref, angle_ref;
+    results.push_back( { "gradMag", size, 1, (double) n,
+            n * 3.0 * sizeof(float), measure([&]() {
+                gradMag(luv, M, O, h, w, 1, false);
+            }), measure([&]() {
+                cv::Sobel(L, gx, CV_32F, 1, 0);
+                cv::Sobel(L, gy, CV_32F, 0, 1);
+                cv::cartToPolar(gx, gy, mag_ref, angle_ref);
+            }) });
+
+    // convTri, 半径5
+    cv::Mat mag(w, h, CV_32FC1, M), smooth_ref;
+    cv::Mat tri5 = triangleKernel(5);
+    results.push_back( { "convTri(r=5)", size, 1, (double) n,
+            n * 2.0 * sizeof(float), measure([&]() {
+                convTri(M, S, h, w, 1, 5, 1);
+            }), measure([&]() {
+                cv::sepFilter2D(mag, smooth_ref, CV_32F, tri5, tri5);
+            }) });
+
+    // gradMagNorm, 原地修改, 每次调用前恢复输入, 结果减去单独测得的拷贝耗时
+    memcpy(M_copy, M, n * sizeof(float));
+    double restore_ns = measure([&]() {
+        memcpy(M, M_copy, n * sizeof(float));
+    });
+    cv::Mat norm_mat(w, h, CV_32FC1, S), norm_ref;
+    results.push_back( { "gradMagNorm", size, 1, (double) n,
+            n * 3.0 * sizeof(float), measure([&]() {
+                memcpy(M, M_copy, n * sizeof(float));
+                gradMagNorm(M, S, h, w, 0.005f);
+            }) - restore_ns, measure([&]() {
+                cv::divide(mag, norm_mat + 0.005f, norm_ref);
+            }) });
+    memcpy(M, M_copy, n * sizeof(float));
+
+    for (int shrink : { 2, 4 }) {
+        int hb = h / shrink, wb = w / shrink;
+        int h0 = hb * shrink, nb = hb * wb;
+
+        // gradQuantize, 逐列调用
+        int *O0 = (int *) aligned_alloc(16, h * sizeof(int));
+        int *O1 = (int *) aligned_alloc(16, h * sizeof(int));
+        float *M0 = alignedFloats(h), *M1 = alignedFloats(h);
+        results.push_back( { "gradQuantize", size, shrink, (double) n,
+                n * 6.0 * sizeof(float), measure([&]() {
+                    for (int x = 0; x < w; x++) {
+                        gradQuantize(O + x * h, M + x * h, O0, O1, M0, M1, nb,
+                                h0, 1.0f / shrink / shrink, 6, false);
+                    }
+                }), measure([&]() {
+                    for (int x = 0; x < w; x++) {
+                        gradQuantizeScalar(O + x * h, M + x * h, O0, O1, M0,
+                                M1, nb, h0, 1.0f / shrink / shrink, 6);
+                    }
+                }) });
+        free(O0);
+        free(O1);
+        free(M0);
+        free(M1);
+
+        // gradHist, bin等于shrink, 6个方向
+        float *H = alignedFloats(nb * 6);
+        results.push_back( { "gradHist", size, shrink, (double) n,
+                n * 2.0 * sizeof(float) + nb * 6.0 * sizeof(float),
+                measure([&]() {
+                    memset(H, 0, nb * 6 * sizeof(float));
+                    gradHist(M, O, H, h, w, shrink, 6, false);
+                }), measure([&]() {
+                    memset(H, 0, nb * 6 * sizeof(float));
+                    gradHistScalar(M, O, H, h, w, shrink, 6);
+                }) });
+
+        // convTri1, shrink后的单个通道
+        float *C = alignedFloats(nb), *C_out = alignedFloats(nb);
+        for (int i = 0; i < nb; i++) {
+            C[i] = H[i];
+        }
+        cv::Mat chn(wb, hb, CV_32FC1, C), chn_ref;
+        // [1 2 1] / 4, 即半径为1的三角滤波
+        cv::Mat tri1 = triangleKernel(1);
+        results.push_back( { "convTri1(p=2)", size, shrink, (double) nb,
+                nb * 2.0 * sizeof(float), measure([&]() {
+                    convTri1(C, C_out, hb, wb, 1, 2, 1);
+                }), measure([&]() {
+                    cv::sepFilter2D(chn, chn_ref, CV_32F, tri1, tri1);
+                }) });
+        free(H);
+        free(C);
+        free(C_out);
+    }
+
+    free(rgb);
+    free(luv);
+    free(M);
+    free(O);
+    free(S);
+    free(M_copy);
+    return results;
+}
+
+int main(int argc, char **argv) {
+    std::string json_file;
+    std::string image_file;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--json" && i + 1 < argc) {
+            json_file = argv[++i];
+        } else if (arg == "--min-time" && i + 1 < argc) {
+            min_time_ms = std::stod(argv[++i]);
+        } else {
+            image_file = arg;
+        }
+    }
+
+    cv::Mat source;
+    if (!image_file.empty()) {
+        source = cv::imread(image_file, cv::IMREAD_COLOR);
+        if (source.empty()) {
+            std::cout << "Failed to read " << image_file << std::endl;
+            return 1;
+        }
+    } else {
+        source = cv::Mat(1080, 1920, CV_8UC3);
+        cv::theRNG().state = 12345;
+        cv::randu(source, cv::Scalar::all(0), cv::Scalar::all(255));
+    }
+
+    std::vector<BenchResult> results;
+    for (cv::Size size : { cv::Size(320, 240), cv::Size(640, 480), cv::Size(
+            960, 720), cv::Size(1280, 720), cv::Size(1920, 1080) }) {
+        std::vector<BenchResult> r = benchSize(source, size);
+        results.insert(results.end(), r.begin(), r.end());
+    }
+
+    std::cout << std::setw(16) << std::left << "kernel" << std::right
+            << std::setw(11) << "size" << std::setw(7) << "shrink"
+            << std::setw(10) << "us" << std::setw(10) << "Mpix/s"
+            << std::setw(10) << "MB/s" << std::setw(10) << "ref us"
+            << std::setw(9) << "speedup" << std::endl;
+    std::cout << std::fixed << std::setprecision(1);
+    for (const BenchResult &r : results) {
+        std::stringstream size;
+        size << r.size.width << "x" << r.size.height;
+        std::cout << std::setw(16) << std::left << r.kernel << std::right
+                << std::setw(11) << size.str() << std::setw(7) << r.shrink
+                << std::setw(10) << r.ns / 1e3
+                << std::setw(10) << r.pixels / r.ns * 1e3
+                << std::setw(10) << r.bytes / r.ns * 1e3
+                << std::setw(10) << r.ref_ns / 1e3
+                << std::setw(9) << r.ref_ns / r.ns << std::endl;
+    }
+
+    if (!json_file.empty()) {
+        std::ofstream out(json_file);
+        out << "[" << std::endl;
+        for (size_t i = 0; i < results.size(); i++) {
+            const BenchResult &r = results[i];
+            out << "  {\"kernel\": \"" << r.kernel << "\", \"width\": "
+                    << r.size.width << ", \"height\": " << r.size.height
+                    << ", \"shrink\": " << r.shrink << ", \"ns\": " << r.ns
+                    << ", \"pixels_per_s\": " << r.pixels / r.ns * 1e9
+                    << ", \"bytes_per_s\": " << r.bytes / r.ns * 1e9
+                    << ", \"ref_ns\": " << r.ref_ns << "}"
+                    << (i + 1 < results.size() ? "," : "") << std::endl;
+        }
+        out << "]" << std::endl;
+        if (!out) {
+            std::cout << "Failed to write " << json_file << std::endl;
+            return 1;
+        }
+        std::cout << "Results saved to " << json_file << std::endl;
+    }
+    return 0;
+}